@@ -0,0 +1,196 @@
+/*************************************************************************************************
+ *  Arena.h
+ *  Bump allocator for per-query scratch memory.
+ *
+ *  Memory comes from a list of chunks and is handed out by bumping a pointer, so allocating is a
+ *  few instructions and nothing is freed one by one. arena_reset() releases everything a query
+ *  allocated in one shot (keeping the first chunk around for the next query), arena_save() and
+ *  arena_restore() release everything allocated since a point, for scratch space inside a step.
+ *  An arena is not thread-safe, every thread allocates from its own.
+ **************************************************************************************************/
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Stats.h"
+
+#define ARENA_CHUNK_SIZE (1 << 20)  // bytes per chunk (bigger allocations get a chunk of their own)
+#define ARENA_ALIGN 64              // every allocation is cache line aligned
+
+typedef struct arena_chunk
+{
+	struct arena_chunk* next;
+	size_t size;
+	size_t used;
+	unsigned char* data;
+} arena_chunk;
+
+typedef struct
+{
+	arena_chunk* first;
+	arena_chunk* current;
+	size_t chunk_size;
+} arena;
+
+// a point to go back to
+typedef struct
+{
+	arena_chunk* chunk;
+	size_t used;
+} arena_mark;
+
+/*
+ *  arena_init
+ *  Starts an empty arena (nothing is allocated until it's used)
+ */
+void arena_init(arena* a, size_t chunk_size)
+{
+	a->first = NULL;
+	a->current = NULL;
+	a->chunk_size = (chunk_size > 0) ? chunk_size : ARENA_CHUNK_SIZE;
+}
+
+/*
+ *  arena_new_chunk
+ *  Allocates a chunk with room for at least `size` bytes
+ */
+arena_chunk* arena_new_chunk(size_t size)
+{
+	arena_chunk* chunk = malloc(sizeof(arena_chunk));
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->data = aligned_alloc(ARENA_ALIGN, (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+	return chunk;
+}
+
+/*
+ *  arena_alloc
+ *  Allocates `size` bytes (uninitialized)
+ */
+void* arena_alloc(arena* a, size_t size)
+{
+	STATS_ADD(COUNTER_ALLOCATIONS, 1);
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size == 0)
+		size = ARENA_ALIGN;
+	if (a->current == NULL)
+	{
+		a->first = a->current = arena_new_chunk((size > a->chunk_size) ? size : a->chunk_size);
+	}
+	else
+	{
+		// move on to a spare chunk that fits or put a new one after the current one
+		while (a->current->used + size > a->current->size)
+		{
+			arena_chunk* next = a->current->next;
+			if (next != NULL && next->size >= size)
+			{
+				next->used = 0;
+				a->current = next;
+				break;
+			}
+			arena_chunk* chunk = arena_new_chunk((size > a->chunk_size) ? size : a->chunk_size);
+			chunk->next = next;
+			a->current->next = chunk;
+			a->current = chunk;
+		}
+	}
+	void* p = a->current->data + a->current->used;
+	a->current->used += size;
+	return p;
+}
+
+/*
+ *  arena_calloc
+ *  Allocates `count` zeroed elements of `size` bytes
+ */
+void* arena_calloc(arena* a, size_t count, size_t size)
+{
+	void* p = arena_alloc(a, count * size);
+	memset(p, 0, count * size);
+	return p;
+}
+
+/*
+ *  arena_strdup
+ *  Copies a string into the arena
+ */
+char* arena_strdup(arena* a, const char* s)
+{
+	size_t len = strlen(s) + 1;
+	char* p = arena_alloc(a, len);
+	memcpy(p, s, len);
+	return p;
+}
+
+/*
+ *  arena_save
+ *  Remembers the current point of the arena
+ */
+arena_mark arena_save(arena* a)
+{
+	arena_mark mark;
+	mark.chunk = a->current;
+	mark.used = (a->current != NULL) ? a->current->used : 0;
+	return mark;
+}
+
+/*
+ *  arena_restore
+ *  Releases everything allocated since `mark` (later chunks are kept as spares)
+ */
+void arena_restore(arena* a, arena_mark mark)
+{
+	if (mark.chunk == NULL)
+	{
+		if (a->first != NULL)
+			a->first->used = 0;
+		a->current = a->first;
+		return;
+	}
+	a->current = mark.chunk;
+	a->current->used = mark.used;
+}
+
+/*
+ *  arena_reset
+ *  Releases everything, keeping the first chunk for next time
+ */
+void arena_reset(arena* a)
+{
+	if (a->first == NULL)
+		return;
+	arena_chunk* chunk = a->first->next;
+	while (chunk != NULL)
+	{
+		arena_chunk* next = chunk->next;
+		free(chunk->data);
+		free(chunk);
+		chunk = next;
+	}
+	a->first->next = NULL;
+	a->first->used = 0;
+	a->current = a->first;
+}
+
+/*
+ *  arena_free
+ *  Gives all of the arena's memory back
+ */
+void arena_free(arena* a)
+{
+	arena_reset(a);
+	if (a->first != NULL)
+	{
+		free(a->first->data);
+		free(a->first);
+	}
+	a->first = NULL;
+	a->current = NULL;
+}
+
+#endif
+/* ARENA_H */
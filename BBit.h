@@ -0,0 +1,152 @@
+/*************************************************************************************************
+ *  BBit.h
+ *  b-bit minwise hashing: signatures that keep only the lowest b bits (1, 2, 4 or 8) of every
+ *  minimum, packed 64 / b to a word.
+ *
+ *  Slot i of a packed signature is bits (i * b) % 64 and up of word i * b / 64 (b divides 64, so
+ *  a slot never straddles two words, and the unused slots of the last word are zero). Two slots
+ *  are compared with XOR / popcount a word at a time. The lowest b bits of two minimums match
+ *  when the minimums do (with probability R, the resemblance) and by chance 1 / 2^b of the time
+ *  when they don't, so the fraction P of matching slots is turned back into an estimate of R with
+ *
+ *      R = (P - 2^-b) / (1 - 2^-b)
+ *
+ *  which is Li and Koenig's correction for sets that are tiny next to the 2^64 hash space.
+ **************************************************************************************************/
+#ifndef BBIT_H
+#define BBIT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define BBIT_X86 1
+#endif
+
+#define BBIT_FULL 64                // bits of a minimum that isn't cut down
+
+/*
+ *  bbit_valid
+ *  Whether signatures can keep `bits` bits of every minimum
+ */
+bool bbit_valid(int bits)
+{
+	return bits == 1 || bits == 2 || bits == 4 || bits == 8 || bits == BBIT_FULL;
+}
+
+/*
+ *  bbit_words
+ *  64-bit words taken up by a signature of `permutations` slots of `bits` bits
+ */
+int bbit_words(int permutations, int bits)
+{
+	return (int)(((int64_t)permutations * bits + 63) / 64);
+}
+
+/*
+ *  bbit_pack
+ *  Keeps the lowest `bits` bits of every minimum of a signature, packing them in place into its
+ *  first bbit_words() words
+ */
+void bbit_pack(uint64_t* signature, int permutations, int bits)
+{
+	if (bits == BBIT_FULL)
+		return;
+	int per_word = 64 / bits;
+	uint64_t mask = (1ULL << bits) - 1;
+
+	// word w only reads slots from w on, so nothing is overwritten before it's read
+	for (int w = 0, first = 0; first < permutations; w++, first += per_word)
+	{
+		uint64_t word = 0;
+		for (int k = 0; k < per_word && first + k < permutations; k++)
+			word |= (signature[first + k] & mask) << (k * bits);
+		signature[w] = word;
+	}
+}
+
+/*
+ *  bbit_matches_scalar
+ *  Number of matching slots in `words` words of two packed signatures (unused slots at the end
+ *  of the last word count as matching)
+ */
+size_t bbit_matches_scalar(const uint64_t* a, const uint64_t* b, int words, int bits)
+{
+	uint64_t lowest = UINT64_MAX / ((1ULL << bits) - 1);    // the lowest bit of every slot
+	size_t count = 0;
+	for (int w = 0; w < words; w++)
+	{
+		// a slot matches when all of its bits do, folded down into its lowest bit
+		uint64_t same = ~(a[w] ^ b[w]);
+		for (int shift = 1; shift < bits; shift <<= 1)
+			same &= same >> shift;
+		count += __builtin_popcountll(same & lowest);
+	}
+	return count;
+}
+
+#ifdef BBIT_X86
+/*
+ *  bbit_matches_popcnt
+ *  Same as the scalar kernel, with the popcnt instruction
+ */
+__attribute__((target("popcnt")))
+size_t bbit_matches_popcnt(const uint64_t* a, const uint64_t* b, int words, int bits)
+{
+	uint64_t lowest = UINT64_MAX / ((1ULL << bits) - 1);
+	size_t count = 0;
+	for (int w = 0; w < words; w++)
+	{
+		uint64_t same = ~(a[w] ^ b[w]);
+		for (int shift = 1; shift < bits; shift <<= 1)
+			same &= same >> shift;
+		count += __builtin_popcountll(same & lowest);
+	}
+	return count;
+}
+#endif
+
+/*
+ *  bbit_matches
+ *  Number of matching slots in `words` words of two packed signatures (fastest kernel available,
+ *  set BBIT_KERNEL=scalar in the environment to force the fallback)
+ */
+size_t bbit_matches(const uint64_t* a, const uint64_t* b, int words, int bits)
+{
+	// picked on the first call, workers may race to pick it but they all pick the same
+	static int use_popcnt = -1;
+	int picked = __atomic_load_n(&use_popcnt, __ATOMIC_RELAXED);
+	if (picked < 0)
+	{
+		const char* forced = getenv("BBIT_KERNEL");
+		picked = 0;
+#ifdef BBIT_X86
+		picked = !(forced != NULL && strcmp(forced, "scalar") == 0) && __builtin_cpu_supports("popcnt");
+#endif
+		(void)forced;
+		__atomic_store_n(&use_popcnt, picked, __ATOMIC_RELAXED);
+	}
+#ifdef BBIT_X86
+	if (picked)
+		return bbit_matches_popcnt(a, b, words, bits);
+#endif
+	return bbit_matches_scalar(a, b, words, bits);
+}
+
+/*
+ *  bbit_resemblance
+ *  Estimated resemblance from the matching slots of a whole signature (unused slots included)
+ */
+float bbit_resemblance(size_t matches, int permutations, int bits)
+{
+	int padding = bbit_words(permutations, bits) * (64 / bits) - permutations;
+	double chance = 1.0 / (double)(1 << bits);
+	double estimate = ((double)(matches - padding) / permutations - chance) / (1.0 - chance);
+	if (estimate < 0)
+		return 0;
+	return (estimate > 1) ? 1 : (float)estimate;
+}
+
+#endif
+/* BBIT_H */
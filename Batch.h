@@ -0,0 +1,211 @@
+/*************************************************************************************************
+ *  Batch.h
+ *  Query records and result records of batch mode.
+ *
+ *  A batch is a text file of queries, one per line: a command followed by its arguments,
+ *  separated by whitespace (blank lines and lines starting with `#` are skipped), e.g.
+ *
+ *      pair lorem_a.txt lorem_b.txt
+ *      all lorem_a.txt
+ *      top lorem_a.txt 10
+ *      runs lorem_a.txt lorem_b.txt
+ *      add lorem_h.txt
+ *      remove lorem_h.txt
+ *      stats
+ *
+ *  Every result comes out as one record, either a JSON object per line (JSON Lines) or a CSV row
+ *  under a fixed header, with the time the query took.
+ **************************************************************************************************/
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define BATCH_MAX_ARGS 8
+
+// output formats
+#define BATCH_JSONL 1
+#define BATCH_CSV 2
+
+// one result of a query (fields that don't apply to a query are left out of its JSON records)
+typedef struct
+{
+	const char* query;          // the command
+	const char* file_1;
+	const char* file_2;         // the other file (the match of a one-vs-all query)
+	int rank;                   // position of a one-vs-all match (0 if it doesn't apply)
+	double similarity;          // estimated resemblance (the mean of a multi-run query)
+	double exact;               // exact Jaccard similarity (negative if it wasn't computed)
+	bool has_stats;             // stddev, ci_low and ci_high are set (multi-run queries)
+	double stddev;
+	double ci_low;
+	double ci_high;
+	double ms;                  // time the whole query took
+	const char* error;          // NULL on success, then only query, files and ms are meaningful
+	bool status_only;           // a change to the database, nothing but success or an error to report
+} batch_record;
+
+/*
+ *  batch_record_init
+ *  Starts a record of a query, with nothing computed yet
+ */
+void batch_record_init(batch_record* record, const char* query)
+{
+	memset(record, 0, sizeof(*record));
+	record->query = query;
+	record->exact = -1;
+}
+
+/*
+ *  batch_now_ms
+ *  Monotonic clock in milliseconds
+ */
+double batch_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ *  batch_parse
+ *  Splits a query line into its words in place, returns how many there are (0 for a line with
+ *  no query)
+ */
+int batch_parse(char* line, char** args, int max_args)
+{
+	int num_args = 0;
+	char* location;
+	for (char* word = strtok_r(line, " \t\r\n", &location); word != NULL && num_args < max_args;
+	     word = strtok_r(NULL, " \t\r\n", &location))
+	{
+		if (num_args == 0 && word[0] == '#')
+			return 0;
+		args[num_args++] = word;
+	}
+	return num_args;
+}
+
+/*
+ *  batch_json_string
+ *  Writes a JSON string (or null)
+ */
+void batch_json_string(FILE* out, const char* s)
+{
+	if (s == NULL)
+	{
+		fputs("null", out);
+		return;
+	}
+	fputc('"', out);
+	for (; *s != '\0'; s++)
+	{
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+/*
+ *  batch_csv_field
+ *  Writes a CSV field, quoted when it has to be
+ */
+void batch_csv_field(FILE* out, const char* s)
+{
+	if (s == NULL)
+		return;
+	if (strpbrk(s, ",\"\r\n") == NULL)
+	{
+		fputs(s, out);
+		return;
+	}
+	fputc('"', out);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"')
+			fputc('"', out);
+		fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+/*
+ *  batch_begin
+ *  Writes whatever comes before the first record
+ */
+void batch_begin(FILE* out, int format)
+{
+	if (format == BATCH_CSV)
+		fputs("query,file_1,file_2,rank,similarity,exact,stddev,ci_low,ci_high,ms,error\n", out);
+}
+
+/*
+ *  batch_emit
+ *  Writes one record
+ */
+void batch_emit(FILE* out, int format, const batch_record* record)
+{
+	bool ok = record->error == NULL && !record->status_only;
+	if (format == BATCH_CSV)
+	{
+		batch_csv_field(out, record->query);
+		fputc(',', out);
+		batch_csv_field(out, record->file_1);
+		fputc(',', out);
+		batch_csv_field(out, record->file_2);
+		fputc(',', out);
+		if (ok && record->rank > 0)
+			fprintf(out, "%d", record->rank);
+		fputc(',', out);
+		if (ok)
+			fprintf(out, "%.4f", record->similarity);
+		fputc(',', out);
+		if (ok && record->exact >= 0)
+			fprintf(out, "%.4f", record->exact);
+		fputc(',', out);
+		if (ok && record->has_stats)
+			fprintf(out, "%.4f,%.4f,%.4f", record->stddev, record->ci_low, record->ci_high);
+		else
+			fputs(",,", out);
+		fprintf(out, ",%.3f,", record->ms);
+		batch_csv_field(out, record->error);
+		fputc('\n', out);
+		return;
+	}
+
+	fputs("{\"query\":", out);
+	batch_json_string(out, record->query);
+	fputs(",\"file_1\":", out);
+	batch_json_string(out, record->file_1);
+	fputs(",\"file_2\":", out);
+	batch_json_string(out, record->file_2);
+	if (ok)
+	{
+		if (record->rank > 0)
+			fprintf(out, ",\"rank\":%d", record->rank);
+		fprintf(out, ",\"similarity\":%.4f", record->similarity);
+		if (record->exact >= 0)
+			fprintf(out, ",\"exact\":%.4f", record->exact);
+		if (record->has_stats)
+			fprintf(out, ",\"stddev\":%.4f,\"ci_low\":%.4f,\"ci_high\":%.4f", record->stddev,
+			        record->ci_low, record->ci_high);
+	}
+	fprintf(out, ",\"ms\":%.3f", record->ms);
+	if (record->error != NULL)
+	{
+		fputs(",\"error\":", out);
+		batch_json_string(out, record->error);
+	}
+	fputs("}\n", out);
+}
+
+#endif
+/* BATCH_H */
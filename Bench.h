@@ -0,0 +1,199 @@
+/*************************************************************************************************
+ *  Bench.h
+ *  Timing and result records of the benchmark suite.
+ *
+ *  A benchmark is a function that does some fixed amount of work and returns how many operations
+ *  (words, shingles, signatures, ...) that was. It's called over and over until a trial takes
+ *  at least BENCH_TRIAL_MS, BENCH_TRIALS trials are timed and the median time per operation is
+ *  reported, which keeps one slow trial (a page fault, another process) out of the numbers.
+ *
+ *  Results come out one record per line, as JSON Lines or as CSV under a fixed header, in the
+ *  same order every run. The first record (bench "config") has BENCH_VERSION and the parameters
+ *  the numbers depend on, and the fields of a record only ever get added to the end, so files
+ *  from different releases can be diffed or joined on (bench, words, docs, edits).
+ **************************************************************************************************/
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "Batch.h"
+
+#define BENCH_VERSION 1             // bumped when a benchmark changes what it measures
+#define BENCH_TRIAL_MS 50           // shortest a timed trial can be
+#define BENCH_TRIALS 5              // timed trials of every benchmark (the median is reported)
+#define BENCH_EDIT_STEPS 5          // accuracy is checked at 0, 1, ..., BENCH_EDIT_STEPS times --edits edits
+
+// does one round of a benchmark, returns the number of operations it did
+typedef long (*bench_fn)(void* ctx);
+
+// one result of the benchmark suite (fields that don't apply are left out of its JSON records)
+typedef struct
+{
+	const char* bench;          // what was measured
+	const char* unit;           // what one operation is
+	long words;                 // words per document (0 if it doesn't apply)
+	long docs;                  // documents in the database (0 if it doesn't apply)
+	long edits;                 // words changed between the two documents (-1 if it doesn't apply)
+	long ops;                   // operations timed over all trials
+	double ns_per_op;           // median time per operation (negative for accuracy records)
+	double mb_per_s;            // median throughput over the document text or signatures (0 if it doesn't apply)
+	double similarity;          // estimated resemblance (negative if it doesn't apply)
+	double exact;               // exact Jaccard similarity (negative if it doesn't apply)
+} bench_record;
+
+/*
+ *  bench_record_init
+ *  Starts a record of a benchmark, with nothing measured yet
+ */
+void bench_record_init(bench_record* record, const char* bench, const char* unit)
+{
+	memset(record, 0, sizeof(*record));
+	record->bench = bench;
+	record->unit = unit;
+	record->edits = -1;
+	record->ns_per_op = -1;
+	record->similarity = -1;
+	record->exact = -1;
+}
+
+/*
+ *  bench_double_cmp
+ *  Orders doubles smallest first
+ */
+int bench_double_cmp(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ *  bench_measure
+ *  Times a benchmark, filling in the record's ops and ns_per_op (and mb_per_s when `bytes`, the
+ *  text one round goes over, isn't 0)
+ */
+void bench_measure(bench_record* record, bench_fn fn, void* ctx, size_t bytes)
+{
+	// warm up and find how many rounds fill a trial
+	long rounds = 1;
+	for (;;)
+	{
+		double start = batch_now_ms();
+		for (long i = 0; i < rounds; i++)
+			fn(ctx);
+		if (batch_now_ms() - start >= BENCH_TRIAL_MS || rounds >= (1L << 30))
+			break;
+		rounds *= 2;
+	}
+
+	// time the trials
+	double per_op[BENCH_TRIALS];
+	double per_round[BENCH_TRIALS];
+	record->ops = 0;
+	for (int t = 0; t < BENCH_TRIALS; t++)
+	{
+		long ops = 0;
+		double start = batch_now_ms();
+		for (long i = 0; i < rounds; i++)
+			ops += fn(ctx);
+		double ms = batch_now_ms() - start;
+		per_op[t] = (ops > 0) ? ms * 1e6 / ops : 0;
+		per_round[t] = ms / rounds;
+		record->ops += ops;
+	}
+	qsort(per_op, BENCH_TRIALS, sizeof(double), bench_double_cmp);
+	qsort(per_round, BENCH_TRIALS, sizeof(double), bench_double_cmp);
+	record->ns_per_op = per_op[BENCH_TRIALS / 2];
+	if (bytes > 0 && per_round[BENCH_TRIALS / 2] > 0)
+		record->mb_per_s = bytes / (per_round[BENCH_TRIALS / 2] * 1e3);
+}
+
+/*
+ *  bench_begin
+ *  Writes whatever comes before the first record
+ */
+void bench_begin(FILE* out, int format)
+{
+	if (format == BATCH_CSV)
+		fputs("bench,unit,words,docs,edits,ops,ns_per_op,mb_per_s,similarity,exact\n", out);
+}
+
+/*
+ *  bench_config
+ *  Writes the record with the version of the suite and the parameters the numbers depend on
+ *  (`stats` is whether the pipeline was built with its instrumentation, see Stats.h)
+ */
+void bench_config(FILE* out, int format, int permutations, int shingle_length, const char* engine, int bits,
+                  int threads, int stats)
+{
+	if (format == BATCH_CSV)
+	{
+		// the parameters go in the unit field, as key=value pairs
+		fprintf(out, "config,version=%d permutations=%d shingle_length=%d engine=%s bits=%d threads=%d stats=%d,,,,,,,,\n",
+		        BENCH_VERSION, permutations, shingle_length, engine, bits, threads, stats);
+		return;
+	}
+	fprintf(out, "{\"bench\":\"config\",\"version\":%d,\"permutations\":%d,\"shingle_length\":%d,\"engine\":",
+	        BENCH_VERSION, permutations, shingle_length);
+	batch_json_string(out, engine);
+	fprintf(out, ",\"bits\":%d,\"threads\":%d,\"stats\":%d}\n", bits, threads, stats);
+}
+
+/*
+ *  bench_emit
+ *  Writes one record
+ */
+void bench_emit(FILE* out, int format, const bench_record* record)
+{
+	if (format == BATCH_CSV)
+	{
+		batch_csv_field(out, record->bench);
+		fputc(',', out);
+		batch_csv_field(out, record->unit);
+		fprintf(out, ",%ld,%ld,", record->words, record->docs);
+		if (record->edits >= 0)
+			fprintf(out, "%ld", record->edits);
+		fprintf(out, ",%ld,", record->ops);
+		if (record->ns_per_op >= 0)
+			fprintf(out, "%.2f", record->ns_per_op);
+		fputc(',', out);
+		if (record->mb_per_s > 0)
+			fprintf(out, "%.2f", record->mb_per_s);
+		fputc(',', out);
+		if (record->similarity >= 0)
+			fprintf(out, "%.4f", record->similarity);
+		fputc(',', out);
+		if (record->exact >= 0)
+			fprintf(out, "%.4f", record->exact);
+		fputc('\n', out);
+		fflush(out);
+		return;
+	}
+
+	fputs("{\"bench\":", out);
+	batch_json_string(out, record->bench);
+	fputs(",\"unit\":", out);
+	batch_json_string(out, record->unit);
+	fprintf(out, ",\"words\":%ld", record->words);
+	if (record->docs > 0)
+		fprintf(out, ",\"docs\":%ld", record->docs);
+	if (record->edits >= 0)
+		fprintf(out, ",\"edits\":%ld", record->edits);
+	fprintf(out, ",\"ops\":%ld", record->ops);
+	if (record->ns_per_op >= 0)
+		fprintf(out, ",\"ns_per_op\":%.2f", record->ns_per_op);
+	if (record->mb_per_s > 0)
+		fprintf(out, ",\"mb_per_s\":%.2f", record->mb_per_s);
+	if (record->similarity >= 0)
+		fprintf(out, ",\"similarity\":%.4f", record->similarity);
+	if (record->exact >= 0)
+		fprintf(out, ",\"exact\":%.4f", record->exact);
+	fputs("}\n", out);
+	fflush(out);
+}
+
+#endif
+/* BENCH_H */
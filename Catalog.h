@@ -0,0 +1,600 @@
+/*************************************************************************************************
+ *  Catalog.h
+ *  The documents of the database, kept in a binary manifest.
+ *
+ *  init.txt lists the documents by name, one per line. The catalog gives every one of them a
+ *  dense id and keeps its path (`db/<name>`), size, modification time and a hash of its contents.
+ *  It's written to `catalog.db` when init.txt changes and memory-mapped by every other run, so
+ *  starting up costs one stat of init.txt instead of reading it and every document again (the
+ *  size and modification time of the init.txt it was built from are kept in the header).
+ *
+ *  File layout (all integers little-endian, native width):
+ *  - catalog_header (64 bytes)
+ *  - `capacity` catalog_entry slots (32 bytes each), the first `count` of them in use
+ *  - the paths of the entries, NUL-terminated, `paths_len` bytes
+ *
+ *  Like the signature store, a document added at run time is appended (into the next free slot,
+ *  its path after the others) and a removed one is flagged deleted, so ids only change when the
+ *  catalog is rebuilt. When the slots run out the file is rewritten with twice as many. Names
+ *  are looked up through an in-memory hash table of ids, built the first time it's needed.
+ **************************************************************************************************/
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MurmurHash2.h"
+#include "Tokenizer.h"
+
+#define CATALOG_PATH "catalog.db"
+#define CATALOG_LIST "init.txt"
+#define CATALOG_DIR "db"
+#define CATALOG_MAGIC "PDCATLG"
+#define CATALOG_VERSION 1
+#define CATALOG_SEED 0x9E3779B97F4A7C15ULL  // seed of the content and name hashes
+#define CATALOG_FLAG_MISSING 1      // the document couldn't be read when it was catalogued
+#define CATALOG_FLAG_DELETED 2      // removed, or replaced by a later entry
+#define CATALOG_HASH_CHUNK (1L << 30)   // documents are hashed a chunk at a time (MurmurHash64A takes an int)
+
+// file header
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t deleted;               // entries flagged deleted
+	uint64_t count;                 // entries in use
+	uint64_t capacity;              // entry slots
+	uint64_t paths_len;             // bytes of paths
+	int64_t list_mtime;             // modification time of the init.txt the catalog matches (ns)
+	int64_t list_size;              // and its size
+	uint64_t store_generation;      // generation of the signature store last brought up to date with it
+} catalog_header;
+
+// one document
+typedef struct
+{
+	uint64_t hash;                  // hash of the contents (0 if it couldn't be read)
+	int64_t mtime;                  // modification time (ns)
+	int64_t size;
+	uint32_t path;                  // offset of the path among the paths
+	uint16_t path_len;
+	uint8_t name;                   // where the name starts in the path
+	uint8_t flags;
+} catalog_entry;
+
+// an open (memory-mapped) catalog
+typedef struct
+{
+	int fd;
+	unsigned char* map;
+	size_t map_len;
+	catalog_header* header;
+	int* slots;                     // ids by hash of their name (-1 is empty), NULL until the first lookup
+	size_t num_slots;               // a power of 2
+	pthread_mutex_t lock;           // held while the slots are built
+} doc_catalog;
+
+/*
+ *  catalog_init
+ *  Starts a catalog that isn't open
+ */
+void catalog_init(doc_catalog* cat)
+{
+	memset(cat, 0, sizeof(*cat));
+	cat->fd = -1;
+	pthread_mutex_init(&cat->lock, NULL);
+}
+
+/*
+ *  catalog_stat_ns
+ *  Modification time of a stat in nanoseconds
+ */
+int64_t catalog_stat_ns(const struct stat* st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/*
+ *  catalog_map
+ *  Memory-maps a catalog file, returns 0 on success and -1 if it's missing or unusable
+ */
+int catalog_map(doc_catalog* cat, const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(catalog_header))
+	{
+		close(fd);
+		return -1;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+
+	// validate the header before trusting anything in it
+	catalog_header* header = map;
+	size_t expected = sizeof(catalog_header) + header->capacity * sizeof(catalog_entry) + header->paths_len;
+	if (memcmp(header->magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0 ||
+		header->version != CATALOG_VERSION ||
+		header->count > header->capacity ||
+		expected > (size_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		close(fd);
+		return -1;
+	}
+	cat->fd = fd;
+	cat->map = map;
+	cat->map_len = st.st_size;
+	cat->header = header;
+	return 0;
+}
+
+/*
+ *  catalog_unmap
+ *  Unmaps a catalog, keeping its name lookups
+ */
+void catalog_unmap(doc_catalog* cat)
+{
+	if (cat->map != NULL)
+	{
+		munmap(cat->map, cat->map_len);
+		close(cat->fd);
+	}
+	cat->fd = -1;
+	cat->map = NULL;
+	cat->map_len = 0;
+	cat->header = NULL;
+}
+
+/*
+ *  catalog_forget
+ *  Drops the name lookups (they're built again on the next lookup)
+ */
+void catalog_forget(doc_catalog* cat)
+{
+	free(cat->slots);
+	cat->slots = NULL;
+	cat->num_slots = 0;
+}
+
+/*
+ *  catalog_open
+ *  Opens the catalog at `path`, returns 0 on success and -1 if it's missing or unusable
+ */
+int catalog_open(doc_catalog* cat, const char* path)
+{
+	catalog_unmap(cat);
+	catalog_forget(cat);
+	return catalog_map(cat, path);
+}
+
+/*
+ *  catalog_close
+ *  Closes a catalog (safe to call on one that was never opened)
+ */
+void catalog_close(doc_catalog* cat)
+{
+	catalog_unmap(cat);
+	catalog_forget(cat);
+}
+
+/*
+ *  catalog_count
+ *  Number of entries, deleted ones included (ids go from 0 to this)
+ */
+int catalog_count(const doc_catalog* cat)
+{
+	return (cat->header == NULL) ? 0 : (int)cat->header->count;
+}
+
+/*
+ *  catalog_live_count
+ *  Number of documents in the catalog
+ */
+int catalog_live_count(const doc_catalog* cat)
+{
+	return (cat->header == NULL) ? 0 : (int)(cat->header->count - cat->header->deleted);
+}
+
+/*
+ *  catalog_get
+ *  Returns the entry of a document
+ */
+catalog_entry* catalog_get(const doc_catalog* cat, int id)
+{
+	return (catalog_entry*)(cat->map + sizeof(catalog_header)) + id;
+}
+
+/*
+ *  catalog_path
+ *  Returns the path of a document
+ */
+const char* catalog_path(const doc_catalog* cat, int id)
+{
+	const char* paths = (const char*)(cat->map + sizeof(catalog_header) + cat->header->capacity * sizeof(catalog_entry));
+	return paths + catalog_get(cat, id)->path;
+}
+
+/*
+ *  catalog_name
+ *  Returns the name of a document (as it's listed in init.txt)
+ */
+const char* catalog_name(const doc_catalog* cat, int id)
+{
+	return catalog_path(cat, id) + catalog_get(cat, id)->name;
+}
+
+/*
+ *  catalog_is_current
+ *  Whether a catalog was built from (or kept up to date with) the list at `list`
+ */
+bool catalog_is_current(const doc_catalog* cat, const char* list)
+{
+	struct stat st;
+	return cat->header != NULL && stat(list, &st) == 0 && cat->header->list_mtime == catalog_stat_ns(&st) &&
+	       cat->header->list_size == st.st_size;
+}
+
+/*
+ *  catalog_slot_add
+ *  Adds an id to name lookups of `num_slots` slots
+ */
+void catalog_slot_add(const doc_catalog* cat, int* slots, size_t num_slots, int id)
+{
+	const char* name = catalog_name(cat, id);
+	size_t mask = num_slots - 1;
+	size_t i = MurmurHash64A(name, strlen(name), CATALOG_SEED) & mask;
+	while (slots[i] >= 0)
+		i = (i + 1) & mask;
+	slots[i] = id;
+}
+
+/*
+ *  catalog_index
+ *  Builds the name lookups of every id, with at most half the slots used (num_slots is set last,
+ *  so a lookup that sees it sees the slots)
+ */
+void catalog_index(doc_catalog* cat)
+{
+	size_t num_slots = 64;
+	while (num_slots < 2 * (size_t)catalog_count(cat))
+		num_slots *= 2;
+	int* slots = malloc(num_slots * sizeof(int));
+	memset(slots, 0xFF, num_slots * sizeof(int));
+	for (int id = 0; id < catalog_count(cat); id++)
+		catalog_slot_add(cat, slots, num_slots, id);
+	free(cat->slots);
+	cat->slots = slots;
+	__atomic_store_n(&cat->num_slots, num_slots, __ATOMIC_RELEASE);
+}
+
+/*
+ *  catalog_find
+ *  Finds a (not deleted) document by name, returns its id or -1 (thread-safe while the catalog
+ *  doesn't change)
+ */
+int catalog_find(doc_catalog* cat, const char* name)
+{
+	if (cat->header == NULL)
+		return -1;
+	if (__atomic_load_n(&cat->num_slots, __ATOMIC_ACQUIRE) == 0)
+	{
+		pthread_mutex_lock(&cat->lock);
+		if (cat->num_slots == 0)
+			catalog_index(cat);
+		pthread_mutex_unlock(&cat->lock);
+	}
+
+	// probe until an empty slot, a replaced document leaves its old entry behind
+	size_t len = strlen(name);
+	size_t mask = cat->num_slots - 1;
+	for (size_t i = MurmurHash64A(name, len, CATALOG_SEED) & mask; cat->slots[i] >= 0; i = (i + 1) & mask)
+	{
+		int id = cat->slots[i];
+		catalog_entry* entry = catalog_get(cat, id);
+		if ((size_t)(entry->path_len - entry->name) == len && memcmp(catalog_name(cat, id), name, len) == 0 &&
+		    !(entry->flags & CATALOG_FLAG_DELETED))
+			return id;
+	}
+	return -1;
+}
+
+/*
+ *  catalog_hash_file
+ *  Hashes the contents of a file, filling in its stat, returns 0 on success or -1 if it can't
+ *  be read
+ */
+int catalog_hash_file(const char* path, uint64_t* hash, struct stat* st)
+{
+	doc_map doc;
+	if (doc_map_open(&doc, path) != 0)
+		return -1;
+	uint64_t h = CATALOG_SEED;
+	for (size_t done = 0; done < doc.size; done += CATALOG_HASH_CHUNK)
+	{
+		size_t len = (doc.size - done < CATALOG_HASH_CHUNK) ? doc.size - done : CATALOG_HASH_CHUNK;
+		h = MurmurHash64A(doc.data + done, len, h);
+	}
+	*hash = h;
+	*st = doc.st;
+	doc_map_close(&doc);
+	return 0;
+}
+
+/*
+ *  catalog_fill_entry
+ *  Fills in the entry of the document at `path` (a name of `name_len` bytes at its end), hashing
+ *  it unless `old` is an entry of the same file that's still current; returns -1 if the path is
+ *  too long
+ */
+int catalog_fill_entry(catalog_entry* entry, const char* path, size_t name_len, const catalog_entry* old)
+{
+	memset(entry, 0, sizeof(*entry));
+	size_t path_len = strlen(path);
+	if (path_len > UINT16_MAX || path_len - name_len > UINT8_MAX)
+		return -1;
+	entry->path_len = path_len;
+	entry->name = path_len - name_len;
+	struct stat st;
+	if (old != NULL && !(old->flags & (CATALOG_FLAG_MISSING | CATALOG_FLAG_DELETED)) && stat(path, &st) == 0 &&
+	    S_ISREG(st.st_mode) && catalog_stat_ns(&st) == old->mtime && st.st_size == old->size)
+		entry->hash = old->hash;
+	else if (catalog_hash_file(path, &entry->hash, &st) != 0)
+	{
+		entry->flags = CATALOG_FLAG_MISSING;
+		return 0;
+	}
+	entry->mtime = catalog_stat_ns(&st);
+	entry->size = st.st_size;
+	return 0;
+}
+
+/*
+ *  catalog_write
+ *  Writes a catalog of `count` entries and their paths to a temporary file, then atomically
+ *  replaces the one at `path`; returns 0 on success
+ */
+int catalog_write(const char* path, const catalog_header* header, const catalog_entry* entries, const char* paths)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE* fp = fopen(tmp, "wb");
+	if (fp == NULL)
+		return -1;
+
+	// the free slots are left as a hole
+	bool ok = fwrite(header, sizeof(*header), 1, fp) == 1 &&
+	          fwrite(entries, sizeof(catalog_entry), header->count, fp) == header->count &&
+	          fseek(fp, sizeof(*header) + header->capacity * sizeof(catalog_entry), SEEK_SET) == 0 &&
+	          fwrite(paths, 1, header->paths_len, fp) == header->paths_len;
+	if (fclose(fp) != 0 || !ok)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return rename(tmp, path);
+}
+
+/*
+ *  catalog_build
+ *  Catalogues every file listed in `list` (files of `dir`) into a new catalog at `path`, reusing
+ *  the hashes of `old` (which can be closed) for files that didn't change; returns 0 on success
+ *  and -1 if the list can't be read or a path is too long
+ */
+int catalog_build(const char* path, const char* list, const char* dir, doc_catalog* old)
+{
+	struct stat list_st;
+	FILE* in = fopen(list, "r");
+	if (in == NULL || fstat(fileno(in), &list_st) != 0)
+	{
+		if (in != NULL)
+			fclose(in);
+		return -1;
+	}
+
+	size_t capacity = 64;
+	catalog_entry* entries = malloc(capacity * sizeof(catalog_entry));
+	size_t paths_cap = 4096;
+	char* paths = malloc(paths_cap);
+	catalog_header header;
+	memset(&header, 0, sizeof(header));
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	int status = 0;
+	while ((len = getline(&line, &line_cap, in)) >= 0)
+	{
+		// only whole lines count
+		if (len == 0 || line[len - 1] != '\n')
+			break;
+		line[--len] = '\0';
+		if (header.count == capacity)
+		{
+			capacity *= 2;
+			entries = realloc(entries, capacity * sizeof(catalog_entry));
+		}
+		size_t path_size = strlen(dir) + len + 2;
+		if (header.paths_len + path_size > paths_cap)
+		{
+			while (header.paths_len + path_size > paths_cap)
+				paths_cap *= 2;
+			paths = realloc(paths, paths_cap);
+		}
+		char* file_path = paths + header.paths_len;
+		snprintf(file_path, path_size, "%s/%s", dir, line);
+
+		int previous = catalog_find(old, line);
+		catalog_entry* entry = &entries[header.count];
+		if (catalog_fill_entry(entry, file_path, len, (previous >= 0) ? catalog_get(old, previous) : NULL) != 0 ||
+		    header.paths_len + path_size > UINT32_MAX)
+		{
+			status = -1;
+			break;
+		}
+		entry->path = header.paths_len;
+		header.paths_len += path_size;
+		header.count++;
+	}
+	free(line);
+	fclose(in);
+
+	// room to add a quarter as many again before the file has to be rewritten
+	if (status == 0)
+	{
+		memcpy(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+		header.version = CATALOG_VERSION;
+		header.capacity = header.count + header.count / 4 + 64;
+		header.list_mtime = catalog_stat_ns(&list_st);
+		header.list_size = list_st.st_size;
+		status = catalog_write(path, &header, entries, paths);
+	}
+	free(entries);
+	free(paths);
+	return status;
+}
+
+/*
+ *  catalog_grow
+ *  Rewrites a catalog with twice as many slots and opens it again, returns 0 on success
+ */
+int catalog_grow(doc_catalog* cat, const char* path)
+{
+	catalog_header header = *cat->header;
+	header.capacity *= 2;
+	const char* paths = (const char*)(cat->map + sizeof(catalog_header) + cat->header->capacity * sizeof(catalog_entry));
+	if (catalog_write(path, &header, catalog_get(cat, 0), paths) != 0)
+		return -1;
+	catalog_unmap(cat);
+	return catalog_map(cat, path);
+}
+
+/*
+ *  catalog_append
+ *  Adds the document `name` of `dir` to the end of the catalog at `path` and maps it again,
+ *  returns its id or -1 on error
+ */
+int catalog_append(doc_catalog* cat, const char* path, const char* dir, const char* name)
+{
+	char file_path[PATH_MAX];
+	snprintf(file_path, sizeof(file_path), "%s/%s", dir, name);
+	catalog_entry entry;
+	if (catalog_fill_entry(&entry, file_path, strlen(name), NULL) != 0 ||
+	    cat->header->paths_len + entry.path_len + 1 > UINT32_MAX)
+		return -1;
+	if (cat->header->count == cat->header->capacity && catalog_grow(cat, path) != 0)
+		return -1;
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	// the path and the entry first, the header only once they're both there
+	catalog_header header = *cat->header;
+	entry.path = header.paths_len;
+	off_t paths = sizeof(catalog_header) + header.capacity * sizeof(catalog_entry);
+	bool ok = pwrite(fd, file_path, entry.path_len + 1, paths + entry.path) == entry.path_len + 1 &&
+	          pwrite(fd, &entry, sizeof(entry), sizeof(catalog_header) + header.count * sizeof(entry)) == sizeof(entry);
+	header.count++;
+	header.paths_len += entry.path_len + 1;
+	ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	catalog_unmap(cat);
+	if (catalog_map(cat, path) != 0 || !ok)
+		return -1;
+
+	// the lookups get the new id, or are built again once they're half full
+	int id = catalog_count(cat) - 1;
+	if (cat->num_slots > 0 && 2 * (size_t)catalog_count(cat) <= cat->num_slots)
+		catalog_slot_add(cat, cat->slots, cat->num_slots, id);
+	else if (cat->num_slots > 0)
+		catalog_index(cat);
+	return id;
+}
+
+/*
+ *  catalog_tombstone
+ *  Flags a document as deleted, returns 0 on success
+ */
+int catalog_tombstone(doc_catalog* cat, const char* path, int id)
+{
+	catalog_entry* entry = catalog_get(cat, id);
+	if (entry->flags & CATALOG_FLAG_DELETED)
+		return 0;
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	// the mapping is shared, so it sees both writes
+	uint8_t flags = entry->flags | CATALOG_FLAG_DELETED;
+	catalog_header header = *cat->header;
+	header.deleted++;
+	off_t offset = sizeof(catalog_header) + id * sizeof(catalog_entry) + offsetof(catalog_entry, flags);
+	bool ok = pwrite(fd, &flags, sizeof(flags), offset) == sizeof(flags) &&
+	          pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+/*
+ *  catalog_put
+ *  Makes sure the document `name` of `dir` is in the catalog at `path` as it is now (a changed
+ *  document gets a new entry), returns its id or -1 on error
+ */
+int catalog_put(doc_catalog* cat, const char* path, const char* dir, const char* name)
+{
+	int id = catalog_find(cat, name);
+	if (id >= 0)
+	{
+		catalog_entry* entry = catalog_get(cat, id);
+		struct stat st;
+		bool readable = stat(catalog_path(cat, id), &st) == 0 && S_ISREG(st.st_mode);
+		bool missing = (entry->flags & CATALOG_FLAG_MISSING) != 0;
+		if (readable ? !missing && catalog_stat_ns(&st) == entry->mtime && st.st_size == entry->size : missing)
+			return id;
+		if (catalog_tombstone(cat, path, id) != 0)
+			return -1;
+	}
+	return catalog_append(cat, path, dir, name);
+}
+
+/*
+ *  catalog_stamp
+ *  Records that the catalog at `path` matches `list` as it is now and that the signature store
+ *  of `store_generation` was brought up to date with it, returns 0 on success
+ */
+int catalog_stamp(doc_catalog* cat, const char* path, const char* list, uint64_t store_generation)
+{
+	struct stat st;
+	if (stat(list, &st) != 0)
+		return -1;
+	catalog_header header = *cat->header;
+	header.list_mtime = catalog_stat_ns(&st);
+	header.list_size = st.st_size;
+	header.store_generation = store_generation;
+	if (memcmp(&header, cat->header, sizeof(header)) == 0)
+		return 0;
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	bool ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+#endif
+/* CATALOG_H */
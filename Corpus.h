@@ -0,0 +1,174 @@
+/*************************************************************************************************
+ *  Corpus.h
+ *  Synthetic lorem ipsum documents of a given length and edit distance.
+ *
+ *  A document is an array of words drawn from a fixed lorem ipsum vocabulary and rendered into
+ *  text the way the files in db/ look: sentences of CORPUS_SENTENCE words, paragraphs of
+ *  CORPUS_PARAGRAPH sentences. A variant of a document replaces a number of distinct words with
+ *  different ones, so "differs from the baseline by N words" is exact (lorem_b.txt ... lorem_f.txt
+ *  were made that way by hand). The same seed always gives the same corpus.
+ *
+ *  A corpus written out with corpus_write() is a baseline, synth_0000.txt, followed by documents
+ *  that differ from it by `edits` more words each (synth_0003.txt by 3 * edits words).
+ **************************************************************************************************/
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "Permutation.h"
+
+#define CORPUS_SENTENCE 12          // words per sentence
+#define CORPUS_PARAGRAPH 6          // sentences per paragraph
+#define CORPUS_WORD_MAX 16          // longest word in the vocabulary (with room for punctuation)
+#define CORPUS_SEED 0x5EED5EED5EED5EEDULL   // seed of generated corpora
+#define CORPUS_DOCS 1000            // documents in a generated corpus unless asked otherwise
+#define CORPUS_WORDS 1000           // words per generated document unless asked otherwise
+#define CORPUS_EDITS 10             // words between consecutive generated documents unless asked otherwise
+
+static const char* const corpus_vocabulary[] =
+{
+	"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "eu",
+	"suscipit", "est", "ut", "dapibus", "magna", "et", "ligula", "blandit", "non", "malesuada",
+	"mi", "mattis", "praesent", "vehicula", "lacus", "auctor", "tempus", "mollis", "tortor", "eget",
+	"aliquam", "purus", "etiam", "tellus", "nec", "gravida", "consequat", "nisl", "tempor", "diam",
+	"rutrum", "dui", "arcu", "nunc", "vivamus", "metus", "in", "justo", "sapien", "fusce",
+	"nulla", "id", "quam", "donec", "lacinia", "vestibulum", "urna", "a", "turpis", "placerat",
+	"condimentum", "nam", "vel", "massa", "feugiat", "pharetra", "velit", "ac", "facilisis", "orci",
+	"integer", "porta", "libero", "quis", "risus", "cras", "semper", "odio", "morbi", "ultrices"
+};
+#define CORPUS_VOCABULARY (int)(sizeof(corpus_vocabulary) / sizeof(corpus_vocabulary[0]))
+
+/*
+ *  corpus_words
+ *  Fills a document with `n` random words
+ */
+void corpus_words(int* words, long n, uint64_t* state)
+{
+	for (long i = 0; i < n; i++)
+		words[i] = splitmix64(state) % CORPUS_VOCABULARY;
+}
+
+/*
+ *  corpus_edit
+ *  Replaces `edits` distinct words of a document (all of them if there are fewer) with different
+ *  words
+ */
+void corpus_edit(int* words, long n, long edits, uint64_t* state)
+{
+	if (edits > n)
+		edits = n;
+
+	// Floyd's sampling of distinct positions
+	unsigned char* picked = calloc(n + 1, 1);
+	for (long j = n - edits; j < n; j++)
+	{
+		long i = splitmix64(state) % (j + 1);
+		if (picked[i])
+			i = j;
+		picked[i] = 1;
+		words[i] = (words[i] + 1 + splitmix64(state) % (CORPUS_VOCABULARY - 1)) % CORPUS_VOCABULARY;
+	}
+	free(picked);
+}
+
+/*
+ *  corpus_text_size
+ *  Most bytes the text of an `n` word document can take up (with its terminating 0)
+ */
+size_t corpus_text_size(long n)
+{
+	return (size_t)n * (CORPUS_WORD_MAX + 2) + 2;
+}
+
+/*
+ *  corpus_render
+ *  Writes a document out as text (`out` needs corpus_text_size() bytes), returns its length
+ */
+size_t corpus_render(const int* words, long n, char* out)
+{
+	char* p = out;
+	for (long i = 0; i < n; i++)
+	{
+		const char* word = corpus_vocabulary[words[i]];
+		size_t len = strlen(word);
+		memcpy(p, word, len);
+		if (i % CORPUS_SENTENCE == 0)
+			*p = toupper((unsigned char)*p);
+		p += len;
+
+		// sentences and paragraphs fall on fixed words, so edits don't move them
+		bool ends_sentence = i % CORPUS_SENTENCE == CORPUS_SENTENCE - 1 || i == n - 1;
+		bool ends_paragraph = ends_sentence && (i / CORPUS_SENTENCE) % CORPUS_PARAGRAPH == CORPUS_PARAGRAPH - 1;
+		if (ends_sentence)
+			*p++ = '.';
+		if (i == n - 1 || ends_paragraph)
+		{
+			*p++ = '\n';
+			if (i < n - 1)
+				*p++ = '\n';
+		}
+		else
+			*p++ = ' ';
+	}
+	*p = '\0';
+	return p - out;
+}
+
+/*
+ *  corpus_name
+ *  Name of the i-th document of a generated corpus
+ */
+void corpus_name(char* name, size_t size, int i)
+{
+	snprintf(name, size, "synth_%04d.txt", i);
+}
+
+/*
+ *  corpus_write
+ *  Writes a corpus of `docs` documents of `words` words into `dir`, and their names to `names` one
+ *  per line (unless it's NULL), returns 0 on success and -1 if a file couldn't be written
+ */
+int corpus_write(const char* dir, int docs, long words, long edits, uint64_t seed, FILE* names)
+{
+	uint64_t state = seed;
+	int* baseline = malloc((words + 1) * sizeof(int));
+	int* variant = malloc((words + 1) * sizeof(int));
+	char* text = malloc(corpus_text_size(words));
+	corpus_words(baseline, words, &state);
+	int status = 0;
+	for (int i = 0; i < docs && status == 0; i++)
+	{
+		memcpy(variant, baseline, words * sizeof(int));
+		corpus_edit(variant, words, i * edits, &state);
+		size_t len = corpus_render(variant, words, text);
+
+		char name[32];
+		char path[4096];
+		corpus_name(name, sizeof(name), i);
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		FILE* out = fopen(path, "w");
+		if (out == NULL)
+		{
+			status = -1;
+			break;
+		}
+		if (fwrite(text, 1, len, out) != len)
+			status = -1;
+		if (fclose(out) != 0)
+			status = -1;
+		if (names != NULL)
+			fprintf(names, "%s\n", name);
+	}
+	free(baseline);
+	free(variant);
+	free(text);
+	return status;
+}
+
+#endif
+/* CORPUS_H */
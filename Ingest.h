@@ -0,0 +1,613 @@
+/*************************************************************************************************
+ *  Ingest.h
+ *  Pipelined signing of many documents: readers, tokenizers and signers on threads of their own,
+ *  connected by bounded lock-free queues.
+ *
+ *  - Readers stat and read whole documents into memory (documents bigger than INGEST_READ_MAX
+ *    are only opened, their tokenizer streams them), so the disk is kept busy while the CPUs
+ *    work on documents read earlier.
+ *  - Tokenizers split a document into words and hash its shingles (see Shingle.h) into batches
+ *    of INGEST_BATCH hashes. All the batches of a document go to the same signer, in order.
+ *  - Signers fold batches into the document's signature and finish it once its last batch is in.
+ *  - The calling thread hands finished signatures to a callback in the order the documents were
+ *    given, so the result is the same as signing them one after the other.
+ *
+ *  Backpressure: batches come from a fixed pool of INGEST_BATCHES that signers give back, and a
+ *  reader doesn't start a document more than INGEST_WINDOW documents ahead of the oldest one not
+ *  handed out yet, so memory stays bounded however fast the disk is. A thread that finds its
+ *  queue empty (or full) yields, then sleeps a little, instead of spinning on a core another
+ *  stage needs.
+ *
+ *  Every stage adds up what it did and how long it was busy, ingest_report() prints the
+ *  throughput of each and how busy its threads were, which shows the stage holding it back.
+ **************************************************************************************************/
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "Tokenizer.h"
+#include "Shingle.h"
+#include "Arena.h"
+#include "Stats.h"
+
+#define INGEST_BATCH 4096           // shingle hashes per batch
+#define INGEST_BATCHES 64           // batches in the pool (a power of 2, also the capacity of every queue)
+#define INGEST_WINDOW 64            // documents being worked on at most
+#define INGEST_READERS 2            // reader threads (they mostly wait on the disk)
+#define INGEST_READ_MAX (1L << 24)  // biggest document a reader loads, bigger ones are streamed
+
+// stages of the pipeline
+#define INGEST_READ 0
+#define INGEST_TOKENIZE 1
+#define INGEST_SIGN 2
+#define INGEST_STAGES 3
+
+// one cell of a queue (its sequence number says whether it's free or full for a given position)
+typedef struct
+{
+	size_t seq;
+	void* item;
+} ingest_cell;
+
+// a bounded multi-producer multi-consumer queue of pointers
+typedef struct
+{
+	ingest_cell* cells;
+	size_t mask;
+	size_t head __attribute__((aligned(64)));     // next position to push to
+	size_t tail __attribute__((aligned(64)));     // next position to pop from
+	int producers;                  // producers that haven't closed it yet (atomic)
+} ingest_queue;
+
+// a document on its way through the pipeline
+typedef struct
+{
+	long item;                      // which of the documents it is
+	char* text;                     // the whole document (NULL if it's streamed or unreadable)
+	size_t size;
+	int fd;                         // the document to stream (-1 if it was read or is unreadable)
+	struct stat st;
+	bool readable;
+	uint64_t* signature;
+	int ready;                      // set once the signature is finished (atomic)
+} ingest_slot;
+
+// shingle hashes of a document, in order
+typedef struct
+{
+	ingest_slot* slot;
+	int len;
+	bool first;                     // the document's first batch
+	bool last;                      // the document's last batch
+	uint64_t shingles[INGEST_BATCH];
+} ingest_batch;
+
+// what a stage did
+typedef struct
+{
+	int threads;
+	uint64_t items;                 // documents read, words tokenized or shingles folded
+	uint64_t bytes;                 // bytes read (readers and tokenizers)
+	uint64_t busy_ns;               // time its threads spent working, added up
+} ingest_stage;
+
+// how signatures are built and where they go
+typedef struct
+{
+	int permutations;               // minimums per signature
+	int shingle_length;
+	uint64_t seed;                  // seed the words are hashed with
+	void (*init)(uint64_t* signature);                                  // starts a signature
+	void (*fold)(uint64_t* signature, const uint64_t* shingles, int len); // folds shingles into one
+	void (*finish)(uint64_t* signature, arena* scratch);               // completes one
+	void (*pack)(uint64_t* signature);                                  // cuts one down to what's kept
+	void (*done)(void* ctx, int item, const uint64_t* signature,       // takes a signature, in order
+	             const struct stat* st, bool readable);
+	void* ctx;
+} ingest_config;
+
+// a run of the pipeline
+typedef struct
+{
+	const ingest_config* config;
+	const char* const* paths;
+	int num;
+	long next;                      // next document a reader takes (atomic)
+	long written;                   // documents handed to `done` so far (atomic)
+	ingest_slot slots[INGEST_WINDOW];
+	ingest_batch* batches;
+	ingest_queue free_batches;
+	ingest_queue docs;              // read, waiting for a tokenizer
+	ingest_queue* to_sign;          // one per signer
+	int signers;
+	ingest_stage stages[INGEST_STAGES];
+	double wall_ns;
+} ingest_pipeline;
+
+// what a pipeline thread needs to know about itself
+typedef struct
+{
+	ingest_pipeline* pipeline;
+	int index;                      // among the threads of its stage
+} ingest_thread;
+
+/*
+ *  ingest_now_ns
+ *  Monotonic clock in nanoseconds
+ */
+static inline uint64_t ingest_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ *  ingest_backoff
+ *  Waits a little longer every time a thread finds nothing to do (`tries` counts the attempts)
+ */
+static inline void ingest_backoff(int* tries)
+{
+	if ((*tries)++ < 16)
+		sched_yield();
+	else
+	{
+		struct timespec ts = {0, 50000};
+		nanosleep(&ts, NULL);
+	}
+}
+
+/*
+ *  ingest_queue_init
+ *  Starts an empty queue of `capacity` (a power of 2) pointers, closed once `producers` have
+ *  closed it
+ */
+void ingest_queue_init(ingest_queue* q, size_t capacity, int producers)
+{
+	q->cells = malloc(capacity * sizeof(ingest_cell));
+	for (size_t i = 0; i < capacity; i++)
+		q->cells[i].seq = i;
+	q->mask = capacity - 1;
+	q->head = 0;
+	q->tail = 0;
+	q->producers = producers;
+}
+
+/*
+ *  ingest_queue_free
+ *  Releases a queue
+ */
+void ingest_queue_free(ingest_queue* q)
+{
+	free(q->cells);
+	q->cells = NULL;
+}
+
+/*
+ *  ingest_queue_try_push
+ *  Pushes a pointer unless the queue is full (returns whether it did)
+ */
+bool ingest_queue_try_push(ingest_queue* q, void* item)
+{
+	size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		ingest_cell* cell = &q->cells[pos & q->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0)
+		{
+			// the cell is free for this position, claim it
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				cell->item = item;
+				__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ *  ingest_queue_try_pop
+ *  Pops a pointer unless the queue is empty (returns whether it did)
+ */
+bool ingest_queue_try_pop(ingest_queue* q, void** item)
+{
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		ingest_cell* cell = &q->cells[pos & q->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0)
+		{
+			// the cell holds this position's pointer, take it
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*item = cell->item;
+				__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ *  ingest_queue_push
+ *  Pushes a pointer, waiting while the queue is full
+ */
+void ingest_queue_push(ingest_queue* q, void* item)
+{
+	int tries = 0;
+	while (!ingest_queue_try_push(q, item))
+		ingest_backoff(&tries);
+}
+
+/*
+ *  ingest_queue_pop
+ *  Pops a pointer, waiting while the queue is empty; returns NULL once it's empty and closed
+ */
+void* ingest_queue_pop(ingest_queue* q)
+{
+	void* item;
+	int tries = 0;
+	while (!ingest_queue_try_pop(q, &item))
+	{
+		// once it's closed, one more look catches what was pushed just before
+		if (__atomic_load_n(&q->producers, __ATOMIC_ACQUIRE) == 0)
+			return ingest_queue_try_pop(q, &item) ? item : NULL;
+		ingest_backoff(&tries);
+	}
+	return item;
+}
+
+/*
+ *  ingest_queue_close
+ *  Tells a queue one of its producers is done
+ */
+void ingest_queue_close(ingest_queue* q)
+{
+	__atomic_sub_fetch(&q->producers, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  ingest_stage_add
+ *  Adds work done by one thread of a stage (thread-safe)
+ */
+void ingest_stage_add(ingest_stage* stage, uint64_t items, uint64_t bytes, uint64_t busy_ns)
+{
+	__atomic_add_fetch(&stage->items, items, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stage->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stage->busy_ns, busy_ns, __ATOMIC_RELAXED);
+}
+
+/*
+ *  ingest_read_whole
+ *  Reads `size` bytes of a file into `buf`, returns 0 on success
+ */
+int ingest_read_whole(int fd, char* buf, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t n = read(fd, buf + done, size - done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ *  ingest_reader
+ *  Reads documents in order and hands them to the tokenizers (a reader thread)
+ */
+void* ingest_reader(void* arg)
+{
+	ingest_thread* self = arg;
+	ingest_pipeline* p = self->pipeline;
+	for (;;)
+	{
+		long seq = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+		if (seq >= p->num)
+			break;
+
+		// wait for the document's slot to be handed out
+		int tries = 0;
+		while (seq >= __atomic_load_n(&p->written, __ATOMIC_ACQUIRE) + INGEST_WINDOW)
+			ingest_backoff(&tries);
+		uint64_t start = ingest_now_ns();
+		STATS_MARK(io);
+		ingest_slot* slot = &p->slots[seq % INGEST_WINDOW];
+		slot->item = seq;
+		slot->text = NULL;
+		slot->size = 0;
+		slot->fd = -1;
+		slot->readable = false;
+		const char* path = p->paths[seq];
+		int fd = -1;
+		if (stat(path, &slot->st) == 0 && S_ISREG(slot->st.st_mode) && (fd = open(path, O_RDONLY)) >= 0)
+		{
+			slot->size = slot->st.st_size;
+			if (slot->size > INGEST_READ_MAX)
+			{
+				slot->fd = fd;
+				slot->readable = true;
+			}
+			else
+			{
+				slot->text = malloc(slot->size + 1);
+				slot->readable = slot->text != NULL && ingest_read_whole(fd, slot->text, slot->size) == 0;
+				close(fd);
+			}
+		}
+		STATS_SPAN(STAGE_IO, io);
+		STATS_ADD(COUNTER_BYTES_READ, (slot->fd < 0 && slot->readable) ? slot->size : 0);
+		ingest_stage_add(&p->stages[INGEST_READ], 1, (slot->fd < 0 && slot->readable) ? slot->size : 0,
+		                 ingest_now_ns() - start);
+		ingest_queue_push(&p->docs, slot);
+	}
+	ingest_queue_close(&p->docs);
+	return NULL;
+}
+
+/*
+ *  ingest_send
+ *  Hands a batch to the signer of its document
+ */
+void ingest_send(ingest_pipeline* p, ingest_batch* batch)
+{
+	ingest_queue_push(&p->to_sign[batch->slot->item % p->signers], batch);
+}
+
+/*
+ *  ingest_tokenizer
+ *  Splits documents into batches of shingle hashes (a tokenizer thread)
+ */
+void* ingest_tokenizer(void* arg)
+{
+	ingest_thread* self = arg;
+	ingest_pipeline* p = self->pipeline;
+	const ingest_config* config = p->config;
+	char* chunk = malloc(STREAM_CHUNK);
+	ingest_slot* slot;
+	while ((slot = ingest_queue_pop(&p->docs)) != NULL)
+	{
+		uint64_t start = ingest_now_ns();
+		uint64_t waited = 0;
+		STATS_FRAME(frame);
+		STATS_MARK(lap);
+		doc_stream stream;
+		if (slot->fd >= 0)
+			doc_stream_fd(&stream, slot->fd, chunk, STREAM_CHUNK);
+		else
+			doc_stream_text(&stream, slot->text, slot->readable ? slot->size : 0);
+
+		// hash every shingle as its last word comes in, a batch at a time
+		shingler sh;
+		shingler_init(&sh, config->shingle_length, config->seed);
+		ingest_batch* batch = ingest_queue_pop(&p->free_batches);
+		batch->slot = slot;
+		batch->len = 0;
+		batch->first = true;
+		batch->last = false;
+		long words = 0;
+		const char* word;
+		int word_len;
+		uint64_t shingle;
+		while (doc_stream_next(&stream, &word, &word_len))
+		{
+			STATS_LAP(frame, STAGE_TOKENIZE, lap);
+			words++;
+			bool complete = shingler_push(&sh, word, word_len, &shingle);
+			STATS_LAP(frame, STAGE_HASH, lap);
+			if (!complete)
+				continue;
+			batch->shingles[batch->len++] = shingle;
+			if (batch->len == INGEST_BATCH)
+			{
+				ingest_send(p, batch);
+				uint64_t wait = ingest_now_ns();
+				batch = ingest_queue_pop(&p->free_batches);
+				waited += ingest_now_ns() - wait;
+				batch->slot = slot;
+				batch->len = 0;
+				batch->first = false;
+				batch->last = false;
+			}
+		}
+		STATS_LAP(frame, STAGE_TOKENIZE, lap);
+		STATS_COUNT(frame, COUNTER_WORDS, words);
+		STATS_FLUSH(frame);
+		if (stream.failed)
+			slot->readable = false;
+		if (slot->fd >= 0)
+		{
+			close(slot->fd);
+			slot->fd = -1;
+		}
+		free(slot->text);
+		slot->text = NULL;
+		batch->last = true;
+		ingest_send(p, batch);
+		ingest_stage_add(&p->stages[INGEST_TOKENIZE], words, slot->readable ? slot->size : 0,
+		                 ingest_now_ns() - start - waited);
+	}
+	free(chunk);
+	for (int s = 0; s < p->signers; s++)
+		ingest_queue_close(&p->to_sign[s]);
+	return NULL;
+}
+
+/*
+ *  ingest_signer
+ *  Folds batches into their documents' signatures (a signer thread)
+ */
+void* ingest_signer(void* arg)
+{
+	ingest_thread* self = arg;
+	ingest_pipeline* p = self->pipeline;
+	const ingest_config* config = p->config;
+	arena scratch;
+	arena_init(&scratch, ARENA_CHUNK_SIZE);
+	ingest_batch* batch;
+	while ((batch = ingest_queue_pop(&p->to_sign[self->index])) != NULL)
+	{
+		uint64_t start = ingest_now_ns();
+		STATS_MARK(permute);
+		ingest_slot* slot = batch->slot;
+		if (batch->first)
+			config->init(slot->signature);
+		config->fold(slot->signature, batch->shingles, batch->len);
+		STATS_ADD(COUNTER_SHINGLES, batch->len);
+		uint64_t folded = batch->len;
+		bool last = batch->last;
+		ingest_queue_push(&p->free_batches, batch);
+		if (last)
+		{
+			// an unreadable document gets an empty signature
+			if (slot->readable)
+				config->finish(slot->signature, &scratch);
+			else
+				config->init(slot->signature);
+			config->pack(slot->signature);
+			__atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+		}
+		STATS_SPAN(STAGE_PERMUTE, permute);
+		ingest_stage_add(&p->stages[INGEST_SIGN], folded, 0, ingest_now_ns() - start);
+	}
+	arena_free(&scratch);
+	return NULL;
+}
+
+/*
+ *  ingest_run
+ *  Signs the documents at `paths` with `tokenizers` tokenizer and `signers` signer threads (and
+ *  INGEST_READERS readers), handing every signature to the config's `done` in order; fills in
+ *  what every stage did
+ */
+void ingest_run(ingest_pipeline* p, const ingest_config* config, const char* const* paths, int num, int tokenizers,
+                int signers)
+{
+	uint64_t start = ingest_now_ns();
+	memset(p, 0, sizeof(*p));
+	p->config = config;
+	p->paths = paths;
+	p->num = num;
+	p->signers = signers;
+	p->stages[INGEST_READ].threads = INGEST_READERS;
+	p->stages[INGEST_TOKENIZE].threads = tokenizers;
+	p->stages[INGEST_SIGN].threads = signers;
+	uint64_t* signatures = malloc((size_t)INGEST_WINDOW * config->permutations * sizeof(uint64_t));
+	for (int i = 0; i < INGEST_WINDOW; i++)
+		p->slots[i].signature = signatures + (size_t)i * config->permutations;
+
+	// the queues, with every batch free to start with
+	p->batches = malloc(INGEST_BATCHES * sizeof(ingest_batch));
+	ingest_queue_init(&p->free_batches, INGEST_BATCHES, 1);
+	for (int i = 0; i < INGEST_BATCHES; i++)
+		ingest_queue_push(&p->free_batches, &p->batches[i]);
+	ingest_queue_init(&p->docs, INGEST_BATCHES, INGEST_READERS);
+	p->to_sign = malloc(signers * sizeof(ingest_queue));
+	for (int s = 0; s < signers; s++)
+		ingest_queue_init(&p->to_sign[s], INGEST_BATCHES, tokenizers);
+
+	// start every stage
+	int num_threads = INGEST_READERS + tokenizers + signers;
+	pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+	ingest_thread* args = malloc(num_threads * sizeof(ingest_thread));
+	for (int t = 0; t < num_threads; t++)
+	{
+		args[t].pipeline = p;
+		void* (*routine)(void*);
+		if (t < INGEST_READERS)
+		{
+			args[t].index = t;
+			routine = ingest_reader;
+		}
+		else if (t < INGEST_READERS + tokenizers)
+		{
+			args[t].index = t - INGEST_READERS;
+			routine = ingest_tokenizer;
+		}
+		else
+		{
+			args[t].index = t - INGEST_READERS - tokenizers;
+			routine = ingest_signer;
+		}
+		if (pthread_create(&threads[t], NULL, routine, &args[t]) != 0)
+		{
+			fprintf(stderr, "Error, couldn't start the ingestion threads\n");
+			exit(1);
+		}
+	}
+
+	// hand out the signatures in order as they're finished
+	for (long seq = 0; seq < num; seq++)
+	{
+		ingest_slot* slot = &p->slots[seq % INGEST_WINDOW];
+		int tries = 0;
+		while (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE))
+			ingest_backoff(&tries);
+		config->done(config->ctx, slot->item, slot->signature, &slot->st, slot->readable);
+		slot->ready = 0;
+		__atomic_store_n(&p->written, seq + 1, __ATOMIC_RELEASE);
+	}
+
+	for (int t = 0; t < num_threads; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+	free(args);
+	for (int s = 0; s < signers; s++)
+		ingest_queue_free(&p->to_sign[s]);
+	free(p->to_sign);
+	ingest_queue_free(&p->docs);
+	ingest_queue_free(&p->free_batches);
+	free(p->batches);
+	free(signatures);
+	p->wall_ns = ingest_now_ns() - start;
+}
+
+/*
+ *  ingest_report
+ *  Prints how much every stage went through per second and how busy its threads were
+ */
+void ingest_report(FILE* out, const ingest_pipeline* p)
+{
+	static const char* const names[INGEST_STAGES] = {"read", "tokenize", "sign"};
+	static const char* const units[INGEST_STAGES] = {"files", "words", "shingles"};
+	double seconds = p->wall_ns / 1e9;
+	fprintf(out, "Signed %d files in %.2f s\n", p->num, seconds);
+	for (int s = 0; s < INGEST_STAGES; s++)
+	{
+		const ingest_stage* stage = &p->stages[s];
+		double busy = (seconds > 0 && stage->threads > 0) ? stage->busy_ns / 1e9 / (seconds * stage->threads) : 0;
+		fprintf(out, "  %-8s %2d thread%s  %12.0f %s/s", names[s], stage->threads, (stage->threads == 1) ? " " : "s",
+		        (seconds > 0) ? stage->items / seconds : 0, units[s]);
+		if (stage->bytes > 0)
+			fprintf(out, "  %9.1f MB/s", (seconds > 0) ? stage->bytes / seconds / 1e6 : 0);
+		fprintf(out, "  busy %3.0f%%\n", busy * 100);
+	}
+}
+
+#endif
+/* INGEST_H */
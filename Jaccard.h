@@ -0,0 +1,181 @@
+/*************************************************************************************************
+ *  Jaccard.h
+ *  Exact Jaccard similarity of two shingle sets.
+ *
+ *  Shingle hashes are sorted with an LSD radix sort (8 passes of 8 bits, passes where every key
+ *  has the same byte are skipped) into caller-provided scratch space, deduplicated, and the two
+ *  sorted sets are intersected with a merge. The merge has an AVX2 kernel that compares a block
+ *  of 4 against a block of 4 (all 16 pairs via lane rotations) and a scalar fallback, picked at
+ *  runtime (set JACCARD_KERNEL=scalar in the environment to force the fallback).
+ **************************************************************************************************/
+#ifndef JACCARD_H
+#define JACCARD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JACCARD_X86 1
+#endif
+
+/*
+ *  radix_sort_u64
+ *  Sorts `n` keys, `scratch` must have room for `n` keys (the result ends up in `keys`)
+ */
+void radix_sort_u64(uint64_t* keys, uint64_t* scratch, size_t n)
+{
+	// every pass's histogram in one read of the keys
+	size_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (size_t i = 0; i < n; i++)
+	{
+		uint64_t k = keys[i];
+		for (int pass = 0; pass < 8; pass++)
+			counts[pass][(k >> (pass * 8)) & 0xFF]++;
+	}
+
+	uint64_t* from = keys;
+	uint64_t* to = scratch;
+	for (int pass = 0; pass < 8; pass++)
+	{
+		// nothing to do if every key has the same byte here
+		if (n == 0 || counts[pass][(from[0] >> (pass * 8)) & 0xFF] == n)
+			continue;
+
+		// offsets, then scatter
+		size_t offset = 0;
+		for (int b = 0; b < 256; b++)
+		{
+			size_t c = counts[pass][b];
+			counts[pass][b] = offset;
+			offset += c;
+		}
+		for (size_t i = 0; i < n; i++)
+		{
+			uint64_t k = from[i];
+			to[counts[pass][(k >> (pass * 8)) & 0xFF]++] = k;
+		}
+		uint64_t* tmp = from;
+		from = to;
+		to = tmp;
+	}
+	if (from != keys)
+		memcpy(keys, from, n * sizeof(uint64_t));
+}
+
+/*
+ *  dedupe_sorted
+ *  Removes repeated keys from a sorted array, returns how many are left
+ */
+size_t dedupe_sorted(uint64_t* keys, size_t n)
+{
+	if (n == 0)
+		return 0;
+	size_t kept = 1;
+	for (size_t i = 1; i < n; i++)
+	{
+		if (keys[i] != keys[kept - 1])
+			keys[kept++] = keys[i];
+	}
+	return kept;
+}
+
+/*
+ *  intersect_count_scalar
+ *  Size of the intersection of two sorted sets
+ */
+size_t intersect_count_scalar(const uint64_t* a, size_t a_len, const uint64_t* b, size_t b_len)
+{
+	size_t i = 0, j = 0, count = 0;
+	while (i < a_len && j < b_len)
+	{
+		if (a[i] < b[j])
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else
+		{
+			count++;
+			i++;
+			j++;
+		}
+	}
+	return count;
+}
+
+#ifdef JACCARD_X86
+/*
+ *  intersect_count_avx2
+ *  Same as the scalar kernel, comparing blocks of 4 against blocks of 4 (each value is unique
+ *  within its set, so every match is counted once)
+ */
+__attribute__((target("avx2,popcnt")))
+size_t intersect_count_avx2(const uint64_t* a, size_t a_len, const uint64_t* b, size_t b_len)
+{
+	size_t i = 0, j = 0, count = 0;
+	while (i + 4 <= a_len && j + 4 <= b_len)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + j));
+
+		// compare every lane of a with every lane of b by rotating b
+		__m256i eq = _mm256_cmpeq_epi64(va, vb);
+		eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+		eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4E)));
+		eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+		count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(eq)));
+
+		// advance whichever block ends lower (both if they end on the same value)
+		uint64_t a_max = a[i + 3];
+		uint64_t b_max = b[j + 3];
+		if (a_max <= b_max)
+			i += 4;
+		if (b_max <= a_max)
+			j += 4;
+	}
+
+	// the tails, being careful not to count a pair twice: a block that was left behind only
+	// holds values above everything already passed in the other set
+	return count + intersect_count_scalar(a + i, a_len - i, b + j, b_len - j);
+}
+#endif
+
+/*
+ *  intersect_count
+ *  Size of the intersection of two sorted, deduplicated sets (fastest kernel available)
+ */
+size_t intersect_count(const uint64_t* a, size_t a_len, const uint64_t* b, size_t b_len)
+{
+	static int use_avx2 = -1;
+	if (use_avx2 < 0)
+	{
+		const char* forced = getenv("JACCARD_KERNEL");
+		use_avx2 = 0;
+#ifdef JACCARD_X86
+		use_avx2 = !(forced != NULL && strcmp(forced, "scalar") == 0) && __builtin_cpu_supports("avx2");
+#endif
+		(void)forced;
+	}
+#ifdef JACCARD_X86
+	if (use_avx2)
+		return intersect_count_avx2(a, a_len, b, b_len);
+#endif
+	return intersect_count_scalar(a, a_len, b, b_len);
+}
+
+/*
+ *  jaccard
+ *  |A and B| / |A or B| of two sorted, deduplicated sets (two empty sets are identical)
+ */
+double jaccard(const uint64_t* a, size_t a_len, const uint64_t* b, size_t b_len)
+{
+	if (a_len == 0 && b_len == 0)
+		return 1.0;
+	size_t both = intersect_count(a, a_len, b, b_len);
+	return (double)both / (double)(a_len + b_len - both);
+}
+
+#endif
+/* JACCARD_H */
@@ -0,0 +1,363 @@
+/*************************************************************************************************
+ *  Join.h
+ *  All-pairs similarity join over the signature store.
+ *
+ *  The stored documents are cut into tiles of JOIN_TILE documents and every pair of tiles is one
+ *  task on the thread pool. A task walks the signatures in slices sized so that both tiles'
+ *  slices fit in half of the L2 cache, adding up matching minimums (see Match.h, or b-bit slots,
+ *  see BBit.h) of every document pair as it goes, and keeps the pairs at least `threshold`
+ *  similar. A task's pairs are written out as batch records (see Batch.h) as soon as it
+ *  finishes, so output memory is bounded by one tile pair per worker.
+ *
+ *  When writing to a file, finished tile pairs are logged to `<output>.ckpt` along with how big
+ *  the output was after them. A join that was interrupted picks up from there: the output is cut
+ *  back to the last logged tile pair and only tile pairs that aren't logged are done again. The
+ *  log is thrown away (and the join started over) if the store, tiling or threshold changed, and
+ *  removed once the join finishes.
+ **************************************************************************************************/
+#ifndef JOIN_H
+#define JOIN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "Store.h"
+#include "Match.h"
+#include "Pool.h"
+#include "Batch.h"
+
+#define JOIN_TILE 64                // documents per tile
+#define JOIN_L2_FALLBACK (256 << 10) // L2 size to plan for when the system doesn't say
+#define JOIN_MAGIC "PDJOINC"
+#define JOIN_START UINT64_MAX       // log entry of the output before any tile pair
+
+// what the log was started for
+typedef struct
+{
+	char magic[8];
+	uint64_t store_generation;
+	uint32_t count;
+	uint32_t tile;
+	float threshold;
+	uint32_t reserved_0;
+} join_log_header;
+
+// one finished tile pair
+typedef struct
+{
+	uint64_t tile_pair;
+	uint64_t output_size;           // bytes of output once its pairs were written
+} join_log_entry;
+
+// a pair above the threshold
+typedef struct
+{
+	int doc_1;
+	int doc_2;
+	float score;
+} join_pair;
+
+// what one pool worker needs for a tile pair
+typedef struct
+{
+	uint32_t* counts;               // matching minimums, JOIN_TILE * JOIN_TILE
+	join_pair* pairs;               // JOIN_TILE * JOIN_TILE
+} join_buffer;
+
+// a join shared by the pool's workers
+typedef struct
+{
+	const signature_store* store;
+	int count;
+	int permutations;
+	int bits;                       // bits per slot of the signatures
+	int words;                      // 64-bit words per signature
+	int slice;                      // words per slice
+	int num_tiles;
+	float threshold;
+	const unsigned char* done;      // tile pairs finished before a restart
+	FILE* out;
+	int format;
+	int log_fd;                     // -1 without a checkpoint
+	pthread_mutex_t out_lock;
+	int progress;                   // tile pairs done so far (under out_lock)
+	int total;
+	bool show_progress;
+	join_buffer* buffers;           // one per worker
+} join_job;
+
+/*
+ *  join_slice_size
+ *  Words per slice so two tiles' slices take half of the L2 cache
+ */
+int join_slice_size(int words)
+{
+	long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if (l2 <= 0)
+		l2 = JOIN_L2_FALLBACK;
+	long slice = l2 / 2 / (2 * JOIN_TILE * (long)sizeof(uint64_t));
+	slice -= slice % 64;
+	if (slice < 64)
+		slice = 64;
+	return (slice > words) ? words : (int)slice;
+}
+
+/*
+ *  join_tile_pair
+ *  The two tiles (first <= second) of a tile pair index
+ */
+void join_tile_pair(int num_tiles, int index, int* first, int* second)
+{
+	int row = 0;
+	while (index >= num_tiles - row)
+	{
+		index -= num_tiles - row;
+		row++;
+	}
+	*first = row;
+	*second = row + index;
+}
+
+/*
+ *  join_task
+ *  Compares every document of one tile with every document of another (runs on a pool worker)
+ */
+void join_task(void* ctx, int index, int worker)
+{
+	join_job* job = ctx;
+	if (job->done != NULL && job->done[index])
+		return;
+	double start = batch_now_ms();
+	int tile_1, tile_2;
+	join_tile_pair(job->num_tiles, index, &tile_1, &tile_2);
+	int first_1 = tile_1 * JOIN_TILE;
+	int first_2 = tile_2 * JOIN_TILE;
+	int len_1 = (job->count - first_1 < JOIN_TILE) ? job->count - first_1 : JOIN_TILE;
+	int len_2 = (job->count - first_2 < JOIN_TILE) ? job->count - first_2 : JOIN_TILE;
+	join_buffer* buffer = &job->buffers[worker];
+	memset(buffer->counts, 0, JOIN_TILE * JOIN_TILE * sizeof(uint32_t));
+
+	// add up matching minimums one cache-sized slice of the signatures at a time
+	for (int p = 0; p < job->words; p += job->slice)
+	{
+		int width = (job->words - p < job->slice) ? job->words - p : job->slice;
+		for (int i = 0; i < len_1; i++)
+		{
+			const uint64_t* sig_1 = store_signature(job->store, first_1 + i) + p;
+			for (int j = (tile_1 == tile_2) ? i + 1 : 0; j < len_2; j++)
+			{
+				const uint64_t* sig_2 = store_signature(job->store, first_2 + j) + p;
+				uint32_t matching;
+				if (job->bits == BBIT_FULL)
+					matching = match_count(sig_1, sig_2, width);
+				else
+					matching = bbit_matches(sig_1, sig_2, width, job->bits);
+				buffer->counts[i * JOIN_TILE + j] += matching;
+			}
+		}
+	}
+
+	// keep the pairs above the threshold (files that couldn't be read or were removed don't pair up)
+	int num_pairs = 0;
+	for (int i = 0; i < len_1; i++)
+	{
+		if (store_get_record(job->store, first_1 + i)->flags & (STORE_FLAG_MISSING | STORE_FLAG_DELETED))
+			continue;
+		for (int j = (tile_1 == tile_2) ? i + 1 : 0; j < len_2; j++)
+		{
+			uint32_t matching = buffer->counts[i * JOIN_TILE + j];
+			float score = (job->bits == BBIT_FULL) ? (float)matching / (float)job->permutations
+			                                       : bbit_resemblance(matching, job->permutations, job->bits);
+			if (score < job->threshold ||
+			    (store_get_record(job->store, first_2 + j)->flags & (STORE_FLAG_MISSING | STORE_FLAG_DELETED)))
+				continue;
+			buffer->pairs[num_pairs].doc_1 = first_1 + i;
+			buffer->pairs[num_pairs].doc_2 = first_2 + j;
+			buffer->pairs[num_pairs++].score = score;
+		}
+	}
+
+	// write them out, then log the tile pair as done
+	double ms = batch_now_ms() - start;
+	pthread_mutex_lock(&job->out_lock);
+	batch_record record;
+	batch_record_init(&record, "join");
+	record.ms = ms;
+	for (int i = 0; i < num_pairs; i++)
+	{
+		record.file_1 = store_get_record(job->store, buffer->pairs[i].doc_1)->name;
+		record.file_2 = store_get_record(job->store, buffer->pairs[i].doc_2)->name;
+		record.similarity = buffer->pairs[i].score;
+		batch_emit(job->out, job->format, &record);
+	}
+	if (job->log_fd >= 0)
+	{
+		fflush(job->out);
+		join_log_entry entry = { (uint64_t)index, (uint64_t)ftello(job->out) };
+		if (write(job->log_fd, &entry, sizeof(entry)) != sizeof(entry))
+			perror("join checkpoint");
+	}
+	job->progress++;
+	if (job->show_progress)
+		fprintf(stderr, "\rJoining tiles (%d/%d)", job->progress, job->total);
+	pthread_mutex_unlock(&job->out_lock);
+}
+
+/*
+ *  join_resume
+ *  Reads the log of an earlier run of the same join, marking its finished tile pairs in `done`,
+ *  returns the size the output should be cut back to (or -1 if there's nothing to resume)
+ */
+long join_resume(const char* log_path, const join_log_header* expected, unsigned char* done, int total)
+{
+	int fd = open(log_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	join_log_header header;
+	long output_size = -1;
+	if (read(fd, &header, sizeof(header)) == sizeof(header) && memcmp(&header, expected, sizeof(header)) == 0)
+	{
+		// a half-written entry at the end is ignored
+		join_log_entry entry;
+		while (read(fd, &entry, sizeof(entry)) == sizeof(entry))
+		{
+			if (entry.tile_pair != JOIN_START && entry.tile_pair >= (uint64_t)total)
+				break;
+			if (entry.tile_pair != JOIN_START)
+				done[entry.tile_pair] = 1;
+			output_size = (long)entry.output_size;
+		}
+	}
+	close(fd);
+	if (output_size < 0)
+		memset(done, 0, total);
+	return output_size;
+}
+
+/*
+ *  join_run
+ *  Writes every pair of stored documents at least `threshold` similar to `output` ("-" for
+ *  standard output, which can't be resumed), returns 0 on success and -1 on error
+ */
+int join_run(const signature_store* store, thread_pool* pool, float threshold, const char* output,
+             int format, bool show_progress)
+{
+	join_job job;
+	job.store = store;
+	job.count = store_count(store);
+	job.permutations = store->header->permutations;
+	job.bits = store->header->bits;
+	job.words = store_signature_words(store->header);
+	job.slice = join_slice_size(job.words);
+	job.num_tiles = (job.count + JOIN_TILE - 1) / JOIN_TILE;
+	job.threshold = threshold;
+	job.format = format;
+	job.out = NULL;
+	job.log_fd = -1;
+	job.progress = 0;
+	job.total = job.num_tiles * (job.num_tiles + 1) / 2;
+	job.show_progress = show_progress;
+	unsigned char* done = calloc(job.total + 1, 1);
+	job.done = done;
+
+	// pick up an interrupted join of the same store with the same settings
+	char log_path[PATH_MAX];
+	bool to_file = strcmp(output, "-") != 0;
+	if (to_file)
+	{
+		join_log_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, JOIN_MAGIC, sizeof(header.magic));
+		header.store_generation = store->header->generation;
+		header.count = job.count;
+		header.tile = JOIN_TILE;
+		header.threshold = threshold;
+		snprintf(log_path, sizeof(log_path), "%s.ckpt", output);
+		long output_size = join_resume(log_path, &header, done, job.total);
+		if (output_size >= 0)
+		{
+			job.out = fopen(output, "r+");
+			if (job.out == NULL || ftruncate(fileno(job.out), output_size) != 0)
+				output_size = -1;
+			else
+				fseeko(job.out, output_size, SEEK_SET);
+		}
+		if (output_size >= 0)
+		{
+			for (int i = 0; i < job.total; i++)
+				job.progress += done[i];
+			job.log_fd = open(log_path, O_WRONLY | O_APPEND);
+		}
+		else
+		{
+			// start over
+			if (job.out != NULL)
+				fclose(job.out);
+			job.out = fopen(output, "w");
+			if (job.out != NULL)
+			{
+				batch_begin(job.out, format);
+				fflush(job.out);
+				job.log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				join_log_entry start = { JOIN_START, (uint64_t)ftello(job.out) };
+				if (job.log_fd >= 0 && (write(job.log_fd, &header, sizeof(header)) != sizeof(header) ||
+				                        write(job.log_fd, &start, sizeof(start)) != sizeof(start)))
+				{
+					close(job.log_fd);
+					job.log_fd = -1;
+				}
+			}
+		}
+		if (job.out == NULL || job.log_fd < 0)
+		{
+			if (job.out != NULL)
+				fclose(job.out);
+			free(done);
+			return -1;
+		}
+	}
+	else
+	{
+		job.out = stdout;
+		batch_begin(job.out, format);
+	}
+
+	// every tile pair across the pool
+	pthread_mutex_init(&job.out_lock, NULL);
+	job.buffers = malloc(pool->num_workers * sizeof(join_buffer));
+	for (int w = 0; w < pool->num_workers; w++)
+	{
+		job.buffers[w].counts = malloc(JOIN_TILE * JOIN_TILE * sizeof(uint32_t));
+		job.buffers[w].pairs = malloc(JOIN_TILE * JOIN_TILE * sizeof(join_pair));
+	}
+	pool_parallel_for(pool, job.total, 1, join_task, &job);
+	if (show_progress)
+		fprintf(stderr, "\n");
+
+	// clean up (the log isn't needed once everything is done)
+	for (int w = 0; w < pool->num_workers; w++)
+	{
+		free(job.buffers[w].counts);
+		free(job.buffers[w].pairs);
+	}
+	free(job.buffers);
+	pthread_mutex_destroy(&job.out_lock);
+	free(done);
+	fflush(job.out);
+	if (to_file)
+	{
+		fclose(job.out);
+		close(job.log_fd);
+		unlink(log_path);
+	}
+	return 0;
+}
+
+#endif
+/* JOIN_H */
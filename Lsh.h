@@ -0,0 +1,335 @@
+/*************************************************************************************************
+ *  Lsh.h
+ *  Locality sensitive hashing (banding) index over the signature store.
+ *
+ *  A signature is cut into `bands` bands of `rows` slots and every band is hashed into a bucket
+ *  key (with b-bit signatures a band's slots have to fill whole bytes). Two documents with
+ *  resemblance s share at least one bucket with probability 1 - (1 - s^rows)^bands, so a query
+ *  only has to look at the documents in its own buckets.
+ *
+ *  File layout:
+ *  - lsh_header (64 bytes): magic, version, bands, rows, bits per slot and which store the index
+ *    was built from
+ *  - for every band, `count` lsh_entry (bucket key, document) sorted by key, so a bucket is a
+ *    binary search away in the memory-mapped file
+ *  - `delta` documents added since the tables were built, each as `bands` entries in band order,
+ *    which a query scans in full (the index is rebuilt once they're an eighth of the tables)
+ *
+ *  Documents deleted from the store keep their entries until the next rebuild, queries have to
+ *  skip them.
+ **************************************************************************************************/
+#ifndef LSH_H
+#define LSH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MurmurHash2.h"
+#include "Store.h"
+
+#define LSH_PATH "lsh.idx"
+#define LSH_MAGIC "PDLSHIX"
+#define LSH_VERSION 3
+#define LSH_DELTA_MAX(count) ((count) / 8 + 16)   // added documents before a rebuild
+
+// file header
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t bands;
+	uint32_t rows;
+	uint32_t bits;                  // bits per slot of the store's signatures
+	uint64_t count;                 // documents in every band table
+	uint64_t store_generation;      // the store the index is up to date with
+	uint64_t delta;                 // documents added after the tables were built
+	uint64_t reserved_1[2];
+} lsh_header;
+
+// one document in one bucket
+typedef struct
+{
+	uint64_t key;
+	uint32_t doc;
+	uint32_t reserved;
+} lsh_entry;
+
+// an open (memory-mapped) index
+typedef struct
+{
+	int fd;
+	unsigned char* map;
+	size_t map_len;
+	lsh_header* header;
+} lsh_index;
+
+/*
+ *  lsh_band_key
+ *  Bucket key of one band of a signature with `bits` bits per slot
+ */
+uint64_t lsh_band_key(const uint64_t* signature, int band, int rows, int bits)
+{
+	int len = rows * bits / 8;
+	return MurmurHash64A((const unsigned char*)signature + band * len, len, band);
+}
+
+/*
+ *  lsh_table
+ *  Sorted entries of one band
+ */
+const lsh_entry* lsh_table(const lsh_index* index, int band)
+{
+	return (const lsh_entry*)(index->map + sizeof(lsh_header)) + band * index->header->count;
+}
+
+/*
+ *  lsh_delta_entries
+ *  Entries of the documents added after the tables were built
+ */
+const lsh_entry* lsh_delta_entries(const lsh_index* index)
+{
+	return lsh_table(index, index->header->bands);
+}
+
+/*
+ *  lsh_close
+ *  Unmaps an index (safe to call on an index that was never opened)
+ */
+void lsh_close(lsh_index* index)
+{
+	if (index->map != NULL)
+		munmap(index->map, index->map_len);
+	if (index->fd >= 0)
+		close(index->fd);
+	memset(index, 0, sizeof(*index));
+	index->fd = -1;
+}
+
+/*
+ *  lsh_open
+ *  Memory-maps an index, returns 0 on success and -1 if it's missing or unusable
+ */
+int lsh_open(lsh_index* index, const char* path)
+{
+	memset(index, 0, sizeof(*index));
+	index->fd = -1;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(lsh_header))
+	{
+		close(fd);
+		return -1;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+	lsh_header* header = map;
+	size_t expected = sizeof(lsh_header) + (size_t)header->bands * (header->count + header->delta) * sizeof(lsh_entry);
+	if (memcmp(header->magic, LSH_MAGIC, sizeof(LSH_MAGIC)) != 0 || header->version != LSH_VERSION ||
+		expected != (size_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		close(fd);
+		return -1;
+	}
+	index->fd = fd;
+	index->map = map;
+	index->map_len = st.st_size;
+	index->header = header;
+	return 0;
+}
+
+/*
+ *  lsh_entry_cmp
+ *  Orders entries by key (then document, to keep buckets stable)
+ */
+int lsh_entry_cmp(const void* a, const void* b)
+{
+	const lsh_entry* x = a;
+	const lsh_entry* y = b;
+	if (x->key != y->key)
+		return (x->key < y->key) ? -1 : 1;
+	return (x->doc < y->doc) ? -1 : (x->doc > y->doc);
+}
+
+/*
+ *  lsh_build
+ *  Hashes every band of every stored signature and writes the index, returns 0 on success
+ */
+int lsh_build(const char* path, const signature_store* store, int bands, int rows)
+{
+	int bits = store->header->bits;
+	if (bands <= 0 || rows <= 0 || bands * rows > (int)store->header->permutations || rows * bits % 8 != 0)
+		return -1;
+
+	// only documents that were actually read (and are still there) get an entry
+	int count = store_count(store);
+	int live = 0;
+	for (int i = 0; i < count; i++)
+		live += !(store_get_record(store, i)->flags & (STORE_FLAG_MISSING | STORE_FLAG_DELETED));
+
+	lsh_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LSH_MAGIC, sizeof(LSH_MAGIC));
+	header.version = LSH_VERSION;
+	header.bands = bands;
+	header.rows = rows;
+	header.bits = bits;
+	header.count = live;
+	header.store_generation = store->header->generation;
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE* fp = fopen(tmp, "wb");
+	if (fp == NULL)
+		return -1;
+	fwrite(&header, sizeof(header), 1, fp);
+	lsh_entry* table = malloc((live > 0 ? live : 1) * sizeof(lsh_entry));
+	for (int band = 0; band < bands; band++)
+	{
+		int n = 0;
+		for (int i = 0; i < count; i++)
+		{
+			if (store_get_record(store, i)->flags & (STORE_FLAG_MISSING | STORE_FLAG_DELETED))
+				continue;
+			table[n].key = lsh_band_key(store_signature(store, i), band, rows, bits);
+			table[n].doc = i;
+			table[n].reserved = 0;
+			n++;
+		}
+		qsort(table, n, sizeof(lsh_entry), lsh_entry_cmp);
+		fwrite(table, sizeof(lsh_entry), n, fp);
+	}
+	free(table);
+	if (fclose(fp) != 0)
+		return -1;
+	return rename(tmp, path);
+}
+
+/*
+ *  lsh_is_current
+ *  Whether an open index is up to date with the given store
+ */
+bool lsh_is_current(const lsh_index* index, const signature_store* store)
+{
+	return index->header != NULL && store->header != NULL &&
+	       index->header->store_generation == store->header->generation;
+}
+
+/*
+ *  lsh_follow
+ *  Writes the index's header back with `delta` added documents, marking it up to date with the
+ *  store, and maps the index again, returns 0 on success
+ */
+int lsh_follow(lsh_index* index, const char* path, const signature_store* store, uint64_t delta)
+{
+	lsh_header header = *index->header;
+	header.store_generation = store->header->generation;
+	header.delta = delta;
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	bool ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	lsh_close(index);
+	return (lsh_open(index, path) == 0 && ok) ? 0 : -1;
+}
+
+/*
+ *  lsh_add
+ *  Adds a document that was appended to the store to the delta, returns 0 on success
+ */
+int lsh_add(lsh_index* index, const char* path, const signature_store* store, int doc)
+{
+	int bands = index->header->bands;
+	int rows = index->header->rows;
+	lsh_entry* entries = malloc(bands * sizeof(lsh_entry));
+	for (int band = 0; band < bands; band++)
+	{
+		entries[band].key = lsh_band_key(store_signature(store, doc), band, rows, index->header->bits);
+		entries[band].doc = doc;
+		entries[band].reserved = 0;
+	}
+	int fd = open(path, O_WRONLY);
+	bool ok = fd >= 0 && pwrite(fd, entries, bands * sizeof(lsh_entry), index->map_len) ==
+	                     (ssize_t)(bands * sizeof(lsh_entry));
+	if (fd >= 0)
+		close(fd);
+	free(entries);
+	return ok ? lsh_follow(index, path, store, index->header->delta + 1) : -1;
+}
+
+/*
+ *  lsh_candidates
+ *  Collects every document sharing at least one bucket with `signature` into `candidates`
+ *  (which needs room for every document), `seen` is scratch space of one byte per stored
+ *  document and must be all zero, returns the number of candidates (which may include deleted
+ *  documents)
+ */
+int lsh_candidates(const lsh_index* index, const uint64_t* signature, unsigned char* seen, int* candidates)
+{
+	int num_candidates = 0;
+	int bands = index->header->bands;
+	int rows = index->header->rows;
+	int count = index->header->count;
+	uint64_t keys[bands];
+	for (int band = 0; band < bands; band++)
+	{
+		// first entry with the band's key
+		uint64_t key = keys[band] = lsh_band_key(signature, band, rows, index->header->bits);
+		const lsh_entry* table = lsh_table(index, band);
+		int lo = 0, hi = count;
+		while (lo < hi)
+		{
+			int mid = lo + (hi - lo) / 2;
+			if (table[mid].key < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		// everything in the bucket
+		for (int i = lo; i < count && table[i].key == key; i++)
+		{
+			if (!seen[table[i].doc])
+			{
+				seen[table[i].doc] = 1;
+				candidates[num_candidates++] = table[i].doc;
+			}
+		}
+	}
+
+	// documents added since the tables were built
+	const lsh_entry* delta = lsh_delta_entries(index);
+	for (uint64_t d = 0; d < index->header->delta; d++, delta += bands)
+	{
+		for (int band = 0; band < bands; band++)
+		{
+			if (delta[band].key == keys[band] && !seen[delta[band].doc])
+			{
+				seen[delta[band].doc] = 1;
+				candidates[num_candidates++] = delta[band].doc;
+				break;
+			}
+		}
+	}
+
+	// leave the scratch space clean for the next query
+	for (int i = 0; i < num_candidates; i++)
+		seen[candidates[i]] = 0;
+	return num_candidates;
+}
+
+#endif
+/* LSH_H */
@@ -0,0 +1,176 @@
+/*************************************************************************************************
+ *  Match.h
+ *  Kernels counting the slots two signatures agree on.
+ *
+ *  A slot matches when the two minimums are equal. The AVX-512 kernel compares 8 slots at a time
+ *  into a mask and popcounts it, the AVX2 one compares 4 at a time and subtracts the all-ones
+ *  lanes of equal slots from a vector of counts, so neither has a branch in its loop; the
+ *  fastest one the CPU has is picked at runtime (set MATCH_KERNEL=scalar or MATCH_KERNEL=avx2 in
+ *  the environment to force a slower one), and all of them give the same counts.
+ *
+ *  match_count_many() compares one query with a run of signatures laid out a fixed stride apart
+ *  (the records of the signature store), so a one-vs-all scan goes through the store front to
+ *  back with the query in cache and the kernel picked once per run instead of once per file.
+ **************************************************************************************************/
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "BBit.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define MATCH_X86 1
+#include <immintrin.h>
+#endif
+
+#define MATCH_BATCH 64              // signatures a one-vs-all scan hands match_count_many() at a time
+
+// instruction sets the kernels can use
+#define MATCH_SCALAR 0
+#define MATCH_AVX2 1
+#define MATCH_AVX512 2
+
+// counts the slots two runs of `len` minimums agree on
+typedef size_t (*match_kernel)(const uint64_t* a, const uint64_t* b, int len);
+
+/*
+ *  match_count_scalar
+ *  Number of slots two runs of `len` minimums agree on
+ */
+size_t match_count_scalar(const uint64_t* a, const uint64_t* b, int len)
+{
+	size_t count = 0;
+	for (int i = 0; i < len; i++)
+		count += a[i] == b[i];
+	return count;
+}
+
+#ifdef MATCH_X86
+/*
+ *  match_count_avx2
+ *  Same as the scalar kernel, 16 slots an iteration in four vectors of counts (an equal lane is
+ *  all ones, so subtracting it adds 1)
+ */
+__attribute__((target("avx2")))
+size_t match_count_avx2(const uint64_t* a, const uint64_t* b, int len)
+{
+	__m256i counts_0 = _mm256_setzero_si256();
+	__m256i counts_1 = _mm256_setzero_si256();
+	__m256i counts_2 = _mm256_setzero_si256();
+	__m256i counts_3 = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		counts_0 = _mm256_sub_epi64(counts_0, _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i)),
+		                                                         _mm256_loadu_si256((const __m256i*)(b + i))));
+		counts_1 = _mm256_sub_epi64(counts_1, _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i + 4)),
+		                                                         _mm256_loadu_si256((const __m256i*)(b + i + 4))));
+		counts_2 = _mm256_sub_epi64(counts_2, _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i + 8)),
+		                                                         _mm256_loadu_si256((const __m256i*)(b + i + 8))));
+		counts_3 = _mm256_sub_epi64(counts_3, _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i + 12)),
+		                                                         _mm256_loadu_si256((const __m256i*)(b + i + 12))));
+	}
+	__m256i counts = _mm256_add_epi64(_mm256_add_epi64(counts_0, counts_1), _mm256_add_epi64(counts_2, counts_3));
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, counts);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + match_count_scalar(a + i, b + i, len - i);
+}
+
+/*
+ *  match_count_avx512
+ *  Same as the scalar kernel, 8 slots at a time into a mask that's popcounted
+ */
+__attribute__((target("avx512f,popcnt")))
+size_t match_count_avx512(const uint64_t* a, const uint64_t* b, int len)
+{
+	size_t count = 0;
+	int i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__mmask8 eq_0 = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+		__mmask8 eq_1 = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512(a + i + 8), _mm512_loadu_si512(b + i + 8));
+		count += __builtin_popcount(eq_0 | ((unsigned)eq_1 << 8));
+	}
+	return count + match_count_scalar(a + i, b + i, len - i);
+}
+#endif
+
+/*
+ *  match_simd
+ *  The widest instruction set the CPU has for the kernels (MATCH_KERNEL in the environment caps it)
+ */
+int match_simd(void)
+{
+	static int level = -1;
+	int picked = __atomic_load_n(&level, __ATOMIC_RELAXED);
+	if (picked >= 0)
+		return picked;
+	picked = MATCH_SCALAR;
+#ifdef MATCH_X86
+	const char* forced = getenv("MATCH_KERNEL");
+	bool scalar = forced != NULL && strcmp(forced, "scalar") == 0;
+	bool avx2 = forced != NULL && strcmp(forced, "avx2") == 0;
+	if (!scalar && !avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt"))
+		picked = MATCH_AVX512;
+	else if (!scalar && __builtin_cpu_supports("avx2"))
+		picked = MATCH_AVX2;
+#endif
+	__atomic_store_n(&level, picked, __ATOMIC_RELAXED);
+	return picked;
+}
+
+/*
+ *  match_kernel_pick
+ *  The fastest kernel available
+ */
+match_kernel match_kernel_pick(void)
+{
+#ifdef MATCH_X86
+	if (match_simd() == MATCH_AVX512)
+		return match_count_avx512;
+	if (match_simd() == MATCH_AVX2)
+		return match_count_avx2;
+#endif
+	return match_count_scalar;
+}
+
+/*
+ *  match_count
+ *  Number of slots two runs of `len` minimums agree on (fastest kernel available)
+ */
+size_t match_count(const uint64_t* a, const uint64_t* b, int len)
+{
+	return match_kernel_pick()(a, b, len);
+}
+
+/*
+ *  match_count_many
+ *  Compares a query with `num` signatures `stride` bytes apart starting at `first`, writing the
+ *  slots each agrees on to `counts`; signatures are `permutations` minimums, or packed to `bits`
+ *  bits (see BBit.h, unused slots of the last word count as matching)
+ */
+void match_count_many(const uint64_t* query, const void* first, size_t stride, int num, int permutations, int bits,
+                      int* counts)
+{
+	const unsigned char* sig = first;
+	if (bits != BBIT_FULL)
+	{
+		int words = bbit_words(permutations, bits);
+		for (int d = 0; d < num; d++, sig += stride)
+			counts[d] = bbit_matches(query, (const uint64_t*)sig, words, bits);
+		return;
+	}
+	match_kernel kernel = match_kernel_pick();
+	for (int d = 0; d < num; d++, sig += stride)
+	{
+		// start pulling in the next signature while this one is compared
+		if (d + 1 < num)
+			__builtin_prefetch(sig + stride);
+		counts[d] = kernel(query, (const uint64_t*)sig, permutations);
+	}
+}
+
+#endif
+/* MATCH_H */
@@ -0,0 +1,420 @@
+/*************************************************************************************************
+ *  Matrix.h
+ *  The stored signatures transposed into a slot-major matrix, for one-vs-all scans.
+ *
+ *  Documents are grouped in blocks of MATRIX_BLOCK, and a block holds slot 0 of its 64 documents,
+ *  then slot 1 of them, and so on. A scan broadcasts the query's slot i and compares it with the
+ *  block's 64 slot i's a vector at a time, keeping the 64 match counts in registers until the
+ *  block is done, so it streams through memory once with no per-document work at all.
+ *
+ *  A slot of a full signature takes 8 bytes (a block is as big as the same 64 signatures in the
+ *  store); a b-bit slot (see BBit.h) takes one byte, whatever b is, so it's compared 32 or 64
+ *  documents at a time with byte-wide counts that are widened every 255 slots.
+ *
+ *  File layout:
+ *  - matrix_header (64 bytes): magic, version, permutations, bits, bytes per slot, how many of the
+ *    store's documents it has and which store it's up to date with
+ *  - ceil(count / MATRIX_BLOCK) blocks of permutations * MATRIX_BLOCK slots (the unused columns
+ *    of the last block are zero)
+ *
+ *  The matrix has the store's first `count` documents. Documents added to the store after it was
+ *  built are compared straight from the store until they're an eighth of it, documents deleted
+ *  keep their columns until the next rebuild and queries have to skip them.
+ **************************************************************************************************/
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Store.h"
+#include "Match.h"
+
+#define MATRIX_PATH "matrix.db"
+#define MATRIX_MAGIC "PDMATRX"
+#define MATRIX_VERSION 1
+#define MATRIX_BLOCK 64                                 // documents in a block (as many as MATCH_BATCH)
+#define MATRIX_TAIL_MAX(count) ((count) / 8 + MATRIX_BLOCK)   // added documents before a rebuild
+
+// file header
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t permutations;
+	uint32_t bits;                  // bits per slot of the store's signatures
+	uint32_t lane;                  // bytes per slot in the matrix (8, or 1 for b-bit signatures)
+	uint64_t count;                 // documents in the matrix (the store's first `count`)
+	uint64_t store_generation;      // the store the matrix is up to date with
+	uint64_t reserved_1[3];
+} matrix_header;
+
+// an open (memory-mapped) matrix
+typedef struct
+{
+	int fd;
+	unsigned char* map;
+	size_t map_len;
+	matrix_header* header;
+} signature_matrix;
+
+/*
+ *  matrix_lane
+ *  Bytes a slot of `bits` bits takes in the matrix
+ */
+int matrix_lane(int bits)
+{
+	return (bits == BBIT_FULL) ? 8 : 1;
+}
+
+/*
+ *  matrix_block_size
+ *  Bytes taken up by one block
+ */
+size_t matrix_block_size(const matrix_header* header)
+{
+	return (size_t)header->permutations * MATRIX_BLOCK * header->lane;
+}
+
+/*
+ *  matrix_blocks
+ *  Number of blocks in a matrix
+ */
+int matrix_blocks(const signature_matrix* matrix)
+{
+	return (int)((matrix->header->count + MATRIX_BLOCK - 1) / MATRIX_BLOCK);
+}
+
+/*
+ *  matrix_block
+ *  Returns the b-th block
+ */
+const unsigned char* matrix_block(const signature_matrix* matrix, int b)
+{
+	return matrix->map + sizeof(matrix_header) + (size_t)b * matrix_block_size(matrix->header);
+}
+
+/*
+ *  matrix_slot
+ *  Slot i of a signature of `bits` bits per slot (the minimum itself for full signatures)
+ */
+static inline uint64_t matrix_slot(const uint64_t* signature, int i, int bits)
+{
+	if (bits == BBIT_FULL)
+		return signature[i];
+	int per_word = 64 / bits;
+	return (signature[i / per_word] >> ((i % per_word) * bits)) & ((1ULL << bits) - 1);
+}
+
+/*
+ *  matrix_close
+ *  Unmaps a matrix (safe to call on a matrix that was never opened)
+ */
+void matrix_close(signature_matrix* matrix)
+{
+	if (matrix->map != NULL)
+	{
+		munmap(matrix->map, matrix->map_len);
+		close(matrix->fd);
+	}
+	memset(matrix, 0, sizeof(*matrix));
+	matrix->fd = -1;
+}
+
+/*
+ *  matrix_open
+ *  Memory-maps a matrix, returns 0 on success and -1 if it's missing or unusable
+ */
+int matrix_open(signature_matrix* matrix, const char* path)
+{
+	memset(matrix, 0, sizeof(*matrix));
+	matrix->fd = -1;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	matrix_header header;
+	if (fstat(fd, &st) != 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC)) != 0 || header.version != MATRIX_VERSION ||
+	    header.lane != (uint32_t)matrix_lane(header.bits) ||
+	    (size_t)st.st_size != sizeof(header) + (header.count + MATRIX_BLOCK - 1) / MATRIX_BLOCK *
+	                                           matrix_block_size(&header))
+	{
+		close(fd);
+		return -1;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+	matrix->fd = fd;
+	matrix->map = map;
+	matrix->map_len = st.st_size;
+	matrix->header = map;
+	return 0;
+}
+
+/*
+ *  matrix_is_current
+ *  Whether an open matrix is up to date with the given store
+ */
+bool matrix_is_current(const signature_matrix* matrix, const signature_store* store)
+{
+	return matrix->header != NULL && store->header != NULL &&
+	       matrix->header->store_generation == store->header->generation &&
+	       matrix->header->permutations == store->header->permutations && matrix->header->bits == store->header->bits;
+}
+
+/*
+ *  matrix_build
+ *  Transposes every signature of the store into a matrix, written to a temporary file and then
+ *  atomically moved to `path`, returns 0 on success
+ */
+int matrix_build(const char* path, const signature_store* store)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE* fp = fopen(tmp, "wb");
+	if (fp == NULL)
+		return -1;
+	matrix_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC));
+	header.version = MATRIX_VERSION;
+	header.permutations = store->header->permutations;
+	header.bits = store->header->bits;
+	header.lane = matrix_lane(header.bits);
+	header.count = store_count(store);
+	header.store_generation = store->header->generation;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+	// one block at a time, a column per document
+	int permutations = header.permutations;
+	int bits = header.bits;
+	unsigned char* block = malloc(matrix_block_size(&header));
+	for (int first = 0; first < (int)header.count && ok; first += MATRIX_BLOCK)
+	{
+		memset(block, 0, matrix_block_size(&header));
+		int num = ((int)header.count - first < MATRIX_BLOCK) ? (int)header.count - first : MATRIX_BLOCK;
+		for (int d = 0; d < num; d++)
+		{
+			const uint64_t* signature = store_signature(store, first + d);
+			if (header.lane == 8)
+			{
+				for (int i = 0; i < permutations; i++)
+					((uint64_t*)block)[(size_t)i * MATRIX_BLOCK + d] = signature[i];
+			}
+			else
+			{
+				for (int i = 0; i < permutations; i++)
+					block[(size_t)i * MATRIX_BLOCK + d] = matrix_slot(signature, i, bits);
+			}
+		}
+		ok = fwrite(block, matrix_block_size(&header), 1, fp) == 1;
+	}
+	free(block);
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *  matrix_follow
+ *  Writes the matrix's header back marking it up to date with the store (documents added since
+ *  it was built are left to the store) and maps it again, returns 0 on success
+ */
+int matrix_follow(signature_matrix* matrix, const char* path, const signature_store* store)
+{
+	matrix_header header = *matrix->header;
+	header.store_generation = store->header->generation;
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	bool ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	matrix_close(matrix);
+	return (matrix_open(matrix, path) == 0 && ok) ? 0 : -1;
+}
+
+/*
+ *  matrix_query
+ *  Lays a query's signature out the way the matrix has its slots, in `lanes` (permutations slots
+ *  of the matrix's lane size)
+ */
+void matrix_query(const signature_matrix* matrix, const uint64_t* signature, void* lanes)
+{
+	int permutations = matrix->header->permutations;
+	if (matrix->header->lane == 8)
+		memcpy(lanes, signature, permutations * sizeof(uint64_t));
+	else
+	{
+		for (int i = 0; i < permutations; i++)
+			((unsigned char*)lanes)[i] = matrix_slot(signature, i, matrix->header->bits);
+	}
+}
+
+/*
+ *  matrix_counts_wide_scalar
+ *  Slots of 8 bytes every document of a block agrees with the query on
+ */
+void matrix_counts_wide_scalar(const uint64_t* block, const uint64_t* query, int permutations, int* counts)
+{
+	memset(counts, 0, MATRIX_BLOCK * sizeof(int));
+	for (int i = 0; i < permutations; i++)
+	{
+		const uint64_t* slots = block + (size_t)i * MATRIX_BLOCK;
+		for (int d = 0; d < MATRIX_BLOCK; d++)
+			counts[d] += slots[d] == query[i];
+	}
+}
+
+/*
+ *  matrix_counts_narrow_scalar
+ *  Slots of one byte every document of a block agrees with the query on
+ */
+void matrix_counts_narrow_scalar(const unsigned char* block, const unsigned char* query, int permutations,
+                                 int* counts)
+{
+	memset(counts, 0, MATRIX_BLOCK * sizeof(int));
+	for (int i = 0; i < permutations; i++)
+	{
+		const unsigned char* slots = block + (size_t)i * MATRIX_BLOCK;
+		for (int d = 0; d < MATRIX_BLOCK; d++)
+			counts[d] += slots[d] == query[i];
+	}
+}
+
+#ifdef MATCH_X86
+/*
+ *  matrix_counts_wide_avx2
+ *  Same as the scalar kernel, half a block at a time in eight vectors of counts
+ */
+__attribute__((target("avx2")))
+void matrix_counts_wide_avx2(const uint64_t* block, const uint64_t* query, int permutations, int* counts)
+{
+	for (int half = 0; half < MATRIX_BLOCK; half += 32)
+	{
+		__m256i acc[8];
+		for (int g = 0; g < 8; g++)
+			acc[g] = _mm256_setzero_si256();
+		for (int i = 0; i < permutations; i++)
+		{
+			__m256i q = _mm256_set1_epi64x(query[i]);
+			const uint64_t* slots = block + (size_t)i * MATRIX_BLOCK + half;
+			for (int g = 0; g < 8; g++)
+				acc[g] = _mm256_sub_epi64(acc[g], _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(slots + g * 4)), q));
+		}
+		uint64_t lanes[32];
+		for (int g = 0; g < 8; g++)
+			_mm256_storeu_si256((__m256i*)(lanes + g * 4), acc[g]);
+		for (int d = 0; d < 32; d++)
+			counts[half + d] = lanes[d];
+	}
+}
+
+/*
+ *  matrix_counts_wide_avx512
+ *  Same as the scalar kernel, the whole block in eight vectors of counts
+ */
+__attribute__((target("avx512f")))
+void matrix_counts_wide_avx512(const uint64_t* block, const uint64_t* query, int permutations, int* counts)
+{
+	__m512i acc[8];
+	__m512i one = _mm512_set1_epi64(1);
+	for (int g = 0; g < 8; g++)
+		acc[g] = _mm512_setzero_si512();
+	for (int i = 0; i < permutations; i++)
+	{
+		__m512i q = _mm512_set1_epi64(query[i]);
+		const uint64_t* slots = block + (size_t)i * MATRIX_BLOCK;
+		for (int g = 0; g < 8; g++)
+		{
+			__mmask8 eq = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512(slots + g * 8), q);
+			acc[g] = _mm512_mask_add_epi64(acc[g], eq, acc[g], one);
+		}
+	}
+	uint64_t lanes[MATRIX_BLOCK];
+	for (int g = 0; g < 8; g++)
+		_mm512_storeu_si512(lanes + g * 8, acc[g]);
+	for (int d = 0; d < MATRIX_BLOCK; d++)
+		counts[d] = lanes[d];
+}
+
+/*
+ *  matrix_counts_narrow_avx2
+ *  Same as the scalar kernel, the whole block in two vectors of byte-wide counts that are added
+ *  into four vectors of 16-bit counts before they can overflow
+ */
+__attribute__((target("avx2")))
+void matrix_counts_narrow_avx2(const unsigned char* block, const unsigned char* query, int permutations,
+                               int* counts)
+{
+	__m256i wide[4];
+	for (int g = 0; g < 4; g++)
+		wide[g] = _mm256_setzero_si256();
+	for (int start = 0; start < permutations; start += 255)
+	{
+		int end = (permutations - start < 255) ? permutations : start + 255;
+		__m256i narrow_0 = _mm256_setzero_si256();
+		__m256i narrow_1 = _mm256_setzero_si256();
+		for (int i = start; i < end; i++)
+		{
+			__m256i q = _mm256_set1_epi8((char)query[i]);
+			const unsigned char* slots = block + (size_t)i * MATRIX_BLOCK;
+			narrow_0 = _mm256_sub_epi8(narrow_0, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)slots), q));
+			narrow_1 = _mm256_sub_epi8(narrow_1, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(slots + 32)), q));
+		}
+		wide[0] = _mm256_add_epi16(wide[0], _mm256_cvtepu8_epi16(_mm256_castsi256_si128(narrow_0)));
+		wide[1] = _mm256_add_epi16(wide[1], _mm256_cvtepu8_epi16(_mm256_extracti128_si256(narrow_0, 1)));
+		wide[2] = _mm256_add_epi16(wide[2], _mm256_cvtepu8_epi16(_mm256_castsi256_si128(narrow_1)));
+		wide[3] = _mm256_add_epi16(wide[3], _mm256_cvtepu8_epi16(_mm256_extracti128_si256(narrow_1, 1)));
+	}
+	uint16_t lanes[MATRIX_BLOCK];
+	for (int g = 0; g < 4; g++)
+		_mm256_storeu_si256((__m256i*)(lanes + g * 16), wide[g]);
+	for (int d = 0; d < MATRIX_BLOCK; d++)
+		counts[d] = lanes[d];
+}
+#endif
+
+/*
+ *  matrix_counts
+ *  Writes how many slots each document of the b-th block agrees with the query on to `counts`
+ *  (MATRIX_BLOCK of them, the query laid out by matrix_query()), with the fastest kernel
+ *  available (see Match.h)
+ */
+void matrix_counts(const signature_matrix* matrix, int b, const void* query, int* counts)
+{
+	const unsigned char* block = matrix_block(matrix, b);
+	int permutations = matrix->header->permutations;
+	int simd = match_simd();
+#ifdef MATCH_X86
+	if (matrix->header->lane == 8 && simd == MATCH_AVX512)
+		matrix_counts_wide_avx512((const uint64_t*)block, query, permutations, counts);
+	else if (matrix->header->lane == 8 && simd == MATCH_AVX2)
+		matrix_counts_wide_avx2((const uint64_t*)block, query, permutations, counts);
+	else if (matrix->header->lane == 1 && simd != MATCH_SCALAR)
+		matrix_counts_narrow_avx2(block, query, permutations, counts);
+	else
+#endif
+	if (matrix->header->lane == 8)
+		matrix_counts_wide_scalar((const uint64_t*)block, query, permutations, counts);
+	else
+		matrix_counts_narrow_scalar(block, query, permutations, counts);
+	(void)simd;
+}
+
+#endif
+/* MATRIX_H */
@@ -0,0 +1,71 @@
+/*************************************************************************************************
+ *  OnePermutation.h
+ *  One permutation hashing (OPH) with optimal densification.
+ *
+ *  Instead of permuting every shingle `n` times, each shingle is hashed once and the hash picks
+ *  one of `n` bins, each bin keeping the smallest hash it has seen. Bins no shingle fell into are
+ *  then filled from a non-empty bin picked by a hash of (bin, attempt), which is the same for
+ *  every document, so two signatures stay comparable slot by slot just like k-permutation ones.
+ *  Building a signature costs O(shingles + n) instead of O(shingles * n).
+ *
+ *  Shrivastava, "Optimal Densification for Fast and Accurate Minwise Hashing", ICML 2017
+ **************************************************************************************************/
+#ifndef ONE_PERMUTATION_H
+#define ONE_PERMUTATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ *  oph_add
+ *  Puts one shingle hash into its bin
+ */
+void oph_add(uint64_t* signature, int n, uint64_t hash)
+{
+	int bin = (int)(((unsigned __int128)hash * (unsigned)n) >> 64);
+	if (hash < signature[bin])
+		signature[bin] = hash;
+}
+
+/*
+ *  oph_donor
+ *  The bin an empty bin tries to borrow from on a given attempt
+ */
+int oph_donor(uint64_t seed, int bin, int attempt, int n)
+{
+	uint64_t z = seed ^ ((uint64_t)bin * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)attempt * 0xC2B2AE3D27D4EB4FULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return (int)(((unsigned __int128)z * (unsigned)n) >> 64);
+}
+
+/*
+ *  oph_densify
+ *  Fills every empty bin from a bin that was non-empty (an empty document stays empty),
+ *  `empty` is scratch space for `n` flags
+ */
+void oph_densify(uint64_t* signature, int n, uint64_t seed, bool* empty)
+{
+	int num_empty = 0;
+	for (int i = 0; i < n; i++)
+	{
+		empty[i] = signature[i] == UINT64_MAX;
+		num_empty += empty[i];
+	}
+	if (num_empty > 0 && num_empty < n)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			if (!empty[i])
+				continue;
+			int donor = i;
+			for (int attempt = 1; empty[donor]; attempt++)
+				donor = oph_donor(seed, i, attempt, n);
+			signature[i] = signature[donor];
+		}
+	}
+}
+
+#endif
+/* ONE_PERMUTATION_H */
@@ -0,0 +1,221 @@
+/*************************************************************************************************
+ *  Permutation.h
+ *  Families of hash permutations used to compute MinHash signatures.
+ *
+ *  A family turns one 64-bit shingle hash into `n` permuted values from precomputed coefficient
+ *  tables and folds them into a signature of running minimums. Every family has a scalar kernel
+ *  and may have a vectorized one; the fastest kernel the CPU supports is picked at runtime
+ *  (set PERMUTATION_KERNEL=scalar in the environment to force the fallback).
+ *
+ *  Families
+ *  - multiply-add: p_i(x) = a_i * x + b_i (mod 2^64) with odd a_i, a bijection on 64-bit values
+ *
+ *  To add a family, write its coefficient and kernel functions and add it to perm_families.
+ **************************************************************************************************/
+#ifndef PERMUTATION_H
+#define PERMUTATION_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PERMUTATION_X86 1
+#endif
+
+#define PERMUTATION_MULTIPLY_ADD 1
+
+struct permutation;
+typedef void (*perm_fold_fn)(const struct permutation* perm, uint64_t x, uint64_t* signature);
+
+// a family of permutations
+typedef struct
+{
+	int id;                                         // stored with signatures built from it
+	const char* name;
+	void (*fill)(struct permutation* perm, uint64_t seed);
+	perm_fold_fn fold_scalar;
+	perm_fold_fn fold_avx2;                         // NULL if there's no vectorized kernel
+} perm_family;
+
+// `n` permutations of one family, ready to use
+typedef struct permutation
+{
+	const perm_family* family;
+	int n;
+	uint64_t* a;
+	uint64_t* b;
+	perm_fold_fn fold;
+	const char* kernel;
+} permutation;
+
+/*
+ *  splitmix64
+ *  Steps a splitmix64 generator (used to derive coefficients from a seed)
+ */
+uint64_t splitmix64(uint64_t* state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ *  multiply_add_fill
+ *  Random odd multipliers and random increments
+ */
+void multiply_add_fill(permutation* perm, uint64_t seed)
+{
+	uint64_t state = seed;
+	for (int i = 0; i < perm->n; i++)
+	{
+		perm->a[i] = splitmix64(&state) | 1;
+		perm->b[i] = splitmix64(&state);
+	}
+}
+
+/*
+ *  multiply_add_fold_scalar
+ *  Folds a*x+b of every permutation into the running minimums
+ */
+void multiply_add_fold_scalar(const permutation* perm, uint64_t x, uint64_t* signature)
+{
+	const uint64_t* a = perm->a;
+	const uint64_t* b = perm->b;
+	for (int i = 0; i < perm->n; i++)
+	{
+		uint64_t permuted = a[i] * x + b[i];
+		if (permuted < signature[i])
+			signature[i] = permuted;
+	}
+}
+
+#ifdef PERMUTATION_X86
+/*
+ *  multiply_add_fold_avx2
+ *  Same as the scalar kernel, 4 permutations at a time (64-bit multiplies are built from 32-bit
+ *  ones and the unsigned minimum from a signed compare with the sign bits flipped)
+ */
+__attribute__((target("avx2")))
+void multiply_add_fold_avx2(const permutation* perm, uint64_t x, uint64_t* signature)
+{
+	const __m256i x_lo = _mm256_set1_epi64x(x & 0xFFFFFFFFULL);
+	const __m256i x_hi = _mm256_set1_epi64x(x >> 32);
+	const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+	int i = 0;
+	for (; i + 4 <= perm->n; i += 4)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(perm->a + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(perm->b + i));
+		__m256i s = _mm256_loadu_si256((const __m256i*)(signature + i));
+
+		// a * x (mod 2^64) = lo(a) * lo(x) + ((hi(a) * lo(x) + lo(a) * hi(x)) << 32)
+		__m256i lo = _mm256_mul_epu32(a, x_lo);
+		__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), x_lo),
+		                                 _mm256_mul_epu32(a, x_hi));
+		__m256i v = _mm256_add_epi64(_mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32)), b);
+
+		// unsigned min
+		__m256i greater = _mm256_cmpgt_epi64(_mm256_xor_si256(s, sign), _mm256_xor_si256(v, sign));
+		_mm256_storeu_si256((__m256i*)(signature + i), _mm256_blendv_epi8(s, v, greater));
+	}
+	for (; i < perm->n; i++)
+	{
+		uint64_t permuted = perm->a[i] * x + perm->b[i];
+		if (permuted < signature[i])
+			signature[i] = permuted;
+	}
+}
+#endif
+
+// every available family
+const perm_family perm_families[] =
+{
+	{
+		PERMUTATION_MULTIPLY_ADD, "multiply-add", multiply_add_fill, multiply_add_fold_scalar,
+#ifdef PERMUTATION_X86
+		multiply_add_fold_avx2
+#else
+		NULL
+#endif
+	},
+};
+
+/*
+ *  perm_family_find
+ *  Finds a family by id, returns NULL if there isn't one
+ */
+const perm_family* perm_family_find(int id)
+{
+	for (size_t i = 0; i < sizeof(perm_families) / sizeof(perm_families[0]); i++)
+	{
+		if (perm_families[i].id == id)
+			return &perm_families[i];
+	}
+	return NULL;
+}
+
+/*
+ *  permutation_init
+ *  Builds `n` permutations of a family from a seed and picks the fastest kernel
+ */
+void permutation_init(permutation* perm, const perm_family* family, uint64_t seed, int n)
+{
+	perm->family = family;
+	perm->n = n;
+	perm->a = malloc(n * sizeof(uint64_t));
+	perm->b = malloc(n * sizeof(uint64_t));
+	family->fill(perm, seed);
+
+	// runtime kernel selection
+	const char* forced = getenv("PERMUTATION_KERNEL");
+	bool scalar_only = forced != NULL && strcmp(forced, "scalar") == 0;
+	perm->fold = family->fold_scalar;
+	perm->kernel = "scalar";
+#ifdef PERMUTATION_X86
+	if (!scalar_only && family->fold_avx2 != NULL && __builtin_cpu_supports("avx2"))
+	{
+		perm->fold = family->fold_avx2;
+		perm->kernel = "avx2";
+	}
+#endif
+	(void)scalar_only;
+}
+
+/*
+ *  permutation_free
+ *  Frees the coefficient tables
+ */
+void permutation_free(permutation* perm)
+{
+	free(perm->a);
+	free(perm->b);
+	memset(perm, 0, sizeof(*perm));
+}
+
+/*
+ *  permutation_slice
+ *  A view of permutations [first, first + n) of `perm` (shares its tables, don't free it)
+ */
+permutation permutation_slice(const permutation* perm, int first, int n)
+{
+	permutation slice = *perm;
+	slice.n = n;
+	slice.a = perm->a + first;
+	slice.b = perm->b + first;
+	return slice;
+}
+
+/*
+ *  permutation_fold
+ *  Permutes `x` with every permutation and keeps the running minimums in `signature`
+ */
+void permutation_fold(const permutation* perm, uint64_t x, uint64_t* signature)
+{
+	perm->fold(perm, x, signature);
+}
+
+#endif
+/* PERMUTATION_H */
@@ -0,0 +1,284 @@
+/*************************************************************************************************
+ *  Pool.h
+ *  A work-stealing thread pool for data parallel loops.
+ *
+ *  pool_parallel_for(pool, n, grain, fn, ctx) calls fn(ctx, i, worker) for every i in [0, n).
+ *  The range is split evenly between the workers (the calling thread is worker 0). Each worker
+ *  takes `grain` items at a time from the front of its own range and, once that runs dry, steals
+ *  the back half of the largest range left, so uneven items still keep every core busy.
+ *  `worker` is in [0, pool->num_workers) and is meant for indexing per-thread buffers.
+ *
+ *  Only one loop runs on a pool at a time; a loop started while another one is running (from
+ *  another thread or from inside a task) just runs serially on the calling thread.
+ **************************************************************************************************/
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef void (*pool_task_fn)(void* ctx, int index, int worker);
+
+// the items a worker still has to do
+typedef struct
+{
+	pthread_mutex_t lock;
+	int next;
+	int end;
+} pool_range;
+
+struct thread_pool;
+
+// what a pool thread needs to know about itself
+typedef struct
+{
+	struct thread_pool* pool;
+	int worker;
+} pool_thread;
+
+typedef struct thread_pool
+{
+	int num_workers;                // including the calling thread
+	pthread_t* threads;
+	pool_thread* thread_args;
+	pool_range* ranges;
+
+	// the current loop
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	pthread_mutex_t busy;
+	unsigned long generation;
+	int active;
+	bool stop;
+	pool_task_fn fn;
+	void* ctx;
+	int grain;
+} thread_pool;
+
+/*
+ *  pool_take
+ *  Takes up to `grain` items from the front of a range, returns how many
+ */
+int pool_take(pool_range* range, int grain, int* first)
+{
+	pthread_mutex_lock(&range->lock);
+	int n = range->end - range->next;
+	if (n > grain)
+		n = grain;
+	if (n < 0)
+		n = 0;
+	*first = range->next;
+	__atomic_store_n(&range->next, range->next + n, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&range->lock);
+	return n;
+}
+
+/*
+ *  pool_steal
+ *  Moves the back half of the fullest other range into the worker's own range, returns false
+ *  if there was nothing left to steal
+ */
+bool pool_steal(thread_pool* pool, int worker)
+{
+	while (true)
+	{
+		// find the fullest victim (without locking, it's only a hint)
+		int victim = -1;
+		int most = 0;
+		for (int i = 1; i < pool->num_workers; i++)
+		{
+			int v = (worker + i) % pool->num_workers;
+			int left = __atomic_load_n(&pool->ranges[v].end, __ATOMIC_RELAXED) -
+			           __atomic_load_n(&pool->ranges[v].next, __ATOMIC_RELAXED);
+			if (left > most)
+			{
+				most = left;
+				victim = v;
+			}
+		}
+		if (victim < 0)
+			return false;
+
+		// take half of what it has left
+		pool_range* from = &pool->ranges[victim];
+		pthread_mutex_lock(&from->lock);
+		int left = from->end - from->next;
+		if (left <= 0)
+		{
+			pthread_mutex_unlock(&from->lock);
+			continue;
+		}
+		int take = (left + 1) / 2;
+		int end = from->end;
+		__atomic_store_n(&from->end, end - take, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&from->lock);
+
+		pool_range* own = &pool->ranges[worker];
+		pthread_mutex_lock(&own->lock);
+		__atomic_store_n(&own->next, end - take, __ATOMIC_RELAXED);
+		__atomic_store_n(&own->end, end, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&own->lock);
+		return true;
+	}
+}
+
+/*
+ *  pool_work
+ *  Runs a worker's share of the current loop and steals until there's nothing left
+ */
+void pool_work(thread_pool* pool, int worker)
+{
+	int first;
+	do
+	{
+		int n;
+		while ((n = pool_take(&pool->ranges[worker], pool->grain, &first)) > 0)
+		{
+			for (int i = first; i < first + n; i++)
+				pool->fn(pool->ctx, i, worker);
+		}
+	}
+	while (pool_steal(pool, worker));
+}
+
+/*
+ *  pool_thread_main
+ *  Waits for loops and helps with them
+ */
+void* pool_thread_main(void* arg)
+{
+	pool_thread* self = arg;
+	thread_pool* pool = self->pool;
+	unsigned long seen = 0;
+	while (true)
+	{
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(pool, self->worker);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->active == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/*
+ *  pool_default_size
+ *  One worker per online core
+ */
+int pool_default_size(void)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cores > 0) ? (int)cores : 1;
+}
+
+/*
+ *  pool_init
+ *  Starts a pool of `num_workers` workers (the calling thread counts as one of them)
+ */
+void pool_init(thread_pool* pool, int num_workers)
+{
+	if (num_workers < 1)
+		num_workers = 1;
+	pool->num_workers = num_workers;
+	pool->ranges = calloc(num_workers, sizeof(pool_range));
+	for (int i = 0; i < num_workers; i++)
+		pthread_mutex_init(&pool->ranges[i].lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pthread_mutex_init(&pool->busy, NULL);
+	pool->generation = 0;
+	pool->active = 0;
+	pool->stop = false;
+	pool->threads = malloc(num_workers * sizeof(pthread_t));
+	pool->thread_args = malloc(num_workers * sizeof(pool_thread));
+	for (int i = 1; i < num_workers; i++)
+	{
+		pool->thread_args[i].pool = pool;
+		pool->thread_args[i].worker = i;
+		pthread_create(&pool->threads[i], NULL, pool_thread_main, &pool->thread_args[i]);
+	}
+}
+
+/*
+ *  pool_destroy
+ *  Stops and joins every worker
+ */
+void pool_destroy(thread_pool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 1; i < pool->num_workers; i++)
+		pthread_join(pool->threads[i], NULL);
+	for (int i = 0; i < pool->num_workers; i++)
+		pthread_mutex_destroy(&pool->ranges[i].lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	pthread_mutex_destroy(&pool->busy);
+	free(pool->ranges);
+	free(pool->threads);
+	free(pool->thread_args);
+}
+
+/*
+ *  pool_parallel_for
+ *  Calls fn(ctx, i, worker) for every i in [0, n) across the pool and waits for all of them
+ */
+void pool_parallel_for(thread_pool* pool, int n, int grain, pool_task_fn fn, void* ctx)
+{
+	if (grain < 1)
+		grain = 1;
+
+	// run serially if the pool is already busy or there's no point waking anyone up
+	if (pool->num_workers == 1 || n <= grain || pthread_mutex_trylock(&pool->busy) != 0)
+	{
+		for (int i = 0; i < n; i++)
+			fn(ctx, i, 0);
+		return;
+	}
+
+	// split the items evenly
+	for (int i = 0; i < pool->num_workers; i++)
+	{
+		__atomic_store_n(&pool->ranges[i].next, (int)((long)n * i / pool->num_workers), __ATOMIC_RELAXED);
+		__atomic_store_n(&pool->ranges[i].end, (int)((long)n * (i + 1) / pool->num_workers), __ATOMIC_RELAXED);
+	}
+
+	// wake the workers up and help out
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->ctx = ctx;
+	pool->grain = grain;
+	pool->active = pool->num_workers - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	pool_work(pool, 0);
+
+	// wait for the stragglers
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->busy);
+}
+
+#endif
+/* POOL_H */
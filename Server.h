@@ -0,0 +1,452 @@
+/*************************************************************************************************
+ *  Server.h
+ *  A line-oriented server on a Unix-domain socket.
+ *
+ *  One thread runs an epoll loop over the listening socket and every connection: it accepts
+ *  clients, reads whatever they send and cuts it into lines. Each complete line is a request that
+ *  goes on a queue for a fixed set of worker threads, which run it (server_query_fn) into a
+ *  buffer of their own and hand the response back to the loop to send. A connection has at most
+ *  one request running at a time, so responses come back in the order the requests were sent,
+ *  while requests of different connections run side by side.
+ *
+ *  A client that shuts down its end after sending still gets every answer before the connection
+ *  is closed. Every worker has its own arena, reset after every request. The loop stops on SIGINT
+ *  or SIGTERM, lets the requests that are running finish and removes the socket.
+ **************************************************************************************************/
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Arena.h"
+
+#define SERVER_BACKLOG 64           // connections waiting to be accepted
+#define SERVER_READ 4096            // bytes read from a connection at a time
+#define SERVER_LINE_MAX (1 << 16)   // longest request (a client sending longer lines is dropped)
+#define SERVER_EVENTS 64            // events handled per epoll_wait
+
+// runs one request (a line without its newline) and writes its response to `out`
+typedef void (*server_query_fn)(char* line, FILE* out, arena* scratch, void* ctx);
+
+// a client
+typedef struct server_conn
+{
+	int fd;
+	char* in;                       // what's been read and not handled yet
+	size_t in_len;
+	size_t in_cap;
+	char* out;                      // what's still to be sent
+	size_t out_len;
+	size_t out_sent;
+	bool busy;                      // a request of this connection is queued or running
+	bool eof;                       // the client is done sending (its requests are still answered)
+	bool closing;                   // the connection broke (freed once it isn't busy)
+	uint32_t watching;              // events the loop is waiting for (0 when it isn't registered)
+	struct server_conn* next_ready; // finished requests waiting for the loop
+	struct server_conn* next_job;   // requests waiting for a worker
+	char* job;                      // the request a worker is to run
+	char* response;                 // what the worker wrote, for the loop to send
+	size_t response_len;
+} server_conn;
+
+typedef struct
+{
+	int listen_fd;
+	int epoll_fd;
+	int wake_fd;                    // eventfd the workers signal the loop with
+	int signal_fd;
+	server_query_fn fn;
+	void* ctx;
+	pthread_mutex_t lock;           // protects the queues below
+	pthread_cond_t has_job;
+	server_conn* jobs;              // requests waiting for a worker (first in, first out)
+	server_conn* jobs_tail;
+	server_conn* ready;             // connections with a finished request
+	bool stopping;
+	int num_workers;
+	pthread_t* workers;
+} server;
+
+/*
+ *  server_worker_main
+ *  Runs requests off the queue until the server stops
+ */
+void* server_worker_main(void* arg)
+{
+	server* srv = arg;
+	arena scratch;
+	arena_init(&scratch, ARENA_CHUNK_SIZE);
+	for (;;)
+	{
+		pthread_mutex_lock(&srv->lock);
+		while (srv->jobs == NULL && !srv->stopping)
+			pthread_cond_wait(&srv->has_job, &srv->lock);
+		if (srv->jobs == NULL)
+		{
+			pthread_mutex_unlock(&srv->lock);
+			break;
+		}
+		server_conn* conn = srv->jobs;
+		srv->jobs = conn->next_job;
+		if (srv->jobs == NULL)
+			srv->jobs_tail = NULL;
+		pthread_mutex_unlock(&srv->lock);
+
+		// run it into a buffer of its own (the loop may still be sending the last response)
+		conn->response = NULL;
+		conn->response_len = 0;
+		FILE* out = open_memstream(&conn->response, &conn->response_len);
+		if (out != NULL)
+		{
+			srv->fn(conn->job, out, &scratch, srv->ctx);
+			fclose(out);
+		}
+		arena_reset(&scratch);
+		free(conn->job);
+		conn->job = NULL;
+
+		// hand it to the loop
+		pthread_mutex_lock(&srv->lock);
+		conn->next_ready = srv->ready;
+		srv->ready = conn;
+		pthread_mutex_unlock(&srv->lock);
+		uint64_t one = 1;
+		if (write(srv->wake_fd, &one, sizeof(one)) < 0)
+			perror("server: wake");
+	}
+	arena_free(&scratch);
+	return NULL;
+}
+
+/*
+ *  server_close_conn
+ *  Drops a connection (only once no request of it is running)
+ */
+void server_close_conn(server* srv, server_conn* conn)
+{
+	if (conn->watching != 0)
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out);
+	free(conn->job);
+	free(conn->response);
+	free(conn);
+}
+
+/*
+ *  server_watch
+ *  Waits for what a connection needs next: more requests unless the client is done sending, room
+ *  in the socket while some of a response is left
+ */
+void server_watch(server* srv, server_conn* conn)
+{
+	uint32_t events = 0;
+	if (!conn->closing)
+		events = (conn->eof ? 0 : EPOLLIN) | ((conn->out_len > 0) ? EPOLLOUT : 0);
+	if (events == conn->watching)
+		return;
+	struct epoll_event ev = {0};
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (events == 0)
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	else
+		epoll_ctl(srv->epoll_fd, (conn->watching == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->watching = events;
+}
+
+/*
+ *  server_flush
+ *  Sends as much of a connection's response as the socket takes, returns false if it's gone
+ */
+bool server_flush(server_conn* conn)
+{
+	while (conn->out_sent < conn->out_len)
+	{
+		ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (sent < 0)
+			return false;
+		conn->out_sent += sent;
+	}
+	if (conn->out_sent == conn->out_len)
+		conn->out_sent = conn->out_len = 0;
+	return true;
+}
+
+/*
+ *  server_dispatch
+ *  Queues the next complete line of a connection if it has no request running (once the client
+ *  is done sending, what's left without a newline is its last line), returns false if the
+ *  connection has to be dropped
+ */
+bool server_dispatch(server* srv, server_conn* conn)
+{
+	if (conn->busy || conn->closing || conn->in_len == 0)
+		return true;
+	char* newline = memchr(conn->in, '\n', conn->in_len);
+	if (newline == NULL && !conn->eof)
+		return conn->in_len < SERVER_LINE_MAX;
+
+	size_t len = (newline != NULL) ? (size_t)(newline - conn->in) : conn->in_len;
+	conn->job = malloc(len + 1);
+	memcpy(conn->job, conn->in, len);
+	conn->job[len] = '\0';
+	size_t used = (newline != NULL) ? len + 1 : len;
+	conn->in_len -= used;
+	memmove(conn->in, conn->in + used, conn->in_len);
+
+	conn->busy = true;
+	conn->next_job = NULL;
+	pthread_mutex_lock(&srv->lock);
+	if (srv->jobs_tail != NULL)
+		srv->jobs_tail->next_job = conn;
+	else
+		srv->jobs = conn;
+	srv->jobs_tail = conn;
+	pthread_cond_signal(&srv->has_job);
+	pthread_mutex_unlock(&srv->lock);
+	return true;
+}
+
+/*
+ *  server_read
+ *  Reads what a client sent, returns false if the connection has to be dropped
+ */
+bool server_read(server* srv, server_conn* conn)
+{
+	for (;;)
+	{
+		if (conn->in_cap - conn->in_len < SERVER_READ)
+		{
+			conn->in_cap = conn->in_cap * 2 + SERVER_READ;
+			conn->in = realloc(conn->in, conn->in_cap);
+		}
+		ssize_t got = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (got < 0)
+			return false;
+		if (got == 0)
+		{
+			conn->eof = true;
+			break;
+		}
+		conn->in_len += got;
+	}
+	return server_dispatch(srv, conn);
+}
+
+/*
+ *  server_listen
+ *  Opens the listening socket at `path` (replacing a stale one), returns its descriptor or -1
+ */
+int server_listen(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_BACKLOG) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ *  server_run
+ *  Serves requests on the socket at `path` with `num_workers` workers until SIGINT or SIGTERM,
+ *  returns 0 on a clean stop and -1 if the socket can't be opened
+ */
+int server_run(const char* path, int num_workers, server_query_fn fn, void* ctx)
+{
+	server srv;
+	memset(&srv, 0, sizeof(srv));
+	srv.fn = fn;
+	srv.ctx = ctx;
+	srv.listen_fd = server_listen(path);
+	if (srv.listen_fd < 0)
+		return -1;
+
+	// signals come in through the loop (blocked before the workers start, so they inherit it)
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	srv.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	srv.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int* fds[3] = {&srv.listen_fd, &srv.wake_fd, &srv.signal_fd};
+	for (int i = 0; i < 3; i++)
+	{
+		struct epoll_event ev = {0};
+		ev.events = EPOLLIN;
+		ev.data.ptr = fds[i];       // a connection's events carry the connection instead
+		epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, *fds[i], &ev);
+	}
+
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.has_job, NULL);
+	srv.num_workers = (num_workers > 0) ? num_workers : 1;
+	srv.workers = malloc(srv.num_workers * sizeof(pthread_t));
+	for (int i = 0; i < srv.num_workers; i++)
+		pthread_create(&srv.workers[i], NULL, server_worker_main, &srv);
+
+	// every connection, so they can all be dropped when the server stops
+	size_t num_conns = 0;
+	size_t conns_cap = 16;
+	server_conn** conns = malloc(conns_cap * sizeof(server_conn*));
+
+	bool running = true;
+	struct epoll_event events[SERVER_EVENTS];
+	while (running)
+	{
+		int n = epoll_wait(srv.epoll_fd, events, SERVER_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		for (int e = 0; e < n; e++)
+		{
+			void* source = events[e].data.ptr;
+
+			// new clients
+			if (source == &srv.listen_fd)
+			{
+				int client;
+				while ((client = accept4(srv.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+				{
+					server_conn* conn = calloc(1, sizeof(server_conn));
+					conn->fd = client;
+					server_watch(&srv, conn);
+					if (num_conns == conns_cap)
+					{
+						conns_cap *= 2;
+						conns = realloc(conns, conns_cap * sizeof(server_conn*));
+					}
+					conns[num_conns++] = conn;
+				}
+				continue;
+			}
+
+			// time to stop
+			if (source == &srv.signal_fd)
+			{
+				running = false;
+				continue;
+			}
+
+			// finished requests: send their responses and start the next request of each
+			if (source == &srv.wake_fd)
+			{
+				uint64_t count;
+				if (read(srv.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					perror("server: wake");
+				pthread_mutex_lock(&srv.lock);
+				server_conn* ready = srv.ready;
+				srv.ready = NULL;
+				for (server_conn* conn = ready; conn != NULL; conn = conn->next_ready)
+					conn->busy = false;
+				pthread_mutex_unlock(&srv.lock);
+				while (ready != NULL)
+				{
+					server_conn* conn = ready;
+					ready = conn->next_ready;
+					if (conn->response_len > 0)
+					{
+						conn->out = realloc(conn->out, conn->out_len + conn->response_len);
+						memcpy(conn->out + conn->out_len, conn->response, conn->response_len);
+						conn->out_len += conn->response_len;
+					}
+					free(conn->response);
+					conn->response = NULL;
+					if (conn->closing || !server_flush(conn) || !server_dispatch(&srv, conn))
+						conn->closing = true;
+					server_watch(&srv, conn);
+				}
+				continue;
+			}
+
+			// a client
+			server_conn* conn = source;
+			bool alive = !conn->closing;
+			if (alive && (events[e].events & EPOLLOUT))
+				alive = server_flush(conn);
+			if (alive && !conn->eof && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				alive = server_read(&srv, conn);
+			if (!alive)
+				conn->closing = true;
+			server_watch(&srv, conn);
+		}
+
+		// drop the connections that are done with (a client that's done sending gets its answers first)
+		size_t kept = 0;
+		for (size_t i = 0; i < num_conns; i++)
+		{
+			server_conn* conn = conns[i];
+			bool answered = conn->eof && conn->out_len == 0 && conn->in_len == 0;
+			if (!conn->busy && (conn->closing || answered))
+				server_close_conn(&srv, conn);
+			else
+				conns[kept++] = conn;
+		}
+		num_conns = kept;
+	}
+
+	// let the running requests finish, then shut everything down
+	pthread_mutex_lock(&srv.lock);
+	srv.stopping = true;
+	for (server_conn* conn = srv.jobs; conn != NULL; conn = conn->next_job)
+	{
+		free(conn->job);
+		conn->job = NULL;
+	}
+	srv.jobs = srv.jobs_tail = NULL;
+	pthread_cond_broadcast(&srv.has_job);
+	pthread_mutex_unlock(&srv.lock);
+	for (int i = 0; i < srv.num_workers; i++)
+		pthread_join(srv.workers[i], NULL);
+	for (size_t i = 0; i < num_conns; i++)
+		server_close_conn(&srv, conns[i]);
+	free(conns);
+	free(srv.workers);
+	pthread_mutex_destroy(&srv.lock);
+	pthread_cond_destroy(&srv.has_job);
+	close(srv.epoll_fd);
+	close(srv.wake_fd);
+	close(srv.signal_fd);
+	close(srv.listen_fd);
+	unlink(path);
+	pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+	return 0;
+}
+
+#endif
+/* SERVER_H */
@@ -0,0 +1,92 @@
+/*************************************************************************************************
+ *  Shingle.h
+ *  Rolling shingle hasher.
+ *
+ *  Every word is hashed once with MurmurHash2 and a shingle's hash is a polynomial over the
+ *  hashes of its words, H = w_1 * B^(L-1) + ... + w_L (mod 2^64). When a new word comes in, the
+ *  oldest one is rolled out of H in constant time, so no shingle string is ever built and the
+ *  cost per word doesn't depend on the shingle length. The polynomial is finalized with a
+ *  64-bit mixer so shingle hashes are as well spread as word hashes.
+ **************************************************************************************************/
+#ifndef SHINGLE_H
+#define SHINGLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "MurmurHash2.h"
+
+#define MAX_SHINGLE_LENGTH 64
+#define SHINGLE_BASE 0x9E3779B97F4A7C15ULL
+
+// a window over the last `length` words
+typedef struct
+{
+	int length;
+	uint64_t seed;
+	uint64_t window[MAX_SHINGLE_LENGTH];    // word hashes (circular)
+	int head;                               // oldest word
+	long words;                             // words seen so far
+	uint64_t hash;                          // polynomial over the window
+	uint64_t base_power;                    // B^(length - 1)
+} shingler;
+
+/*
+ *  shingler_init
+ *  Starts a window of `length` words whose words are hashed with `seed`
+ */
+void shingler_init(shingler* sh, int length, uint64_t seed)
+{
+	sh->length = length;
+	sh->seed = seed;
+	sh->head = 0;
+	sh->words = 0;
+	sh->hash = 0;
+	sh->base_power = 1;
+	for (int i = 1; i < length; i++)
+		sh->base_power *= SHINGLE_BASE;
+}
+
+/*
+ *  shingle_mix
+ *  Finalizes a shingle hash (the MurmurHash3 64-bit finalizer)
+ */
+uint64_t shingle_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ *  shingler_push_hash
+ *  Adds an already hashed word, returns true and the shingle ending at it once the window is full
+ */
+bool shingler_push_hash(shingler* sh, uint64_t word_hash, uint64_t* shingle)
+{
+	// roll the oldest word out once the window is full
+	if (sh->words >= sh->length)
+		sh->hash -= sh->window[sh->head] * sh->base_power;
+	sh->hash = sh->hash * SHINGLE_BASE + word_hash;
+	sh->window[sh->head] = word_hash;
+	sh->head = (sh->head + 1) % sh->length;
+	sh->words++;
+	if (sh->words < sh->length)
+		return false;
+	*shingle = shingle_mix(sh->hash);
+	return true;
+}
+
+/*
+ *  shingler_push
+ *  Adds a word, returns true and the shingle ending at it once the window is full
+ */
+bool shingler_push(shingler* sh, const char* word, int len, uint64_t* shingle)
+{
+	return shingler_push_hash(sh, MurmurHash64A(word, len, sh->seed), shingle);
+}
+
+#endif
+/* SHINGLE_H */
@@ -0,0 +1,306 @@
+/*************************************************************************************************
+ *  SigCache.h
+ *  Content-addressed cache of the signatures of documents outside the database.
+ *
+ *  A signature is looked up by the hash of the document's contents (see Catalog.h) along with
+ *  every parameter it depends on (seed, permutations, shingle length and engine), so a document
+ *  that changes simply stops matching its old entries and a store built with other parameters
+ *  never sees them. Signatures are cached with all of their 64-bit minimums, before they're cut
+ *  down to b bits, so changing --bbit doesn't miss.
+ *
+ *  There are two tiers: the SIGCACHE_ENTRIES most recently used signatures in memory (a hash
+ *  table threaded onto an LRU list), and one file per signature in SIGCACHE_DIR, named after the
+ *  key and written to a temporary file first so readers never see half of one. The disk tier
+ *  isn't bounded, delete the directory to clear it. Hits of both tiers and misses are counted
+ *  in the statistics (see Stats.h).
+ **************************************************************************************************/
+#ifndef SIGCACHE_H
+#define SIGCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "MurmurHash2.h"
+#include "Stats.h"
+
+#define SIGCACHE_DIR "sigcache"
+#define SIGCACHE_MAGIC "PDSIGC1"
+#define SIGCACHE_ENTRIES 256        // signatures kept in memory
+
+// results of a lookup
+#define SIGCACHE_MISS 0
+#define SIGCACHE_MEMORY 1
+#define SIGCACHE_DISK 2
+
+// what a signature depends on
+typedef struct
+{
+	uint64_t hash;                  // hash of the document's contents
+	uint64_t seed;
+	uint32_t permutations;
+	uint32_t shingle_length;
+	uint32_t engine;
+	uint32_t reserved_0;
+} sigcache_key;
+
+// a signature in memory
+typedef struct sigcache_entry
+{
+	sigcache_key key;
+	struct sigcache_entry* prev;    // LRU list, most recently used first
+	struct sigcache_entry* next;
+	struct sigcache_entry* chain;   // next entry of the same bucket
+	uint64_t* signature;
+} sigcache_entry;
+
+// the cache
+typedef struct
+{
+	pthread_mutex_t lock;           // guards the memory tier
+	const char* dir;                // the disk tier (NULL for none)
+	int permutations;               // minimums per signature
+	int capacity;
+	int len;
+	sigcache_entry* entries;
+	sigcache_entry** buckets;       // capacity * 2 of them
+	sigcache_entry lru;             // head of the LRU list (lru.next is the most recently used)
+	uint64_t* signatures;           // capacity * permutations minimums
+} sig_cache;
+
+/*
+ *  sigcache_init
+ *  Starts an empty cache of `capacity` signatures of `permutations` minimums in memory, backed
+ *  by the directory `dir` (NULL keeps it all in memory)
+ */
+void sigcache_init(sig_cache* cache, const char* dir, int capacity, int permutations)
+{
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->dir = dir;
+	cache->permutations = permutations;
+	cache->capacity = capacity;
+	cache->entries = calloc(capacity, sizeof(sigcache_entry));
+	cache->buckets = calloc(capacity * 2, sizeof(sigcache_entry*));
+	cache->signatures = malloc((size_t)capacity * permutations * sizeof(uint64_t));
+	cache->lru.next = &cache->lru;
+	cache->lru.prev = &cache->lru;
+	for (int i = 0; i < capacity; i++)
+		cache->entries[i].signature = cache->signatures + (size_t)i * permutations;
+}
+
+/*
+ *  sigcache_free
+ *  Releases the memory tier
+ */
+void sigcache_free(sig_cache* cache)
+{
+	free(cache->entries);
+	free(cache->buckets);
+	free(cache->signatures);
+	pthread_mutex_destroy(&cache->lock);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/*
+ *  sigcache_key_hash
+ *  Hash of a whole key
+ */
+uint64_t sigcache_key_hash(const sigcache_key* key)
+{
+	return MurmurHash64A(key, sizeof(*key), 0);
+}
+
+/*
+ *  sigcache_same_key
+ *  Whether two keys are the same
+ */
+bool sigcache_same_key(const sigcache_key* a, const sigcache_key* b)
+{
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/*
+ *  sigcache_bucket
+ *  The bucket of a key
+ */
+sigcache_entry** sigcache_bucket(sig_cache* cache, const sigcache_key* key)
+{
+	return &cache->buckets[sigcache_key_hash(key) % (cache->capacity * 2)];
+}
+
+/*
+ *  sigcache_unlink
+ *  Takes an entry off the LRU list
+ */
+void sigcache_unlink(sigcache_entry* entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+/*
+ *  sigcache_push_front
+ *  Puts an entry at the front of the LRU list
+ */
+void sigcache_push_front(sig_cache* cache, sigcache_entry* entry)
+{
+	entry->prev = &cache->lru;
+	entry->next = cache->lru.next;
+	cache->lru.next->prev = entry;
+	cache->lru.next = entry;
+}
+
+/*
+ *  sigcache_path
+ *  The file of a key in the disk tier
+ */
+void sigcache_path(const sig_cache* cache, const sigcache_key* key, char* path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx-%016llx.sig", cache->dir, (unsigned long long)key->hash,
+	         (unsigned long long)sigcache_key_hash(key));
+}
+
+/*
+ *  sigcache_remember
+ *  Keeps a signature in the memory tier, in place of the least recently used one when it's full
+ *  (call with the lock held)
+ */
+void sigcache_remember(sig_cache* cache, const sigcache_key* key, const uint64_t* signature)
+{
+	sigcache_entry* entry;
+	if (cache->len < cache->capacity)
+		entry = &cache->entries[cache->len++];
+	else
+	{
+		// evict the least recently used
+		entry = cache->lru.prev;
+		sigcache_unlink(entry);
+		sigcache_entry** link = sigcache_bucket(cache, &entry->key);
+		while (*link != entry)
+			link = &(*link)->chain;
+		*link = entry->chain;
+	}
+	entry->key = *key;
+	memcpy(entry->signature, signature, cache->permutations * sizeof(uint64_t));
+	sigcache_entry** bucket = sigcache_bucket(cache, key);
+	entry->chain = *bucket;
+	*bucket = entry;
+	sigcache_push_front(cache, entry);
+}
+
+/*
+ *  sigcache_read
+ *  Reads a signature from the disk tier, returns 0 on success
+ */
+int sigcache_read(const sig_cache* cache, const sigcache_key* key, uint64_t* signature)
+{
+	char path[PATH_MAX];
+	sigcache_path(cache, key, path, sizeof(path));
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL)
+		return -1;
+	char magic[8];
+	sigcache_key stored;
+	bool ok = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, SIGCACHE_MAGIC, sizeof(SIGCACHE_MAGIC)) == 0 &&
+	          fread(&stored, sizeof(stored), 1, fp) == 1 && sigcache_same_key(&stored, key) &&
+	          fread(signature, sizeof(uint64_t), cache->permutations, fp) == (size_t)cache->permutations;
+	fclose(fp);
+	return ok ? 0 : -1;
+}
+
+/*
+ *  sigcache_write
+ *  Writes a signature to the disk tier, returns 0 on success
+ */
+int sigcache_write(const sig_cache* cache, const sigcache_key* key, const uint64_t* signature)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	sigcache_path(cache, key, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s/.sig-XXXXXX", cache->dir);
+	mkdir(cache->dir, 0755);
+	int fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	FILE* fp = fdopen(fd, "wb");
+	if (fp == NULL)
+	{
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	bool ok = fwrite(SIGCACHE_MAGIC, 8, 1, fp) == 1 && fwrite(key, sizeof(*key), 1, fp) == 1 &&
+	          fwrite(signature, sizeof(uint64_t), cache->permutations, fp) == (size_t)cache->permutations;
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *  sigcache_get
+ *  Looks a signature up, memory first, then disk (a disk hit is kept in memory), and returns
+ *  which tier had it or SIGCACHE_MISS (thread-safe)
+ */
+int sigcache_get(sig_cache* cache, const sigcache_key* key, uint64_t* signature)
+{
+	pthread_mutex_lock(&cache->lock);
+	for (sigcache_entry* entry = *sigcache_bucket(cache, key); entry != NULL; entry = entry->chain)
+	{
+		if (sigcache_same_key(&entry->key, key))
+		{
+			memcpy(signature, entry->signature, cache->permutations * sizeof(uint64_t));
+			sigcache_unlink(entry);
+			sigcache_push_front(cache, entry);
+			pthread_mutex_unlock(&cache->lock);
+			STATS_ADD(COUNTER_CACHE_MEMORY, 1);
+			return SIGCACHE_MEMORY;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	// the disk is read without the lock, another thread may remember the same signature meanwhile
+	if (cache->dir == NULL || sigcache_read(cache, key, signature) != 0)
+	{
+		STATS_ADD(COUNTER_CACHE_MISSES, 1);
+		return SIGCACHE_MISS;
+	}
+	pthread_mutex_lock(&cache->lock);
+	bool known = false;
+	for (sigcache_entry* entry = *sigcache_bucket(cache, key); entry != NULL && !known; entry = entry->chain)
+		known = sigcache_same_key(&entry->key, key);
+	if (!known)
+		sigcache_remember(cache, key, signature);
+	pthread_mutex_unlock(&cache->lock);
+	STATS_ADD(COUNTER_CACHE_DISK, 1);
+	return SIGCACHE_DISK;
+}
+
+/*
+ *  sigcache_put
+ *  Caches a signature that was just computed, in memory and on disk (thread-safe); returns 0
+ *  on success, or -1 if it couldn't be written to disk
+ */
+int sigcache_put(sig_cache* cache, const sigcache_key* key, const uint64_t* signature)
+{
+	pthread_mutex_lock(&cache->lock);
+	bool known = false;
+	for (sigcache_entry* entry = *sigcache_bucket(cache, key); entry != NULL && !known; entry = entry->chain)
+		known = sigcache_same_key(&entry->key, key);
+	if (!known)
+		sigcache_remember(cache, key, signature);
+	pthread_mutex_unlock(&cache->lock);
+	return (cache->dir == NULL) ? 0 : sigcache_write(cache, key, signature);
+}
+
+#endif
+/* SIGCACHE_H */
@@ -0,0 +1,226 @@
+/*************************************************************************************************
+ *  Stats.h
+ *  Per-stage timers and counters of the comparison pipeline.
+ *
+ *  Time is measured in ticks of the CPU's time stamp counter (rdtsc, a few cycles to read) and
+ *  converted to nanoseconds with the rate the counter ran at since the process started. The
+ *  stages of the per-word loops go in a stats_frame on the stack and are added to the shared
+ *  totals once per document (stats_flush), so workers don't fight over cache lines per word;
+ *  rarer events (mapping a file, comparing two signatures, an allocation) are added right away.
+ *
+ *  Everything is added twice, to the totals of the current query (cleared by
+ *  stats_begin_query()) and to the totals of the process. Build with -DSTATS=0 (make STATS=0)
+ *  and every STATS_* macro expands to nothing, so the pipeline doesn't pay for any of it.
+ **************************************************************************************************/
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "Batch.h"
+
+#ifndef STATS
+#define STATS 1                     // 0 compiles the instrumentation out
+#endif
+
+// stages of the pipeline
+#define STAGE_IO 0                  // opening and mapping documents
+#define STAGE_TOKENIZE 1            // splitting text into words (page faults of a mapping land here)
+#define STAGE_HASH 2                // hashing words into shingles
+#define STAGE_PERMUTE 3             // folding shingles into signatures
+#define STAGE_COMPARE 4             // counting the matching minimums of two signatures
+#define STAGE_COUNT 5
+
+// counters
+#define COUNTER_WORDS 0
+#define COUNTER_SHINGLES 1
+#define COUNTER_ALLOCATIONS 2       // arena allocations
+#define COUNTER_BYTES_READ 3        // bytes of documents mapped
+#define COUNTER_PRUNED 4            // comparisons a top-k query gave up on early
+#define COUNTER_CACHE_MEMORY 5      // signatures found in the memory tier of the cache (see SigCache.h)
+#define COUNTER_CACHE_DISK 6        // signatures found in the disk tier of the cache
+#define COUNTER_CACHE_MISSES 7      // signatures the cache didn't have
+#define COUNTER_COUNT 8
+
+static const char* const stats_stage_names[STAGE_COUNT] = {"io", "tokenize", "hash", "permute", "compare"};
+static const char* const stats_counter_names[COUNTER_COUNT] = {"words", "shingles", "allocations", "bytes_read", "pruned",
+                                                                     "cache_memory_hits", "cache_disk_hits", "cache_misses"};
+
+// ticks spent in every stage and the counters
+typedef struct
+{
+	uint64_t ticks[STAGE_COUNT];
+	uint64_t counters[COUNTER_COUNT];
+} stats_frame;
+
+stats_frame stats_query;            // since the current query started
+stats_frame stats_process;          // since the process started
+uint64_t stats_start_ticks;         // when the process started, for converting ticks to time
+double stats_start_ns;
+
+/*
+ *  stats_ticks
+ *  Reads the time stamp counter (the monotonic clock in nanoseconds where there's none)
+ */
+static inline uint64_t stats_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ *  stats_now_ns
+ *  Monotonic clock in nanoseconds
+ */
+double stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ *  stats_init
+ *  Starts the clock the tick rate is measured against
+ */
+void stats_init(void)
+{
+	stats_start_ticks = stats_ticks();
+	stats_start_ns = stats_now_ns();
+}
+
+/*
+ *  stats_ns_per_tick
+ *  Nanoseconds per tick, averaged over the life of the process
+ */
+double stats_ns_per_tick(void)
+{
+	uint64_t ticks = stats_ticks() - stats_start_ticks;
+	return (ticks > 0) ? (stats_now_ns() - stats_start_ns) / ticks : 0;
+}
+
+/*
+ *  stats_add_ticks
+ *  Adds time spent in a stage to the totals (thread-safe)
+ */
+void stats_add_ticks(int stage, uint64_t ticks)
+{
+	__atomic_add_fetch(&stats_query.ticks[stage], ticks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats_process.ticks[stage], ticks, __ATOMIC_RELAXED);
+}
+
+/*
+ *  stats_add_count
+ *  Adds to a counter of the totals (thread-safe)
+ */
+void stats_add_count(int counter, uint64_t n)
+{
+	__atomic_add_fetch(&stats_query.counters[counter], n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats_process.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*
+ *  stats_flush
+ *  Adds a frame to the totals and clears it
+ */
+void stats_flush(stats_frame* frame)
+{
+	for (int i = 0; i < STAGE_COUNT; i++)
+	{
+		if (frame->ticks[i] > 0)
+			stats_add_ticks(i, frame->ticks[i]);
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++)
+	{
+		if (frame->counters[i] > 0)
+			stats_add_count(i, frame->counters[i]);
+	}
+	memset(frame, 0, sizeof(*frame));
+}
+
+/*
+ *  stats_begin_query
+ *  Clears the totals of the current query (only call it while no query is running)
+ */
+void stats_begin_query(void)
+{
+	memset(&stats_query, 0, sizeof(stats_query));
+}
+
+/*
+ *  stats_print
+ *  Prints a snapshot of totals as a table
+ */
+void stats_print(FILE* out, const char* title, const stats_frame* frame)
+{
+	double ns_per_tick = stats_ns_per_tick();
+	fprintf(out, "%s\n", title);
+	fprintf(out, "  %-12s %16s %16s\n", "stage", "ticks", "ms");
+	for (int i = 0; i < STAGE_COUNT; i++)
+		fprintf(out, "  %-12s %16" PRIu64 " %16.3f\n", stats_stage_names[i], frame->ticks[i],
+		        frame->ticks[i] * ns_per_tick / 1e6);
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		fprintf(out, "  %-12s %16" PRIu64 "\n", stats_counter_names[i], frame->counters[i]);
+}
+
+/*
+ *  stats_emit
+ *  Writes a snapshot of totals in a batch format: one JSON object, or with CSV one row per number
+ *  (file_1 is the scope, file_2 the name and similarity the value)
+ */
+void stats_emit(FILE* out, int format, const char* scope, const stats_frame* frame)
+{
+	double ns_per_tick = stats_ns_per_tick();
+	if (format == BATCH_CSV)
+	{
+		for (int i = 0; i < STAGE_COUNT; i++)
+		{
+			fprintf(out, "stats,%s,%s_ticks,,%" PRIu64 ",,,,,,\n", scope, stats_stage_names[i], frame->ticks[i]);
+			fprintf(out, "stats,%s,%s_ns,,%.0f,,,,,,\n", scope, stats_stage_names[i], frame->ticks[i] * ns_per_tick);
+		}
+		for (int i = 0; i < COUNTER_COUNT; i++)
+			fprintf(out, "stats,%s,%s,,%" PRIu64 ",,,,,,\n", scope, stats_counter_names[i], frame->counters[i]);
+		return;
+	}
+
+	fprintf(out, "{\"query\":\"stats\",\"scope\":\"%s\"", scope);
+	for (int i = 0; i < STAGE_COUNT; i++)
+		fprintf(out, ",\"%s_ticks\":%" PRIu64 ",\"%s_ns\":%.0f", stats_stage_names[i], frame->ticks[i],
+		        stats_stage_names[i], frame->ticks[i] * ns_per_tick);
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		fprintf(out, ",\"%s\":%" PRIu64, stats_counter_names[i], frame->counters[i]);
+	fputs("}\n", out);
+}
+
+#if STATS
+#define STATS_FRAME(f) stats_frame f; memset(&f, 0, sizeof(f))
+#define STATS_MARK(t) uint64_t t = stats_ticks()
+#define STATS_LAP(f, stage, t) do { uint64_t stats_now_ = stats_ticks(); (f).ticks[stage] += stats_now_ - (t); \
+                                    (t) = stats_now_; } while (0)
+#define STATS_COUNT(f, counter, n) ((f).counters[counter] += (n))
+#define STATS_FLUSH(f) stats_flush(&(f))
+#define STATS_SPAN(stage, t) stats_add_ticks(stage, stats_ticks() - (t))
+#define STATS_ADD(counter, n) stats_add_count(counter, n)
+#else
+#define STATS_FRAME(f)
+#define STATS_MARK(t)
+#define STATS_LAP(f, stage, t)
+#define STATS_COUNT(f, counter, n)
+#define STATS_FLUSH(f)
+#define STATS_SPAN(stage, t)
+#define STATS_ADD(counter, n)
+#endif
+
+#endif
+/* STATS_H */
@@ -0,0 +1,602 @@
+/*************************************************************************************************
+ *  Store.h
+ *  Persistent on-disk MinHash signature store.
+ *
+ *  File layout (all integers little-endian, native width):
+ *  - store_header (80 bytes): magic, format version and the parameters the signatures were
+ *    built with (permutations, permutation family, signature engine, shingle length, seed and
+ *    bits kept of every minimum)
+ *  - `count` records, each a store_record (256 bytes) immediately followed by the document's
+ *    signature: `permutations` 64-bit minimums, or their lowest `bits` bits packed into words
+ *    (see BBit.h)
+ *
+ *  The file is written in full by boot() when there's no usable store and memory-mapped
+ *  read-only by every later query, so comparing against a corpus document never touches its raw
+ *  text. After that documents change one at a time: a new document is appended, a removed one is
+ *  tombstoned (flagged deleted, its record stays where it is) and a changed one is both. Once a
+ *  quarter of the records are tombstones, a background thread writes a compacted copy of the
+ *  store, which is swapped in between queries along with whatever changed in the meantime.
+ *
+ *  Documents are found by name through a hash table of record indexes built on the first lookup
+ *  and kept up to date by appends, so adding or removing one costs the same however many there
+ *  are (it's only built again once it's half full, or when the store is replaced).
+ **************************************************************************************************/
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include "BBit.h"
+#include "MurmurHash2.h"
+
+#define STORE_PATH "signatures.db"
+#define STORE_MAGIC "PDSIGDB"
+#define STORE_VERSION 6
+#define STORE_NAME_MAX 232
+#define STORE_FLAG_MISSING 1        // the file couldn't be read when the store was built
+#define STORE_FLAG_DELETED 2        // a tombstone (the file was removed or replaced by a later record)
+#define STORE_COMPACT_SUFFIX ".compact"
+#define STORE_NAME_SEED 0x9E3779B97F4A7C15ULL  // seed of the name lookups' hash
+
+// file header
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t permutations;
+	uint32_t shingle_length;
+	uint32_t family;
+	uint64_t seed;
+	uint64_t count;
+	uint64_t record_size;
+	uint32_t engine;
+	uint32_t deleted;               // tombstones among the records
+	uint64_t generation;            // changes every time the store is written
+	uint64_t created;               // generation of the full build the store descends from
+	uint32_t bits;                  // bits kept of every minimum (BBIT_FULL or b-bit)
+	uint32_t reserved_0;
+} store_header;
+
+// per document record (followed by its signature)
+typedef struct
+{
+	uint32_t flags;
+	uint32_t name_len;
+	int64_t mtime;
+	int64_t size;
+	char name[STORE_NAME_MAX];
+} store_record;
+
+// record indexes by hash of their name (-1 is empty)
+typedef struct
+{
+	size_t num_slots;               // a power of 2
+	int slots[];
+} store_names;
+
+// an open (memory-mapped) store
+typedef struct
+{
+	int fd;
+	unsigned char* map;
+	size_t map_len;
+	store_header* header;
+	store_names* names;             // name lookups, NULL until the first one (set atomically)
+} signature_store;
+
+// a compaction running in the background
+typedef struct
+{
+	pthread_t thread;
+	bool running;
+	int finished;                   // set by the thread once the compacted copy is written (atomic)
+	int status;                     // 0 if it was
+	char path[PATH_MAX];
+	char target[PATH_MAX + sizeof(STORE_COMPACT_SUFFIX)]; // where the compacted copy is written
+	int count;                      // records of the store when it started
+	int kept;                       // records in the compacted copy
+	int* sources;                   // record of the store behind every record of the copy
+} store_compaction;
+
+/*
+ *  store_record_size
+ *  Bytes taken up by one record and its signature
+ */
+size_t store_record_size(int permutations, int bits)
+{
+	return sizeof(store_record) + bbit_words(permutations, bits) * sizeof(uint64_t);
+}
+
+/*
+ *  store_signature_words
+ *  64-bit words of every signature in a store
+ */
+int store_signature_words(const store_header* header)
+{
+	return bbit_words(header->permutations, header->bits);
+}
+
+/*
+ *  store_open
+ *  Memory-maps a store file, returns 0 on success and -1 if it's missing or unusable
+ */
+int store_open(signature_store* store, const char* path)
+{
+	memset(store, 0, sizeof(*store));
+	store->fd = -1;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(store_header))
+	{
+		close(fd);
+		return -1;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+
+	// validate the header before trusting anything in it (an append that was cut short leaves
+	// bytes past the last record, which the next append overwrites)
+	store_header* header = map;
+	size_t expected = sizeof(store_header) + header->count * header->record_size;
+	if (memcmp(header->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0 ||
+		header->version != STORE_VERSION ||
+		!bbit_valid(header->bits) ||
+		header->record_size != store_record_size(header->permutations, header->bits) ||
+		expected > (size_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		close(fd);
+		return -1;
+	}
+	store->fd = fd;
+	store->map = map;
+	store->map_len = st.st_size;
+	store->header = header;
+	return 0;
+}
+
+/*
+ *  store_close
+ *  Unmaps a store (safe to call on a store that was never opened)
+ */
+void store_close(signature_store* store)
+{
+	if (store->map != NULL)
+		munmap(store->map, store->map_len);
+	if (store->fd >= 0)
+		close(store->fd);
+	free(store->names);
+	memset(store, 0, sizeof(*store));
+	store->fd = -1;
+}
+
+/*
+ *  store_count
+ *  Number of documents in the store
+ */
+int store_count(const signature_store* store)
+{
+	return (store->header == NULL) ? 0 : (int)store->header->count;
+}
+
+/*
+ *  store_live_count
+ *  Number of documents in the store that aren't tombstones
+ */
+int store_live_count(const signature_store* store)
+{
+	return (store->header == NULL) ? 0 : (int)(store->header->count - store->header->deleted);
+}
+
+/*
+ *  store_get_record
+ *  Returns the i-th record of the store
+ */
+store_record* store_get_record(const signature_store* store, int i)
+{
+	return (store_record*)(store->map + sizeof(store_header) + i * store->header->record_size);
+}
+
+/*
+ *  store_signature
+ *  Returns the signature of the i-th document
+ */
+const uint64_t* store_signature(const signature_store* store, int i)
+{
+	return (const uint64_t*)((unsigned char*)store_get_record(store, i) + sizeof(store_record));
+}
+
+/*
+ *  store_name_add
+ *  Adds the i-th record to name lookups
+ */
+void store_name_add(const signature_store* store, store_names* names, int i)
+{
+	store_record* record = store_get_record(store, i);
+	size_t mask = names->num_slots - 1;
+	size_t slot = MurmurHash64A(record->name, record->name_len, STORE_NAME_SEED) & mask;
+	while (names->slots[slot] >= 0)
+		slot = (slot + 1) & mask;
+	names->slots[slot] = i;
+}
+
+/*
+ *  store_index_names
+ *  Builds the name lookups of every record, with at most half the slots used (NULL if there's
+ *  no memory for them)
+ */
+store_names* store_index_names(const signature_store* store)
+{
+	size_t num_slots = 64;
+	while (num_slots < 2 * (size_t)store_count(store))
+		num_slots *= 2;
+	store_names* names = malloc(sizeof(store_names) + num_slots * sizeof(int));
+	if (names == NULL)
+		return NULL;
+	names->num_slots = num_slots;
+	memset(names->slots, 0xFF, num_slots * sizeof(int));
+	for (int i = 0; i < store_count(store); i++)
+		store_name_add(store, names, i);
+	return names;
+}
+
+/*
+ *  store_find
+ *  Finds a (not deleted) document by name, returns its index or -1 (thread-safe while the store
+ *  doesn't change)
+ */
+int store_find(signature_store* store, const char* name)
+{
+	if (store->header == NULL)
+		return -1;
+	size_t len = strlen(name);
+	store_names* names = __atomic_load_n(&store->names, __ATOMIC_ACQUIRE);
+	if (names == NULL)
+	{
+		// whoever builds them first keeps theirs
+		store_names* built = store_index_names(store);
+		if (built != NULL && !__atomic_compare_exchange_n(&store->names, &names, built, false, __ATOMIC_ACQ_REL,
+		                                                  __ATOMIC_ACQUIRE))
+			free(built);
+		else
+			names = built;
+	}
+
+	// without lookups, look at every record
+	if (names == NULL)
+	{
+		for (int i = 0, n = store_count(store); i < n; i++)
+		{
+			store_record* record = store_get_record(store, i);
+			if (record->name_len == len && memcmp(record->name, name, len) == 0 && !(record->flags & STORE_FLAG_DELETED))
+				return i;
+		}
+		return -1;
+	}
+
+	// probe until an empty slot, a replaced document leaves its tombstone behind
+	size_t mask = names->num_slots - 1;
+	for (size_t slot = MurmurHash64A(name, len, STORE_NAME_SEED) & mask; names->slots[slot] >= 0; slot = (slot + 1) & mask)
+	{
+		store_record* record = store_get_record(store, names->slots[slot]);
+		if (record->name_len == len && memcmp(record->name, name, len) == 0 && !(record->flags & STORE_FLAG_DELETED))
+			return names->slots[slot];
+	}
+	return -1;
+}
+
+/*
+ *  store_new_generation
+ *  A generation number for a store that's just been written
+ */
+uint64_t store_new_generation(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ *  store_fill_record
+ *  Fills in a record, returns 0 on success and -1 if the name doesn't fit
+ */
+int store_fill_record(store_record* record, const char* name, const struct stat* st, uint32_t flags)
+{
+	memset(record, 0, sizeof(*record));
+	size_t len = strlen(name);
+	if (len >= STORE_NAME_MAX)
+		return -1;
+	record->flags = flags;
+	record->name_len = len;
+	memcpy(record->name, name, len);
+	if (st != NULL)
+	{
+		record->mtime = st->st_mtime;
+		record->size = st->st_size;
+	}
+	return 0;
+}
+
+/*
+ *  store_append
+ *  Adds one document and its signature to the end of the store at `path` and maps the store
+ *  again, returns the document's index or -1 on error
+ */
+int store_append(signature_store* store, const char* path, const char* name, const struct stat* st,
+                 uint32_t flags, const uint64_t* signature)
+{
+	store_record record;
+	if (store_fill_record(&record, name, st, flags) != 0)
+		return -1;
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	// the record first, the header only once it's all there
+	store_header header = *store->header;
+	off_t offset = sizeof(store_header) + header.count * header.record_size;
+	size_t signature_len = store_signature_words(&header) * sizeof(uint64_t);
+	bool ok = pwrite(fd, &record, sizeof(record), offset) == sizeof(record) &&
+	          pwrite(fd, signature, signature_len, offset + sizeof(record)) == (ssize_t)signature_len;
+	header.count++;
+	header.generation = store_new_generation();
+	ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	store_names* names = store->names;
+	store->names = NULL;
+	store_close(store);
+	if (store_open(store, path) != 0 || !ok)
+	{
+		free(names);
+		return -1;
+	}
+
+	// the lookups get the new record, or are built again once they're half full
+	int i = store_count(store) - 1;
+	if (names != NULL && 2 * (size_t)store_count(store) <= names->num_slots)
+	{
+		store_name_add(store, names, i);
+		store->names = names;
+	}
+	else
+		free(names);
+	return i;
+}
+
+/*
+ *  store_tombstone
+ *  Flags the i-th document as deleted, returns 0 on success
+ */
+int store_tombstone(signature_store* store, const char* path, int i)
+{
+	store_record* record = store_get_record(store, i);
+	if (record->flags & STORE_FLAG_DELETED)
+		return 0;
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	// the mapping is shared, so it sees both writes
+	uint32_t flags = record->flags | STORE_FLAG_DELETED;
+	store_header header = *store->header;
+	header.deleted++;
+	header.generation = store_new_generation();
+	off_t offset = sizeof(store_header) + i * header.record_size + offsetof(store_record, flags);
+	bool ok = pwrite(fd, &flags, sizeof(flags), offset) == sizeof(flags) &&
+	          pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+/*
+ *  store_writer_begin
+ *  Starts writing a new store to a temporary file next to `path`
+ */
+FILE* store_writer_begin(const char* path, store_header* header, int permutations, int bits, int family,
+                         int engine, int shingle_length, uint64_t seed)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE* fp = fopen(tmp, "wb");
+	if (fp == NULL)
+		return NULL;
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+	header->version = STORE_VERSION;
+	header->permutations = permutations;
+	header->bits = bits;
+	header->family = family;
+	header->engine = engine;
+	header->shingle_length = shingle_length;
+	header->seed = seed;
+	header->record_size = store_record_size(permutations, bits);
+	header->generation = store_new_generation();
+	header->created = header->generation;
+	fwrite(header, sizeof(*header), 1, fp);
+	return fp;
+}
+
+/*
+ *  store_writer_add
+ *  Appends one document and its signature, returns 0 on success
+ */
+int store_writer_add(FILE* fp, store_header* header, const char* name, const struct stat* st,
+                     uint32_t flags, const uint64_t* signature)
+{
+	store_record record;
+	if (store_fill_record(&record, name, st, flags) != 0)
+		return -1;
+	fwrite(&record, sizeof(record), 1, fp);
+	fwrite(signature, sizeof(uint64_t), store_signature_words(header), fp);
+	header->count++;
+	return 0;
+}
+
+/*
+ *  store_writer_end
+ *  Finalizes the header and atomically replaces the store at `path`
+ */
+int store_writer_end(const char* path, FILE* fp, store_header* header)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fseek(fp, 0, SEEK_SET);
+	fwrite(header, sizeof(*header), 1, fp);
+	if (fclose(fp) != 0)
+		return -1;
+	return rename(tmp, path);
+}
+
+/*
+ *  store_compact_main
+ *  Writes every record of the store that isn't a tombstone to `<path>.compact` (runs on the
+ *  compaction's own thread, with its own mapping of the store)
+ */
+void* store_compact_main(void* arg)
+{
+	store_compaction* compaction = arg;
+	compaction->status = -1;
+	signature_store source;
+	if (store_open(&source, compaction->path) == 0)
+	{
+		const char* target = compaction->target;
+		store_header header;
+		const store_header* old = source.header;
+		FILE* fp = store_writer_begin(target, &header, old->permutations, old->bits, old->family,
+		                              old->engine, old->shingle_length, old->seed);
+		if (fp != NULL)
+		{
+			header.created = old->created;
+			// the main thread may append meanwhile, only what was mapped can be copied
+			int count = store_count(&source);
+			int mapped = (int)((source.map_len - sizeof(store_header)) / old->record_size);
+			compaction->count = (count < mapped) ? count : mapped;
+			compaction->sources = malloc((compaction->count + 1) * sizeof(int));
+			compaction->kept = 0;
+			for (int i = 0; i < compaction->count; i++)
+			{
+				store_record* record = store_get_record(&source, i);
+				if (record->flags & STORE_FLAG_DELETED)
+					continue;
+				compaction->sources[compaction->kept++] = i;
+				fwrite(record, source.header->record_size, 1, fp);
+				header.count++;
+			}
+			compaction->status = store_writer_end(target, fp, &header);
+		}
+		store_close(&source);
+	}
+	__atomic_store_n(&compaction->finished, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ *  store_compact_start
+ *  Starts compacting the store at `path` in the background (does nothing if a compaction is
+ *  already running or the path is too long)
+ */
+void store_compact_start(store_compaction* compaction, const char* path)
+{
+	if (compaction->running || strlen(path) >= sizeof(compaction->path))
+		return;
+	snprintf(compaction->path, sizeof(compaction->path), "%s", path);
+	snprintf(compaction->target, sizeof(compaction->target), "%s%s", path, STORE_COMPACT_SUFFIX);
+	compaction->finished = 0;
+	compaction->sources = NULL;
+	compaction->count = 0;
+	compaction->kept = 0;
+	compaction->running = pthread_create(&compaction->thread, NULL, store_compact_main, compaction) == 0;
+}
+
+/*
+ *  store_compact_ready
+ *  Whether a compaction has written its copy and can be finished without waiting
+ */
+bool store_compact_ready(const store_compaction* compaction)
+{
+	return compaction->running && __atomic_load_n(&compaction->finished, __ATOMIC_ACQUIRE);
+}
+
+/*
+ *  store_compact_finish
+ *  Waits for a compaction and swaps the compacted copy in, after tombstoning what was deleted and
+ *  appending what was added since it started, returns 0 if the store was replaced
+ */
+int store_compact_finish(store_compaction* compaction, signature_store* store)
+{
+	if (!compaction->running)
+		return -1;
+	pthread_join(compaction->thread, NULL);
+	compaction->running = false;
+	const char* target = compaction->target;
+	signature_store copy;
+	int status = -1;
+	if (compaction->status == 0 && store_open(&copy, target) == 0)
+	{
+		// only if the store is still the one it was started on
+		int fd = open(target, O_WRONLY);
+		if (fd >= 0 && copy.header->created == store->header->created && store_count(store) >= compaction->count)
+		{
+			store_header header = *copy.header;
+			size_t record_size = header.record_size;
+			bool ok = true;
+			for (int i = 0; i < compaction->kept && ok; i++)
+			{
+				store_record* record = store_get_record(store, compaction->sources[i]);
+				if (record->flags & STORE_FLAG_DELETED)
+				{
+					uint32_t flags = record->flags;
+					off_t offset = sizeof(store_header) + i * record_size + offsetof(store_record, flags);
+					ok = pwrite(fd, &flags, sizeof(flags), offset) == sizeof(flags);
+					header.deleted++;
+				}
+			}
+			for (int i = compaction->count; i < store_count(store) && ok; i++)
+			{
+				store_record* record = store_get_record(store, i);
+				if (record->flags & STORE_FLAG_DELETED)
+					continue;
+				off_t offset = sizeof(store_header) + header.count * record_size;
+				ok = pwrite(fd, record, record_size, offset) == (ssize_t)record_size;
+				header.count++;
+			}
+			header.generation = store_new_generation();
+			ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && fsync(fd) == 0;
+			if (ok && rename(target, compaction->path) == 0)
+				status = 0;
+		}
+		if (fd >= 0)
+			close(fd);
+		store_close(&copy);
+	}
+	if (status == 0)
+	{
+		store_close(store);
+		status = store_open(store, compaction->path);
+	}
+	else
+		unlink(target);
+	free(compaction->sources);
+	compaction->sources = NULL;
+	return status;
+}
+
+#endif
+/* STORE_H */
@@ -0,0 +1,240 @@
+/*************************************************************************************************
+ *  Tokenizer.h
+ *  Zero-copy tokenizer over memory-mapped documents.
+ *
+ *  A document is mapped once and words come out as (pointer, length) views into the mapping, so
+ *  nothing is copied or allocated per word. A word is a run of letters, digits and apostrophes
+ *  that doesn't start with an apostrophe; everything else separates words.
+ *
+ *  Input that can't be mapped (standard input, a pipe) or that is too big to map comfortably is
+ *  streamed instead: a doc_stream reads it in chunks into a fixed buffer and hands out words the
+ *  same way. A word cut off by the end of a chunk is moved to the front of the buffer and
+ *  finished by the next read, so a stream gives exactly the words the mapping would, in memory
+ *  that doesn't grow with the input (a word longer than the whole buffer is split).
+ **************************************************************************************************/
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Stats.h"
+
+// a memory-mapped document
+typedef struct
+{
+	const char* data;
+	size_t size;
+	struct stat st;
+} doc_map;
+
+#define STREAM_CHUNK (1 << 16)     // bytes of a streamed document read at a time
+#define STREAM_MAP_MAX (1L << 28)   // biggest file that's mapped instead of streamed
+
+// position in a document
+typedef struct
+{
+	const char* p;
+	const char* end;
+} tokenizer;
+
+// a document read in chunks (or a buffer that's already all there)
+typedef struct
+{
+	int fd;                         // -1 once everything is in the buffer
+	char* buf;
+	size_t cap;
+	size_t len;                     // bytes in the buffer
+	tokenizer tok;                  // position in the buffer
+	bool failed;                    // a read failed (the words so far were still handed out)
+} doc_stream;
+
+/*
+ *  doc_map_open
+ *  Maps a whole document read-only, returns 0 on success and -1 if it can't be read
+ */
+int doc_map_open(doc_map* doc, const char* path)
+{
+	STATS_MARK(start);
+	doc->data = NULL;
+	doc->size = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &doc->st) < 0 || !S_ISREG(doc->st.st_mode))
+	{
+		close(fd);
+		return -1;
+	}
+
+	// an empty file can't be mapped, but it's still a (wordless) document
+	if (doc->st.st_size > 0)
+	{
+		void* map = mmap(NULL, doc->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			close(fd);
+			return -1;
+		}
+		madvise(map, doc->st.st_size, MADV_SEQUENTIAL);
+		doc->data = map;
+		doc->size = doc->st.st_size;
+	}
+	close(fd);
+	STATS_SPAN(STAGE_IO, start);
+	STATS_ADD(COUNTER_BYTES_READ, doc->size);
+	return 0;
+}
+
+/*
+ *  doc_map_close
+ *  Unmaps a document
+ */
+void doc_map_close(doc_map* doc)
+{
+	STATS_MARK(start);
+	if (doc->data != NULL)
+		munmap((void*)doc->data, doc->size);
+	STATS_SPAN(STAGE_IO, start);
+	doc->data = NULL;
+	doc->size = 0;
+}
+
+/*
+ *  tokenizer_init
+ *  Starts tokenizing a buffer
+ */
+void tokenizer_init(tokenizer* tok, const char* data, size_t size)
+{
+	tok->p = data;
+	tok->end = data + size;
+}
+
+/*
+ *  is_word_char
+ *  Letters and numbers, and apostrophes inside a word
+ */
+bool is_word_char(unsigned char c, bool in_word)
+{
+	return isalpha(c) || isdigit(c) || (c == '\'' && in_word);
+}
+
+/*
+ *  tokenizer_next
+ *  Gets the next word as a view into the buffer, returns false when there are no more words
+ */
+bool tokenizer_next(tokenizer* tok, const char** word, int* len)
+{
+	const char* p = tok->p;
+	const char* end = tok->end;
+
+	// skip to the start of a word
+	while (p < end && !is_word_char(*p, false))
+		p++;
+	if (p == end)
+	{
+		tok->p = p;
+		return false;
+	}
+
+	// find its end
+	const char* start = p;
+	while (p < end && is_word_char(*p, true))
+		p++;
+	*word = start;
+	*len = p - start;
+	tok->p = p;
+	return true;
+}
+
+/*
+ *  doc_stream_text
+ *  Streams a buffer that's already all in memory (nothing is read or copied)
+ */
+void doc_stream_text(doc_stream* s, const char* text, size_t size)
+{
+	s->fd = -1;
+	s->buf = (char*)text;
+	s->cap = size;
+	s->len = size;
+	s->failed = false;
+	tokenizer_init(&s->tok, text, size);
+}
+
+/*
+ *  doc_stream_fd
+ *  Streams a file descriptor through `buf` (`cap` bytes), the caller closes the descriptor
+ */
+void doc_stream_fd(doc_stream* s, int fd, char* buf, size_t cap)
+{
+	s->fd = fd;
+	s->buf = buf;
+	s->cap = cap;
+	s->len = 0;
+	s->failed = false;
+	tokenizer_init(&s->tok, buf, 0);
+}
+
+/*
+ *  doc_stream_fill
+ *  Reads the next chunk in after the `keep` bytes at the end of the buffer (moved to its front),
+ *  returns false at the end of the input
+ */
+bool doc_stream_fill(doc_stream* s, size_t keep)
+{
+	memmove(s->buf, s->buf + s->len - keep, keep);
+	s->len = keep;
+	ssize_t got;
+	do
+		got = read(s->fd, s->buf + s->len, s->cap - s->len);
+	while (got < 0 && errno == EINTR);
+	if (got <= 0)
+	{
+		s->failed = got < 0;
+		s->fd = -1;
+	}
+	else
+	{
+		s->len += got;
+		STATS_ADD(COUNTER_BYTES_READ, got);
+	}
+	tokenizer_init(&s->tok, s->buf, s->len);
+	return got > 0;
+}
+
+/*
+ *  doc_stream_next
+ *  Gets the next word as a view into the buffer (good until the next call), returns false when
+ *  there are no more words
+ */
+bool doc_stream_next(doc_stream* s, const char** word, int* len)
+{
+	for (;;)
+	{
+		if (!tokenizer_next(&s->tok, word, len))
+		{
+			// the buffer is used up, read on
+			if (s->fd < 0 || !doc_stream_fill(s, 0))
+				return false;
+			continue;
+		}
+
+		// a word that runs into the end of the buffer may go on in the next chunk (unless it
+		// already fills the buffer), so it's read again once the chunk is in
+		if (s->fd >= 0 && *word + *len == s->buf + s->len && (size_t)*len < s->cap)
+		{
+			doc_stream_fill(s, *len);
+			continue;
+		}
+		return true;
+	}
+}
+
+#endif
+/* TOKENIZER_H */
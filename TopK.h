@@ -0,0 +1,144 @@
+/*************************************************************************************************
+ *  TopK.h
+ *  The k best matches of a one-vs-all query, kept in a bounded heap.
+ *
+ *  Results are ranked by the number of matching signature slots (the estimate only grows with
+ *  it), ties in database order. The heap is a min-heap of at most k entries with the worst one
+ *  at the root, so a candidate either replaces the root or is dropped in O(log k), and once the
+ *  heap is full the root's matches are a floor every later candidate has to reach: a comparison
+ *  can give up as soon as the slots left to compare couldn't lift it there.
+ **************************************************************************************************/
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "Arena.h"
+
+// a file and how many slots of its signature match the query's
+typedef struct
+{
+	int doc;
+	int matches;
+} topk_entry;
+
+// the best k files seen so far (entries[0] is the worst of them)
+typedef struct
+{
+	topk_entry* entries;
+	int k;
+	int len;
+} topk;
+
+/*
+ *  topk_init
+ *  Starts an empty heap of the best `k` (at least 1) files
+ */
+void topk_init(topk* heap, int k, arena* a)
+{
+	heap->entries = arena_alloc(a, k * sizeof(topk_entry));
+	heap->k = k;
+	heap->len = 0;
+}
+
+/*
+ *  topk_worse
+ *  Whether an entry ranks below another (fewer matches, or as many further into the database)
+ */
+static inline bool topk_worse(topk_entry a, topk_entry b)
+{
+	return a.matches < b.matches || (a.matches == b.matches && a.doc > b.doc);
+}
+
+/*
+ *  topk_floor
+ *  Fewest matches a file needs to have a chance of getting in (0 until the heap is full)
+ */
+static inline int topk_floor(const topk* heap)
+{
+	return (heap->len == heap->k) ? heap->entries[0].matches : 0;
+}
+
+/*
+ *  topk_sift_down
+ *  Moves the entry at `i` down until both of its children rank above it
+ */
+void topk_sift_down(topk* heap, int i)
+{
+	topk_entry* e = heap->entries;
+	for (;;)
+	{
+		int worst = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+		if (left < heap->len && topk_worse(e[left], e[worst]))
+			worst = left;
+		if (right < heap->len && topk_worse(e[right], e[worst]))
+			worst = right;
+		if (worst == i)
+			return;
+		topk_entry tmp = e[i];
+		e[i] = e[worst];
+		e[worst] = tmp;
+		i = worst;
+	}
+}
+
+/*
+ *  topk_push
+ *  Offers a file to the heap (returns whether it got in)
+ */
+bool topk_push(topk* heap, int doc, int matches)
+{
+	topk_entry entry = {doc, matches};
+	topk_entry* e = heap->entries;
+	if (heap->len < heap->k)
+	{
+		// sift up from the end
+		int i = heap->len++;
+		for (; i > 0 && topk_worse(entry, e[(i - 1) / 2]); i = (i - 1) / 2)
+			e[i] = e[(i - 1) / 2];
+		e[i] = entry;
+		return true;
+	}
+	if (!topk_worse(e[0], entry))
+		return false;
+	e[0] = entry;
+	topk_sift_down(heap, 0);
+	return true;
+}
+
+/*
+ *  topk_merge
+ *  Offers every file of one heap to another
+ */
+void topk_merge(topk* into, const topk* from)
+{
+	for (int i = 0; i < from->len; i++)
+		topk_push(into, from->entries[i].doc, from->entries[i].matches);
+}
+
+/*
+ *  topk_sort
+ *  Sorts the heap's entries best first, in place (returns how many there are; the heap is
+ *  spent afterwards)
+ */
+int topk_sort(topk* heap)
+{
+	int len = heap->len;
+	topk_entry* e = heap->entries;
+
+	// take the worst off the root and park it at the end, repeatedly
+	while (heap->len > 1)
+	{
+		topk_entry worst = e[0];
+		e[0] = e[--heap->len];
+		topk_sift_down(heap, 0);
+		e[heap->len] = worst;
+	}
+	heap->len = 0;
+	return len;
+}
+
+#endif
+/* TOPK_H */
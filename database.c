@@ -7,6 +7,8 @@
  *  - Uses permutations on 64-bit numbers to compare document similarity
  *  - Any document can be added by inserting it into the db/ folder and
  *    adding its name to the textfile "init.txt"
+ *  - Signatures of every document in the database are computed once at boot and kept in a
+ *    memory-mapped signature store (see Store.h), so queries never re-read corpus documents
  *  
  *  Additional Features
  *	- Option 1: Can run the database normallly
@@ -14,10 +16,18 @@
  *	- Option 3: Can run a file against every other file in the database and see which one it's most
  *              similar to with a GUI (bars)
  *  - Additional Feature: Can vary the number of permutations used when comparing two files
+ *  - Additional Feature: Signatures can be built with k permutations (default) or with one
+ *    permutation hashing (./database --engine=oph), the choice is kept with the database
+ *  - Additional Feature: Option 3 can use an LSH index (./database --bands=B --rows=R) to only
+ *    compare against files that share a bucket with the query (see Lsh.h)
+ *  - Additional Feature: Option 7 shows where the time of the last query and of the whole run
+ *    went, stage by stage (see Stats.h)
  **************************************************************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -27,80 +37,468 @@
 #include <stdint.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "MurmurHash2.h"
+#include "Store.h"
+#include "Permutation.h"
+#include "OnePermutation.h"
+#include "Lsh.h"
+#include "Pool.h"
+#include "Tokenizer.h"
+#include "Shingle.h"
+#include "Arena.h"
+#include "Jaccard.h"
+#include "Batch.h"
+#include "Join.h"
+#include "BBit.h"
+#include "Corpus.h"
+#include "Bench.h"
+#include "Stats.h"
+#include "Server.h"
+#include "TopK.h"
+#include "Catalog.h"
+#include "SigCache.h"
+#include "Match.h"
+#include "Matrix.h"
+#include "Ingest.h"
 
 // constants
-#define SHINGLE_LENGTH 2            // length of a shingle
+#define DEFAULT_SHINGLE_LENGTH 2    // length of a shingle when a new store is created
 #define PERMUTATIONS 4000           // biggest number for a permutation result
 #define RUNS 5						// number of times to run and average a comparison of two files
-int seed;                           // seed for MurmurHash2
+#define DEFAULT_SEED 0x2545F4914F6CDD1DULL  // seed for MurmurHash2 when a new store is created
+#define ENGINE_KPERM 1               // signatures from PERMUTATIONS permutations of every shingle
+#define ENGINE_OPH 2                 // signatures from one permutation hashing (see OnePermutation.h)
+#define BORDERLINE 0.10              // estimates this close to the threshold get checked exactly (--exact)
+#define DEFAULT_TOP 10               // files option 3 shows when there's no index (--top)
+#define MATCH_CHUNK 512              // signature slots compared between checks of the top-k floor
+uint64_t seed;                      // seed for MurmurHash2 (persisted in the signature store)
+int engine;                         // signature engine (persisted in the signature store)
+int shingle_length;                 // words per shingle (persisted in the signature store)
+int signature_bits;                 // bits kept of every minimum (persisted in the signature store, see BBit.h)
+doc_catalog catalog;                // the files of the database (see Catalog.h)
+bool rescan;                        // catalog init.txt again even if it didn't change
+sig_cache sigcache;                 // signatures of files outside the database (see SigCache.h)
+signature_store store;              // signatures of every file in the database
+store_compaction compaction;        // compaction of the store running in the background
+permutation perm;                   // the permutations (derived from the seed)
+lsh_index lsh;                      // LSH index over the store (used by option 3 when built)
+int lsh_bands = -1;                 // LSH bands asked for on the command line (0 turns the index off)
+int lsh_rows;                       // LSH rows per band asked for on the command line
+float threshold;                    // smallest similarity option 3 reports when using the index
+signature_matrix matrix;            // slot-major copy of the store for one-vs-all scans (when built)
+int matrix_wanted = -1;             // signature matrix asked for on the command line (0 removes it)
+int top = DEFAULT_TOP;              // files option 3 shows (0 is every file)
+thread_pool pool;                   // worker threads for parallel queries
+int num_threads;                    // size of the pool (0 is one per core)
+arena query_arena;                  // scratch memory of the current query (reset after every query)
+bool exact;                         // also compute exact Jaccard similarities (see Jaccard.h)
+bool quiet;                         // no progress messages (batch mode)
+bool stdin_document;                // standard input can still be read as the document `-`
+pthread_rwlock_t store_lock;        // queries of the server share the store, changes have it to themselves
+
+// a block of results of one pool worker in a one-vs-all scan
+#define SCAN_BLOCK 1024
+typedef struct scan_block
+{
+	struct scan_block* next;
+	int len;
+	int docs[SCAN_BLOCK];
+	float scores[SCAN_BLOCK];
+} scan_block;
+
+// results of one pool worker in a one-vs-all scan
+typedef struct
+{
+	arena scratch;                  // the worker's own arena (arenas aren't thread-safe)
+	scan_block* blocks;
+} scan_buffer;
+
+// how a one-vs-all scan is cut into batches: the blocks of the signature matrix (when there is
+// one), then MATCH_BATCH stored signatures at a time
+typedef struct
+{
+	const uint64_t* query;
+	const void* lanes;              // the query laid out like the matrix (NULL without one)
+	int blocks;                     // blocks of the matrix
+	int tail;                       // first record that isn't in the matrix
+	int count;                      // records in the store
+	int batches;
+} scan_plan;
+
+// a one-vs-all scan shared by the pool's workers
+typedef struct
+{
+	scan_plan plan;
+	int self;                       // the query's record (-1 if it isn't stored)
+	int total;
+	int progress;                   // files compared so far (atomic)
+	bool show_progress;             // print the progress as it goes
+	pthread_mutex_t print_lock;
+	scan_buffer* buffers;           // one per worker
+} scan_job;
+
+// a top-k scan shared by the pool's workers
+typedef struct
+{
+	const uint64_t* query;
+	int self;                       // the query's record (-1 if it isn't stored)
+	scan_plan plan;                 // batches to go through when there's a signature matrix
+	int floor;                      // matches some worker's full heap needs, a floor for all of them (atomic)
+	topk* heaps;                    // one per worker
+	int total;
+	int progress;                   // files compared or given up on so far (atomic)
+	bool show_progress;             // print the progress as it goes
+	pthread_mutex_t print_lock;
+} top_job;
+
+// all the runs of option 1, computed together on the pool
+#define RUN_BLOCK 256
+typedef struct
+{
+	permutation perms;              // RUNS * PERMUTATIONS permutations, run r owns the r-th PERMUTATIONS
+	uint64_t run_seeds[RUNS];       // each run's hash seed (one permutation hashing)
+	const uint64_t* sets[2];        // distinct shingles of both files
+	long set_lens[2];
+	uint64_t* sigs[2];              // RUNS * PERMUTATIONS minimums of both files
+	bool* empty;                    // densification scratch, PERMUTATIONS per run
+} runs_job;
+
+// what the benchmarks of run_bench() work on
+typedef struct
+{
+	const char* texts[2];           // a synthetic document and a variant of it
+	size_t sizes[2];
+	const char** words;             // the document's words (views into its text)
+	int* word_lens;
+	long num_words;
+	uint64_t* sigs[2];              // signatures of both documents
+	const char* query;              // file compared against the database (one-vs-all)
+	int* docs;                      // results of one-vs-all (and top-k)
+	float* scores;
+	uint64_t sink;                  // everything computed ends up here so it can't be optimized away
+} bench_job;
+
+// where the signatures of a full rebuild of the store go
+typedef struct
+{
+	FILE* out;
+	store_header* header;
+	int* ids;                       // catalog id of every file signed
+	int num;
+} rebuild_job;
+
+// a file and its similarity to a query
+typedef struct
+{
+	int doc;
+	float score;
+} scored_doc;
 
 // function prototype
-char** boot(void);														   // starts the database (returns all the files)
+void boot(void);														   // starts the database
+void sync_catalog(void);                                                   // brings the catalog up to date with init.txt
+void sync_store(void);                                                     // brings the signature store up to date
+void update_store(void);                                                   // signs only the files that changed
+void store_signed(void* ctx, int item, const uint64_t* signature,          // writes a file signed by the pipeline to the store
+                  const struct stat* st, bool readable);
+bool file_is_current(const char* file, const store_record* record);        // whether a stored signature is up to date
+int sign_entry(const char* file, uint64_t* signature, struct stat* st);    // signs a file of the database
+int put_file(const char* file, bool allow_missing);                        // adds or re-signs one file
+int drop_file(const char* file);                                           // removes one file
+void follow_index(int added);                                              // keeps the LSH index in step with the store
+void follow_matrix(void);                                                  // keeps the signature matrix in step with the store
+void maintain_store(bool wait);                                            // starts and finishes compactions
+int list_add(const char* file);                                            // adds a file to init.txt
+int list_remove(const char* file);                                         // removes a file from init.txt
+void use_seed(uint64_t new_seed);                                          // sets the seed and the permutations
+void sync_index(void);                                                     // brings the LSH index up to date
+void sync_matrix(void);                                                    // brings the signature matrix up to date
+void print_result(const char* file, float result);                         // prints one result of option 3
+void scan_task(void* ctx, int index, int worker);                          // compares a batch of files in a one-vs-all scan
+void top_task(void* ctx, int index, int worker);                           // compares one file in a top-k scan
+void top_batch_task(void* ctx, int index, int worker);                     // compares a batch of files in a top-k scan
+void top_progress(top_job* job, int compared);                             // counts and prints a top-k scan's progress
+void scan_plan_init(scan_plan* plan, const uint64_t* query, arena* scratch); // cuts a one-vs-all scan into batches
+int scan_batch(const scan_plan* plan, int index, int* counts, int* num);   // counts the matching slots of one batch
+int compare_pair(const char* file_a, const char* file_b, float* resemblance,  // estimates the resemblance of two files
+                 arena* scratch);
+double exact_pair(const char* file_a, const char* file_b, long* both,      // exact Jaccard similarity of two files
+                  long* either, arena* scratch);
+int find_file(const char* file);                                           // finds a file of the database in the store
+int compare_all(const char* file, int self, int* docs, float* scores,      // compares a file with every other file
+                bool progress, arena* scratch);
+int compare_top(const char* file, int self, int k, int* docs,              // finds the k files most similar to a file
+                float* scores, bool progress, arena* scratch);
+int run_pair(const char* file_a, const char* file_b, float* results,       // compares two files RUNS times
+             arena* scratch);
+void run_stats(const float* results, double* mean, double* stddev,        // summarizes the results of RUNS runs
+               double* margin);
+void run_batch(FILE* in, FILE* out, int format);                           // runs queries without the UI
+void run_query(char** args, int num_args, FILE* out, int format,           // runs one query of batch mode
+               arena* scratch);
+int run_server(const char* path, int format);                              // serves queries on a Unix-domain socket
+void serve_query(char* line, FILE* out, arena* scratch, void* ctx);        // runs one query of a client
+int scored_doc_cmp(const void* a, const void* b);                          // orders results best first
+void run_bench(FILE* out, int format, const long* sizes, int num_sizes,    // runs the benchmark suite
+               int docs, long doc_words, long edits);
+void bench_sizes(FILE* out, int format, long words, long edits);           // benchmarks documents of one size
+void bench_database(FILE* out, int format, int docs, long words, long edits); // benchmarks a generated database
+long bench_tokenize(void* ctx);                                            // splits a document into words
+long bench_murmur(void* ctx);                                              // hashes the words of a document
+long bench_shingle(void* ctx);                                             // hashes the shingles of a document
+long bench_sign(void* ctx);                                                // builds the signature of a document
+long bench_compare(void* ctx);                                             // compares two signatures
+long bench_pair(void* ctx);                                                // signs and compares two documents
+long bench_one_vs_all(void* ctx);                                          // compares a file with the whole database
+long bench_top_k(void* ctx);                                               // finds the files most similar to a file
 void option_1(void);                                                       // averages the results of shingling RUNS times
+void runs_task(void* ctx, int index, int worker);                          // computes a slice of every run of option 1
+double t_critical_95(int degrees);                                         // critical value for a 95% confidence interval
 void option_2(void);													   // runs the database normally
 void option_3(void);												       // compares a file with every other file
-char* get_next_word(FILE* file);                                           // gets the next word from a given file pointer
-char* concatenate_circle(int head, char** circle, int* circle_lens);       // concatenates all of the words in the circle
+int record_name_compare(const char* name, const store_record* record);     // orders a name against a stored file
+int record_name_cmp(const void* a, const void* b);                         // orders stored files by name
+void option_5(void);                                                       // adds or updates a file
+void option_6(void);                                                       // removes a file
+void option_7(void);                                                       // shows the statistics
+long sign_file(const char* path, uint64_t hash_seed, uint64_t* signature, // shingles a file straight into a signature
+               arena* scratch);
+long sign_text(const char* text, size_t size, uint64_t hash_seed,          // shingles text straight into a signature
+               uint64_t* signature, arena* scratch);
+long sign_stream(doc_stream* stream, uint64_t hash_seed,                   // shingles a stream straight into a signature
+                 uint64_t* signature, arena* scratch);
+void doc_path(const char* file, char* path, size_t size);                  // where a query's file is read from
+const uint64_t* get_signature(const char* file, int index,                // gets a file's signature (stored or computed)
+                              arena* scratch);
+long shingle_set(const char* file, uint64_t** set, arena* scratch);         // gets a file's sorted, distinct shingles
+long shingle_text(const char* text, size_t size, uint64_t** set,           // gets text's sorted, distinct shingles
+                  arena* scratch);
+void signature_init(uint64_t* signature);                                  // starts an empty signature
+void signature_add(uint64_t* signature, uint64_t shingle);                 // folds one shingle into a signature
+void signature_finish(uint64_t* signature, arena* scratch);                // completes a signature
+void signature_fold(uint64_t* signature, const uint64_t* shingles, int len); // folds a batch of shingles into a signature
+void pack_signature(uint64_t* signature);                                  // cuts a signature down to the stored bits
+float compare_signatures(const uint64_t* sig_1, const uint64_t* sig_2);    // estimated resemblance of two signatures
+int count_matches(const uint64_t* sig_1, const uint64_t* sig_2,            // matching slots of two signatures
+                  int at_least);
+float signature_resemblance(int matches);                                  // estimated resemblance from matching slots
 uint64_t MurmurHash64A (const void* key, int len, uint64_t seed);		   // a complicated 64-bit hash function
-float permute_and_compare(char* file_1, int set_1_len, uint64_t* set_1,    // permutes 2 sets of 64-bit numbers
-         			     char* file_2, int set_2_len, uint64_t* set_2);
 
 // main
-int main(void)
+int main(int argc, char* argv[])
 {
+	// command line options
+	static struct option options[] =
+	{
+		{"engine", required_argument, NULL, 'e'},
+		{"shingle-length", required_argument, NULL, 's'},
+		{"bands", required_argument, NULL, 'b'},
+		{"rows", required_argument, NULL, 'r'},
+		{"threshold", required_argument, NULL, 't'},
+		{"threads", required_argument, NULL, 'j'},
+		{"exact", no_argument, NULL, 'x'},
+		{"batch", optional_argument, NULL, 'B'},
+		{"format", required_argument, NULL, 'f'},
+		{"join", required_argument, NULL, 'J'},
+		{"bbit", required_argument, NULL, 'w'},
+		{"bench", optional_argument, NULL, 'M'},
+		{"generate", required_argument, NULL, 'G'},
+		{"docs", required_argument, NULL, 'D'},
+		{"words", required_argument, NULL, 'W'},
+		{"edits", required_argument, NULL, 'E'},
+		{"serve", required_argument, NULL, 'S'},
+		{"top", required_argument, NULL, 'K'},
+		{"rescan", no_argument, NULL, 'R'},
+		{"matrix", optional_argument, NULL, 'X'},
+		{NULL, 0, NULL, 0}
+	};
+	const char* batch = NULL;
+	const char* join = NULL;
+	const char* bench = NULL;
+	const char* generate = NULL;
+	const char* serve = NULL;
+	int docs = CORPUS_DOCS;
+	long words = 0;
+	long edits = CORPUS_EDITS;
+	int format = BATCH_JSONL;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+	{
+		if (opt == 'e' && strcmp(optarg, "kperm") == 0)
+			engine = ENGINE_KPERM;
+		else if (opt == 'e' && strcmp(optarg, "oph") == 0)
+			engine = ENGINE_OPH;
+		else if (opt == 's' && atoi(optarg) > 0 && atoi(optarg) <= MAX_SHINGLE_LENGTH)
+			shingle_length = atoi(optarg);
+		else if (opt == 'b' && atoi(optarg) >= 0)
+			lsh_bands = atoi(optarg);
+		else if (opt == 'r' && atoi(optarg) > 0)
+			lsh_rows = atoi(optarg);
+		else if (opt == 't')
+			threshold = atof(optarg);
+		else if (opt == 'w' && bbit_valid(atoi(optarg)))
+			signature_bits = atoi(optarg);
+		else if (opt == 'j' && atoi(optarg) > 0)
+			num_threads = atoi(optarg);
+		else if (opt == 'K' && atoi(optarg) >= 0)
+			top = atoi(optarg);
+		else if (opt == 'x')
+			exact = true;
+		else if (opt == 'R')
+			rescan = true;
+		else if (opt == 'X' && (optarg == NULL || strcmp(optarg, "1") == 0 || strcmp(optarg, "0") == 0))
+			matrix_wanted = (optarg == NULL) ? 1 : atoi(optarg);
+		else if (opt == 'B')
+			batch = (optarg != NULL) ? optarg : "-";
+		else if (opt == 'J')
+			join = optarg;
+		else if (opt == 'M')
+			bench = (optarg != NULL) ? optarg : "-";
+		else if (opt == 'G')
+			generate = optarg;
+		else if (opt == 'S')
+			serve = optarg;
+		else if (opt == 'D' && atoi(optarg) > 0)
+			docs = atoi(optarg);
+		else if (opt == 'W' && atol(optarg) > 0)
+			words = atol(optarg);
+		else if (opt == 'E' && atol(optarg) >= 0)
+			edits = atol(optarg);
+		else if (opt == 'f' && strcmp(optarg, "jsonl") == 0)
+			format = BATCH_JSONL;
+		else if (opt == 'f' && strcmp(optarg, "csv") == 0)
+			format = BATCH_CSV;
+		else
+		{
+			printf("Usage: %s [--engine=kperm|oph] [--shingle-length=N] [--bbit=1|2|4|8|64] [--bands=B [--rows=R]]\n"
+			       "          [--matrix[=0]] [--threshold=T] [--threads=N] [--top=K] [--exact] [--rescan]\n"
+			       "          [--batch[=FILE] | --join=OUTPUT | --serve=SOCKET] [--format=jsonl|csv]\n"
+			       "       %s --generate=DIR [--docs=N] [--words=W] [--edits=E]\n"
+			       "       %s --bench[=OUTPUT] [--docs=N] [--words=W] [--edits=E] [--format=jsonl|csv]\n",
+			       argv[0], argv[0], argv[0]);
+			exit(1);
+		}
+	}
+	stats_init();
+	pool_init(&pool, (num_threads > 0) ? num_threads : pool_default_size());
+	arena_init(&query_arena, ARENA_CHUNK_SIZE);
+	catalog_init(&catalog);
+	sigcache_init(&sigcache, SIGCACHE_DIR, SIGCACHE_ENTRIES, PERMUTATIONS);
+
+	// seed for picking the seeds of each run in option 1 (the MurmurHash2 seed comes from the store)
+	srand(time(NULL));
+
+	// write a synthetic corpus instead of showing the UI (the names go to standard output)
+	if (generate != NULL)
+	{
+		if (corpus_write(generate, docs, (words > 0) ? words : CORPUS_WORDS, edits, CORPUS_SEED, stdout) != 0)
+		{
+			fprintf(stderr, "Error, couldn't write the corpus to `%s`\n", generate);
+			exit(1);
+		}
+		exit(0);
+	}
+
+	// run the benchmark suite instead of showing the UI
+	if (bench != NULL)
+	{
+		FILE* out = (strcmp(bench, "-") == 0) ? stdout : fopen(bench, "w");
+		if (out == NULL)
+		{
+			fprintf(stderr, "Error, couldn't write `%s`\n", bench);
+			exit(1);
+		}
+		static const long default_sizes[] = {1000, 10000, 100000};
+		quiet = true;
+		if (words > 0)
+			run_bench(out, format, &words, 1, docs, words, edits);
+		else
+			run_bench(out, format, default_sizes, 3, docs, CORPUS_WORDS, edits);
+		if (out != stdout)
+			fclose(out);
+		exit(0);
+	}
+
+	// write every pair of similar files instead of showing the UI
+	if (join != NULL)
+	{
+		quiet = true;
+		boot();
+		if (join_run(&store, &pool, threshold, join, format, isatty(fileno(stderr))) != 0)
+		{
+			fprintf(stderr, "Error, couldn't write `%s`\n", join);
+			exit(1);
+		}
+		exit(0);
+	}
+
+	// serve queries on a socket instead of showing the UI
+	if (serve != NULL)
+	{
+		quiet = true;
+		boot();
+		if (run_server(serve, format) != 0)
+		{
+			fprintf(stderr, "Error, couldn't listen on `%s`\n", serve);
+			exit(1);
+		}
+		maintain_store(true);
+		exit(0);
+	}
+
+	// run a batch of queries instead of the UI
+	if (batch != NULL)
+	{
+		FILE* in = (strcmp(batch, "-") == 0) ? stdin : fopen(batch, "r");
+		if (in == NULL)
+		{
+			fprintf(stderr, "Error, couldn't open the batch `%s`\n", batch);
+			exit(1);
+		}
+		quiet = true;
+		stdin_document = in != stdin;
+		boot();
+		run_batch(in, stdout, format);
+		maintain_store(true);
+		if (in != stdin)
+			fclose(in);
+		exit(0);
+	}
+
 	// get files in the database
-	char** files = boot();
-	int num_files = 0;
-	FILE* fp = fopen("init.txt", "r");
-	char ch;
-	while(1)
-	{
-		ch = fgetc(fp);
-		if (feof(fp))
-			break;
-		else if (ch == '\n')
-			num_files++;
-	}
-	fclose(fp);
+	boot();
 	
 	// print crpytic symbols for aesthetics
 	printf("\033[2J");
     printf("\033[%d;%dH", 0, 0);
 
-    // seed for MurmurHash2
-    srand(time(NULL));
-
     // print UI   
     int spaces = 42;
     printf("******************************** Plagiarism Database ********************************\n");
     printf("*                     Files available to check are listed below.                    *\n");
-    for (int i = 0; i < num_files; i++)
+    for (int i = 0; i < catalog_count(&catalog); i++)
     {
-    	int word_len = strlen(files[i]);
+    	if (catalog_get(&catalog, i)->flags & CATALOG_FLAG_DELETED)
+    		continue;
+    	const char* file = catalog_name(&catalog, i);
+    	int word_len = strlen(file);
     	printf("*");
     	for (int j = 0; j < spaces - (word_len / 2); j++)
     		printf(" ");
-    	printf("%s", files[i]);
+    	printf("%s", file);
     	for (int k = spaces - (word_len / 2) + word_len; k < 83; k++)
     		printf(" ");
     	printf("*\n");
     }
     printf("*************************************************************************************\n");
 
-    // generate MurmurHash2 seed
-    seed = rand();
-
     // for what the user wants to do 
     char* input;
 
-    // clean up (don't need these anymore)
-    for (int i = 0; i < num_files; i++)
-    	free(files[i]);
-    free(files);
-
     // execute database queries
     while(1)
     {
@@ -109,9 +507,19 @@ int main(void)
     		   "* 1 - Use the database\n"
     		   "* 2 - Compare two files `%d` times and average the results\n"
     		   "* 3 - Compare a file against every other file in the database\n"
-    	       "# 4 - Quit\n", RUNS);
+    	       "# 4 - Quit\n"
+    		   "* 5 - Add or update a file in the database\n"
+    		   "* 6 - Remove a file from the database\n"
+    		   "* 7 - Show statistics\n", RUNS);
     	input = readline("Option: ");
+    	if (input == NULL)
+    	{
+    		printf("Reached EOF.\n");
+    		exit(1);
+    	}
     	int input_num = atoi(&input[0]);
+    	if (input_num != 7)
+    		stats_begin_query();
 
     	// call get_files appropriately
     	if (input_num == 2)
@@ -123,11 +531,22 @@ int main(void)
     	else if (input_num == 4)
     	{
     		printf("Quitting... goodbye\n");
+    		maintain_store(true);
     		exit(1);
     	}
+    	else if (input_num == 5)
+    		option_5();
+    	else if (input_num == 6)
+    		option_6();
+    	else if (input_num == 7)
+    		option_7();
     	else
     		printf("Please pick one of the stated options\n\n");
 
+    	// release everything the query allocated and swap in a finished compaction
+    	arena_reset(&query_arena);
+    	maintain_store(false);
+
     	// for CPU
     	usleep(20000); 		
     	free(input);	
@@ -136,802 +555,2300 @@ int main(void)
 
 /*
  *  boot
- *  Starts the database (returns all the files)
+ *  Starts the database
  */
-char** boot(void)
+void boot(void)
 {
 	// get files in the database
-	FILE* init = fopen("init.txt", "r");
-	if (init == NULL)
+	sync_catalog();
+
+	// make sure every file has an up to date signature (and the index is built from them)
+	sync_store();
+	sync_index();
+	sync_matrix();
+	if (catalog_stamp(&catalog, CATALOG_PATH, CATALOG_LIST, store.header->generation) != 0)
 	{
-		printf("Error, make sure `init.txt` is in the same directory as `database.c` and `text files`\n");
-		fclose(init);
+		printf("Error, couldn't write the catalog `%s`\n", CATALOG_PATH);
 		exit(1);
 	}
-	char* char_buf = malloc(BUFSIZ * sizeof(char));
-	int char_buf_index = 0;
-	char ch;
-	while(1)
-	{
-		ch = fgetc(init);
-		if (feof(init))
-			break;
-		char_buf[char_buf_index++] = ch;
-	}
-	int num_files = 0;
-	for (int i = 0, len = strlen(char_buf); i < len; i++)
+}
+
+/*
+ *  sync_catalog
+ *  Makes sure the catalog lists the files in init.txt, cataloguing them again only when init.txt
+ *  changed (or --rescan asked for it)
+ */
+void sync_catalog(void)
+{
+	if (catalog.header == NULL)
+		catalog_open(&catalog, CATALOG_PATH);
+	if (!rescan && catalog_is_current(&catalog, CATALOG_LIST))
+		return;
+	rescan = false;
+	if (access(CATALOG_LIST, R_OK) != 0)
 	{
-		if (char_buf[i] == '\n')
-			num_files++;
+		printf("Error, make sure `init.txt` is in the same directory as `database.c` and `text files`\n");
+		exit(1);
 	}
-	char** files = malloc(num_files * sizeof(char*));
-	char* file_buf;
-	char* location;
-	for (int i = 0; i < num_files; i++)
+
+	// files that didn't change keep their hashes
+	if (catalog_build(CATALOG_PATH, CATALOG_LIST, CATALOG_DIR, &catalog) != 0 ||
+	    catalog_open(&catalog, CATALOG_PATH) != 0)
 	{
-		file_buf = (i == 0) ? strtok_r(char_buf, "\n", &location) : strtok_r(NULL, "\n", &location);
-		files[i] = malloc(strlen(file_buf));
-		strcpy(files[i], file_buf);
+		printf("Error, couldn't write the catalog `%s` (or a file name in `init.txt` is too long)\n", CATALOG_PATH);
+		exit(1);
 	}
-
-	// return the result
-	free(char_buf);
-	fclose(init);
-	return files;
 }
 
 /*
- *  option_1
- *  Averages the results of shingling RUNS times
+ *  sync_store
+ *  Makes sure the signature store holds a current signature for every file, rebuilding it if not
  */
-void option_1(void)
+void sync_store(void)
 {
-	// open the two files (lots of error checking)
-	printf("\nEnter two files to compare.\n");
-	char* file_a = readline("File 1: ");
-    if (file_a == NULL)
-    {
-    	printf("Reached EOF.\n");
-    	exit(1);
-    }
-    else if (strcmp(file_a, "Quit") == 0)
-    {
-    	printf("Quitting\n");
-    	exit(2);
-    }
-	if (!isatty(fileno(stdin)))
-        printf("File 1: %s\n", file_a);
-	char* file_1 = malloc(strlen(file_a) + 3 * sizeof(char));
-	file_1[0] = 'd'; file_1[1] = 'b'; file_1[2] = '/';
-	strcpy(file_1 + 3, file_a);
-	char* file_b = readline("File 2: ");
-	if (file_b == NULL)
+	// open the store left behind by an earlier run
+	if (store.header == NULL)
+		store_open(&store, STORE_PATH);
+
+	// the engine asked for on the command line, otherwise the one the database was built with
+	if (engine == 0)
+		engine = (store.header != NULL && store.header->engine == ENGINE_OPH) ? ENGINE_OPH : ENGINE_KPERM;
+	if (shingle_length == 0)
+		shingle_length = (store.header != NULL && store.header->shingle_length > 0 &&
+		                  store.header->shingle_length <= MAX_SHINGLE_LENGTH) ? (int)store.header->shingle_length
+		                                                                      : DEFAULT_SHINGLE_LENGTH;
+	if (signature_bits == 0)
+		signature_bits = (store.header != NULL) ? (int)store.header->bits : BBIT_FULL;
+
+	// reuse the store if it was built with the same parameters, only signing files that changed
+	maintain_store(true);
+	bool current = store.header != NULL &&
+	               store.header->permutations == PERMUTATIONS &&
+	               store.header->bits == (uint32_t)signature_bits &&
+	               store.header->family == PERMUTATION_MULTIPLY_ADD &&
+	               store.header->engine == (uint32_t)engine &&
+	               store.header->shingle_length == (uint32_t)shingle_length;
+	if (current)
 	{
-		printf("Reached EOF.\n");
-		exit(3);
+		// nothing to do if the store hasn't changed since it was last brought up to date with the catalog
+		use_seed(store.header->seed);
+		if (store.header->generation != catalog.header->store_generation)
+			update_store();
+		return;
 	}
-	if (!isatty(fileno(stdin)))
-		printf("File 2: %s\n", file_b);
-	if (strcmp(file_a, file_b) == 0)
+
+	// keep the seed of the old store so signatures stay comparable across runs
+	use_seed((store.header != NULL) ? store.header->seed : DEFAULT_SEED);
+	store_close(&store);
+
+	// compute a signature for every file
+	store_header header;
+	FILE* out = store_writer_begin(STORE_PATH, &header, PERMUTATIONS, signature_bits, PERMUTATION_MULTIPLY_ADD,
+	                               engine, shingle_length, seed);
+	if (out == NULL)
 	{
-		printf("Please enter two different files.\n\n");
-		return;
+		printf("Error, couldn't write the signature store `%s`\n", STORE_PATH);
+		exit(1);
 	}
-	char* file_2 = malloc(strlen(file_b) + 3 * sizeof(char));
-	file_2[0] = 'd'; file_2[1] = 'b'; file_2[2] = '/';
-	strcpy(file_2 + 3, file_b);
-	FILE* file_1_fp = fopen(file_1, "r");
-	FILE* file_2_fp = fopen(file_2, "r");
-	if (file_1_fp == NULL)
+
+	// read, tokenize and sign on threads of their own, writing the signatures in catalog order
+	rebuild_job job = {out, &header, malloc((catalog_count(&catalog) + 1) * sizeof(int)), 0};
+	char (*paths)[PATH_MAX] = malloc((catalog_count(&catalog) + 1) * sizeof(*paths));
+	const char** path_list = malloc((catalog_count(&catalog) + 1) * sizeof(char*));
+	for (int i = 0; i < catalog_count(&catalog); i++)
 	{
-		printf("Couldn't open `%s`, please enter a file that's listed in the database.\n\n", file_1);
-		free(file_a);
-		free(file_b);
-		free(file_1);
-		free(file_2);
-		fclose(file_1_fp);
-		fclose(file_2_fp);
-		return;
+		if (catalog_get(&catalog, i)->flags & CATALOG_FLAG_DELETED)
+			continue;
+		doc_path(catalog_name(&catalog, i), paths[job.num], PATH_MAX);
+		path_list[job.num] = paths[job.num];
+		job.ids[job.num++] = i;
 	}
-	else if (file_2_fp == NULL)
+	ingest_config config = {PERMUTATIONS, shingle_length, seed, signature_init, signature_fold, signature_finish,
+	                        pack_signature, store_signed, &job};
+	int workers = (num_threads > 0) ? num_threads : pool_default_size();
+	int tokenizers = (engine == ENGINE_OPH) ? workers / 2 : workers / 4;
+	if (tokenizers < 1)
+		tokenizers = 1;
+	int signers = (workers - tokenizers > 1) ? workers - tokenizers : 1;
+	ingest_pipeline pipeline;
+	ingest_run(&pipeline, &config, path_list, job.num, tokenizers, signers);
+	if (!quiet)
 	{
-		printf("Couldn't open `%s`, please enter a file that's listed in the database.\n\n", file_2);
-		free(file_a);
-		free(file_b);
-		free(file_1);
-		free(file_2);
-		fclose(file_1_fp);
-		fclose(file_2_fp);
-		return;
+		printf("\n");
+		ingest_report(stdout, &pipeline);
 	}
+	free(job.ids);
+	free(paths);
+	free(path_list);
+	if (store_writer_end(STORE_PATH, out, &header) != 0 || store_open(&store, STORE_PATH) != 0)
+	{
+		printf("Error, couldn't write the signature store `%s`\n", STORE_PATH);
+		exit(1);
+	}
+}
 
-	// for keeping track result of each run
-	float* results = malloc(RUNS * sizeof(float));
-	int run = 1;
-
-	// do process RUNS times
-	for (int a = 0; a < RUNS; a++)
+/*
+ *  store_signed
+ *  Appends a file the ingestion pipeline signed to the store being rebuilt (called in catalog
+ *  order)
+ */
+void store_signed(void* ctx, int item, const uint64_t* signature, const struct stat* st, bool readable)
+{
+	rebuild_job* job = ctx;
+	int id = job->ids[item];
+	const char* file = catalog_name(&catalog, id);
+	if (!quiet)
 	{
-		// re-seed
-		seed = rand();
-		printf("\rChecking (%d/%d)", run++, RUNS);
+		printf("\rSigning files (%d/%d)", item + 1, job->num);
 		fflush(stdout);
+	}
+	if (!readable)
+		fprintf(quiet ? stderr : stdout, "\nCouldn't open `%s`, it won't be compared against.\n",
+		        catalog_path(&catalog, id));
+	if (store_writer_add(job->out, job->header, file, readable ? st : NULL, readable ? 0 : STORE_FLAG_MISSING,
+	                     signature) != 0)
+	{
+		printf("\nError, the file name `%s` is too long for the signature store\n", file);
+		exit(1);
+	}
+}
 
-		// a circular array to store words
-		char** circle = malloc(SHINGLE_LENGTH * sizeof(char*));
-		int* circle_lens = malloc(SHINGLE_LENGTH * sizeof(int));
-		int circle_index = 0;
-
-		// variables for file 1
-		int sz_unit = BUFSIZ * sizeof(uint64_t);
-		uint64_t* f1_shingles = malloc(sz_unit);
-		ssize_t f1_shingles_sz = sz_unit;
-		int f1_shingles_count = 0;
-		int f1_stored_shingles = 0;
-
-		// get words from file 1
-		char* word = get_next_word(file_1_fp);
-		while (word != NULL)
-		{
-			// add word to the circle
-			circle_lens[circle_index]= strlen(word);
-			circle[circle_index] = malloc(circle_lens[circle_index]);
-			strncpy(*(circle + circle_index), word, circle_lens[circle_index]);
-			circle_index = (circle_index + 1) % SHINGLE_LENGTH;
-			f1_shingles_count++;
-
-			// shingle if ready
-			if (f1_shingles_count >= SHINGLE_LENGTH)
-			{
-				// get a string and convert it to a 64-bit number
-				char* str = concatenate_circle(circle_index, circle, circle_lens);
-				uint64_t hash =  MurmurHash64A(str, strlen(str), seed);
-
-				// possibly increase array size and then store number
-				if (f1_shingles_count % BUFSIZ == 0 && f1_shingles_count != 0)
-				{
-					f1_shingles_sz += sz_unit;
-					f1_shingles = realloc(f1_shingles, f1_shingles_sz);
-				}
-				f1_shingles[f1_stored_shingles++] = hash;
-			}
+/*
+ *  update_store
+ *  Brings a store built with the current parameters up to date with the catalog: new and
+ *  changed files are signed and appended, files no longer listed are tombstoned
+ */
+void update_store(void)
+{
+	// the files in the store, by name
+	int count = store_count(&store);
+	int* by_name = malloc((count + 1) * sizeof(int));
+	int live = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (!(store_get_record(&store, i)->flags & STORE_FLAG_DELETED))
+			by_name[live++] = i;
+	}
+	qsort(by_name, live, sizeof(int), record_name_cmp);
 
-			// get next word
-			word = get_next_word(file_1_fp);
+	// what's new or changed, and which stored files are still listed
+	unsigned char* listed = calloc(count + 1, 1);
+	int* changed = malloc((catalog_count(&catalog) + 1) * sizeof(int));
+	int num_changed = 0;
+	for (int i = 0; i < catalog_count(&catalog); i++)
+	{
+		if (catalog_get(&catalog, i)->flags & CATALOG_FLAG_DELETED)
+			continue;
+		const char* file = catalog_name(&catalog, i);
+		int lo = 0, hi = live;
+		while (lo < hi)
+		{
+			int mid = lo + (hi - lo) / 2;
+			if (record_name_compare(file, store_get_record(&store, by_name[mid])) > 0)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-
-		// reset circle
-		for (int i = 0; i < SHINGLE_LENGTH; i++)
+		if (lo < live && record_name_compare(file, store_get_record(&store, by_name[lo])) == 0)
 		{
-			free(circle[i]);
-			circle_lens[i] = 0;
+			listed[by_name[lo]] = 1;
+			if (file_is_current(file, store_get_record(&store, by_name[lo])))
+				continue;
 		}
-		circle_index = 0;
-
-		// variables for file 2
-		uint64_t* f2_shingles = malloc(sz_unit);
-		ssize_t f2_shingles_sz = sz_unit;
-		int f2_shingles_count = 0;
-		int f2_stored_shingles = 0;
+		changed[num_changed++] = i;
+	}
 
-		// get words from file 2
-		word = get_next_word(file_2_fp);
-		while (word != NULL)
+	// tombstone what isn't listed anymore, then sign what changed
+	for (int i = 0; i < count; i++)
+	{
+		if (!listed[i] && !(store_get_record(&store, i)->flags & STORE_FLAG_DELETED))
 		{
-			// add word to circle
-			circle_lens[circle_index]= strlen(word);
-			circle[circle_index] = malloc(circle_lens[circle_index]);
-			strncpy(*(circle + circle_index), word, circle_lens[circle_index]);
-			circle_index = (circle_index + 1) % SHINGLE_LENGTH;
-			f2_shingles_count++;
-
-			// shingle if ready
-			if (f2_shingles_count >= SHINGLE_LENGTH)
-			{
-				// get a string and convert it to a 64-bit number
-				char* str = concatenate_circle(circle_index, circle, circle_lens);
-				uint64_t hash =  MurmurHash64A(str, strlen(str), seed);
-
-				// possibly increase array size and then store number
-				if (f2_shingles_count % BUFSIZ == 0 && f2_shingles_count != 0)
-				{
-					f2_shingles_sz += sz_unit;
-					f2_shingles = realloc(f2_shingles, f2_shingles_sz);
-				}
-				f2_shingles[f2_stored_shingles++] = hash;
-			}
-
-			// get next words
-			word = get_next_word(file_2_fp);
+			store_tombstone(&store, STORE_PATH, i);
+			follow_index(-1);
 		}
-
-		// reset circle
-		for (int i = 0; i < SHINGLE_LENGTH; i++)
+	}
+	for (int i = 0; i < num_changed; i++)
+	{
+		if (!quiet)
 		{
-			free(circle[i]);
-			circle_lens[i] = 0;
+			printf("\rSigning files (%d/%d)", i + 1, num_changed);
+			fflush(stdout);
+		}
+		if (put_file(catalog_name(&catalog, changed[i]), true) < 0)
+		{
+			printf("\nError, the file name `%s` is too long for the signature store\n", catalog_name(&catalog, changed[i]));
+			exit(1);
 		}
-		circle_index = 0;
-
-		// permute and compare file similarities
-		results[a] = permute_and_compare(file_a, f1_shingles_count, f1_shingles, 
-			                             file_b, f2_shingles_count, f2_shingles);
-
-		// clean up
-		free(f1_shingles);
-	    free(f2_shingles);
-	    free(circle);
-	    free(circle_lens);
-
-	    // seek back to the beginning of the files for next run
-	    fseek(file_1_fp, 0, SEEK_SET);
-	    fseek(file_2_fp, 0, SEEK_SET);
 	}
-	printf("\n");
+	if (num_changed > 0 && !quiet)
+		printf("\n");
+	free(by_name);
+	free(listed);
+	free(changed);
+	maintain_store(false);
+}
 
-	// calculate average and print message
-	float acc = 0;
-	for (int i = 0; i < RUNS; i++)
-		acc += results[i];
-	float final_result = acc / (float)RUNS;
-	for (int i = 0; i < RUNS; i++)
-		printf("* Run %d: %.2f\n", i + 1, results[i]);
-	printf("Average of all %d rounds: %.2f\n\n", RUNS, final_result);
+/*
+ *  record_name_compare
+ *  Orders a name against the name of a record (like strcmp)
+ */
+int record_name_compare(const char* name, const store_record* record)
+{
+	size_t len = strlen(name);
+	int order = memcmp(name, record->name, (len < record->name_len) ? len : record->name_len);
+	if (order != 0)
+		return order;
+	return (len > record->name_len) - (len < record->name_len);
+}
 
-	// clean up
-	fclose(file_1_fp);
-	fclose(file_2_fp);
-	free(file_a);
-	free(file_b);
-	free(file_1);
-	free(file_2);
+/*
+ *  record_name_cmp
+ *  Orders records of the store by name (for qsort)
+ */
+int record_name_cmp(const void* a, const void* b)
+{
+	const store_record* x = store_get_record(&store, *(const int*)a);
+	const store_record* y = store_get_record(&store, *(const int*)b);
+	int order = memcmp(x->name, y->name, (x->name_len < y->name_len) ? x->name_len : y->name_len);
+	if (order != 0)
+		return order;
+	return (x->name_len > y->name_len) - (x->name_len < y->name_len);
 }
 
 /*
- *  option_2
- *  Runs the database normally
+ *  file_is_current
+ *  Whether a stored record still matches its file in db/ (a file that couldn't be read matches
+ *  as long as it still can't be)
  */
-void option_2(void)
+bool file_is_current(const char* file, const store_record* record)
 {
-	// open the two files (lots of error checking)
-	printf("\nEnter two files to compare.\n");
-	char* file_a = readline("File 1: ");
-    if (file_a == NULL)
-    	exit(1);
-    else if (strcmp(file_a, "Quit") == 0)
-    {
-    	printf("Quitting\n");
-    	exit(2);
-    }
-	if (!isatty(fileno(stdin)))
-        printf("File 1: %s\n", file_a);
-	char* file_1 = malloc(strlen(file_a) + 3 * sizeof(char));
-	file_1[0] = 'd'; file_1[1] = 'b'; file_1[2] = '/';
-	strcpy(file_1 + 3, file_a);
-	char* file_b = readline("File 2: ");
-	if (file_b == NULL)
+	char path[PATH_MAX];
+	struct stat st;
+	doc_path(file, path, sizeof(path));
+	if (stat(path, &st) < 0)
+		return (record->flags & STORE_FLAG_MISSING) != 0;
+	return !(record->flags & STORE_FLAG_MISSING) && record->mtime == st.st_mtime && record->size == st.st_size;
+}
+
+/*
+ *  sign_entry
+ *  Signs a file of the database, returns 0 on success or -1 if it can't be read (its signature
+ *  is then empty)
+ */
+int sign_entry(const char* file, uint64_t* signature, struct stat* st)
+{
+	char path[PATH_MAX];
+	doc_path(file, path, sizeof(path));
+	if (stat(path, st) != 0 || !S_ISREG(st->st_mode) || sign_file(path, seed, signature, &query_arena) < 0)
 	{
-		printf("Reached EOF.\n");
-		exit(3);
+		signature_init(signature);
+		pack_signature(signature);
+		return -1;
 	}
-	if (!isatty(fileno(stdin)))
-		printf("File 2: %s\n", file_b);
-	if (strcmp(file_a, file_b) == 0)
+	pack_signature(signature);
+	return 0;
+}
+
+/*
+ *  put_file
+ *  Adds a file of db/ to the store, or re-signs it if it changed, returns 1 if the store changed,
+ *  0 if the file was already up to date and -1 if it can't be stored (when it can't be read and
+ *  `allow_missing` isn't set, or its name is too long)
+ */
+int put_file(const char* file, bool allow_missing)
+{
+	int old = store_find(&store, file);
+	if (old >= 0 && file_is_current(file, store_get_record(&store, old)))
+		return 0;
+	if (strlen(file) >= STORE_NAME_MAX)
+		return -1;
+	arena_mark mark = arena_save(&query_arena);
+	uint64_t* signature = arena_alloc(&query_arena, PERMUTATIONS * sizeof(uint64_t));
+	struct stat st;
+	bool readable = sign_entry(file, signature, &st) == 0;
+	if (!readable && !allow_missing)
 	{
-		printf("Please enter two different files.\n\n");
-		return;
+		arena_restore(&query_arena, mark);
+		return -1;
 	}
-	char* file_2 = malloc(strlen(file_b) + 3 * sizeof(char));
-	file_2[0] = 'd'; file_2[1] = 'b'; file_2[2] = '/';
-	strcpy(file_2 + 3, file_b);
-	FILE* file_1_fp = fopen(file_1, "r");
-	FILE* file_2_fp = fopen(file_2, "r");
-	if (file_1_fp == NULL)
+	if (!readable)
+		fprintf(quiet ? stderr : stdout, "\nCouldn't open `db/%s`, it won't be compared against.\n", file);
+
+	// the old version becomes a tombstone, the new one goes at the end
+	if (old >= 0)
 	{
-		printf("Couldn't open `%s`, please enter a file that's listed in the database.\n\n", file_1);
-		free(file_a);
-		free(file_b);
-		free(file_1);
-		free(file_2);
-		fclose(file_1_fp);
-		fclose(file_2_fp);
-		return;
+		store_tombstone(&store, STORE_PATH, old);
+		follow_index(-1);
 	}
-	else if (file_2_fp == NULL)
+	int doc = store_append(&store, STORE_PATH, file, readable ? &st : NULL, readable ? 0 : STORE_FLAG_MISSING,
+	                       signature);
+	arena_restore(&query_arena, mark);
+	if (doc < 0)
 	{
-		printf("Couldn't open `%s`, please enter a file that's listed in the database.\n\n", file_2);
-		free(file_a);
-		free(file_b);
-		free(file_1);
-		free(file_2);
-		fclose(file_1_fp);
-		fclose(file_2_fp);
-		return;
+		printf("Error, couldn't write the signature store `%s`\n", STORE_PATH);
+		exit(1);
 	}
+	follow_index(readable ? doc : -1);
+	maintain_store(false);
+	return 1;
+}
 
-	// a circular array to store words
-	char** circle = malloc(SHINGLE_LENGTH * sizeof(char*));
-	int* circle_lens = malloc(SHINGLE_LENGTH * sizeof(int));
-	int circle_index = 0;
-
-	// variables for file 1
-	int sz_unit = BUFSIZ * sizeof(uint64_t);
-	uint64_t* f1_shingles = malloc(sz_unit);
-	ssize_t f1_shingles_sz = sz_unit;
-	int f1_shingles_count = 0;
-	int f1_stored_shingles = 0;
+/*
+ *  drop_file
+ *  Tombstones a file in the store, returns 0 on success and -1 if it isn't there
+ */
+int drop_file(const char* file)
+{
+	int doc = store_find(&store, file);
+	if (doc < 0)
+		return -1;
+	store_tombstone(&store, STORE_PATH, doc);
+	follow_index(-1);
+	maintain_store(false);
+	return 0;
+}
 
-	// get words from file 1
-	char* word = get_next_word(file_1_fp);
-	while (word != NULL)
+/*
+ *  follow_index
+ *  Keeps the LSH index (if there is one) up to date after the store changed, adding document
+ *  `added` to it (-1 if nothing was added), and the signature matrix along with it
+ */
+void follow_index(int added)
+{
+	follow_matrix();
+	if (lsh.header == NULL)
+		return;
+	int status;
+	if (added >= 0 && lsh.header->delta + 1 > LSH_DELTA_MAX(lsh.header->count))
 	{
-		// add word to the circle
-		circle_lens[circle_index]= strlen(word);
-		circle[circle_index] = malloc(circle_lens[circle_index]);
-		strncpy(*(circle + circle_index), word, circle_lens[circle_index]);
-		circle_index = (circle_index + 1) % SHINGLE_LENGTH;
-		f1_shingles_count++;
-
-		// shingle if ready
-		if (f1_shingles_count >= SHINGLE_LENGTH)
-		{
-			// get a string and convert it to a 64-bit number
-			char* str = concatenate_circle(circle_index, circle, circle_lens);
-			uint64_t hash =  MurmurHash64A(str, strlen(str), seed);
-
-			// possibly increase array size and then store number
-			if (f1_shingles_count % BUFSIZ == 0 && f1_shingles_count != 0)
-			{
-				f1_shingles_sz += sz_unit;
-				f1_shingles = realloc(f1_shingles, f1_shingles_sz);
-			}
-			f1_shingles[f1_stored_shingles++] = hash;
-		}
-
-		// get next word
-		word = get_next_word(file_1_fp);
+		// too much to scan on every query, build the tables again
+		int bands = lsh.header->bands;
+		int rows = lsh.header->rows;
+		lsh_close(&lsh);
+		status = (lsh_build(LSH_PATH, &store, bands, rows) == 0) ? lsh_open(&lsh, LSH_PATH) : -1;
 	}
-
-	// reset circle
-	for (int i = 0; i < SHINGLE_LENGTH; i++)
+	else if (added >= 0)
+		status = lsh_add(&lsh, LSH_PATH, &store, added);
+	else
+		status = lsh_follow(&lsh, LSH_PATH, &store, lsh.header->delta);
+	if (status != 0)
 	{
-		free(circle[i]);
-		circle_lens[i] = 0;
+		printf("Error, couldn't write the LSH index `%s`\n", LSH_PATH);
+		exit(1);
 	}
-	circle_index = 0;
+}
 
-	// variables for file 2
-	uint64_t* f2_shingles = malloc(sz_unit);
-	ssize_t f2_shingles_sz = sz_unit;
-	int f2_shingles_count = 0;
-	int f2_stored_shingles = 0;
+/*
+ *  follow_matrix
+ *  Keeps the signature matrix (if there is one) up to date after the store changed: documents
+ *  added are left to the store until there are too many of them to scan that way
+ */
+void follow_matrix(void)
+{
+	if (matrix.header == NULL)
+		return;
+	int status;
+	if (store_count(&store) - matrix.header->count > MATRIX_TAIL_MAX(matrix.header->count))
+	{
+		matrix_close(&matrix);
+		status = (matrix_build(MATRIX_PATH, &store) == 0) ? matrix_open(&matrix, MATRIX_PATH) : -1;
+	}
+	else
+		status = matrix_follow(&matrix, MATRIX_PATH, &store);
+	if (status != 0)
+	{
+		printf("Error, couldn't write the signature matrix `%s`\n", MATRIX_PATH);
+		exit(1);
+	}
+}
 
-	// get words from file 2
-	word = get_next_word(file_2_fp);
-	while (word != NULL)
+/*
+ *  maintain_store
+ *  Starts compacting the store once a quarter of it is tombstones and swaps a finished compaction
+ *  in (waiting for it if `wait` is set)
+ */
+void maintain_store(bool wait)
+{
+	if (compaction.running && (wait || store_compact_ready(&compaction)))
 	{
-		// add word to circle
-		circle_lens[circle_index]= strlen(word);
-		circle[circle_index] = malloc(circle_lens[circle_index]);
-		strncpy(*(circle + circle_index), word, circle_lens[circle_index]);
-		circle_index = (circle_index + 1) % SHINGLE_LENGTH;
-		f2_shingles_count++;
+		// the catalog still matches the compacted store if it matched the old one
+		bool synced = catalog.header != NULL && catalog.header->store_generation == store.header->generation;
 
-		// shingle if ready
-		if (f2_shingles_count >= SHINGLE_LENGTH)
+		// documents moved, so the index is rebuilt
+		if (store_compact_finish(&compaction, &store) == 0 && lsh.header != NULL)
 		{
-			// get a string and convert it to a 64-bit number
-			char* str = concatenate_circle(circle_index, circle, circle_lens);
-			uint64_t hash =  MurmurHash64A(str, strlen(str), seed);
-
-			// possibly increase array size and then store number
-			if (f2_shingles_count % BUFSIZ == 0 && f2_shingles_count != 0)
+			int bands = lsh.header->bands;
+			int rows = lsh.header->rows;
+			lsh_close(&lsh);
+			if (lsh_build(LSH_PATH, &store, bands, rows) != 0 || lsh_open(&lsh, LSH_PATH) != 0)
 			{
-				f2_shingles_sz += sz_unit;
-				f2_shingles = realloc(f2_shingles, f2_shingles_sz);
+				printf("Error, couldn't write the LSH index `%s`\n", LSH_PATH);
+				exit(1);
 			}
-			f2_shingles[f2_stored_shingles++] = hash;
 		}
-
-		// get next words
-		word = get_next_word(file_2_fp);
+		if (store.header != NULL && matrix.header != NULL && !matrix_is_current(&matrix, &store))
+		{
+			matrix_close(&matrix);
+			if (matrix_build(MATRIX_PATH, &store) != 0 || matrix_open(&matrix, MATRIX_PATH) != 0)
+			{
+				printf("Error, couldn't write the signature matrix `%s`\n", MATRIX_PATH);
+				exit(1);
+			}
+		}
+		if (store.header == NULL)
+		{
+			printf("Error, couldn't open the signature store `%s`\n", STORE_PATH);
+			exit(1);
+		}
+		if (synced)
+			catalog_stamp(&catalog, CATALOG_PATH, CATALOG_LIST, store.header->generation);
 	}
+	if (!wait && store.header != NULL && store.header->deleted > 0 && store.header->deleted * 4 >= store.header->count)
+		store_compact_start(&compaction, STORE_PATH);
+}
 
-	// reset circle
-	for (int i = 0; i < SHINGLE_LENGTH; i++)
+/*
+ *  list_add
+ *  Adds a file to the end of init.txt (if it isn't listed already) and to the catalog, returns 0
+ *  on success
+ */
+int list_add(const char* file)
+{
+	FILE* init = fopen("init.txt", "a+");
+	if (init == NULL)
+		return -1;
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	bool listed = false;
+	bool ends_line = true;
+	while ((len = getline(&line, &line_cap, init)) >= 0)
 	{
-		free(circle[i]);
-		circle_lens[i] = 0;
+		ends_line = len > 0 && line[len - 1] == '\n';
+		if (ends_line)
+			line[len - 1] = '\0';
+		if (strcmp(line, file) == 0)
+			listed = true;
 	}
-	circle_index = 0;
-
-	// permute and compare file similarities
-	float resemblance = permute_and_compare(file_a, f1_shingles_count, f1_shingles, 
-		                             file_b, f2_shingles_count, f2_shingles);
-
-	// print similarity report
-	printf("Result:\n");
-	printf("                            matching minimums         %.1f             \n", (PERMUTATIONS * resemblance));
-	printf("           Similarity =   ---------------------  =  -------  = %.2f  \n", resemblance);
-	printf("                          # calculated minimums       %.1f             \n\n", (float)PERMUTATIONS);
-	
-	// clean up
-	free(circle);
-	free(circle_lens);
-	free(file_a);
-	free(file_b);
-	free(file_1);
-	free(file_2);
-	free(f1_shingles);
-	free(f2_shingles);
-	fclose(file_1_fp);
-	fclose(file_2_fp);
+	free(line);
+	if (!listed)
+		fprintf(init, "%s%s\n", ends_line ? "" : "\n", file);
+	if (fclose(init) != 0 || catalog_put(&catalog, CATALOG_PATH, CATALOG_DIR, file) < 0)
+		return -1;
+	return catalog_stamp(&catalog, CATALOG_PATH, CATALOG_LIST, store.header->generation);
 }
 
 /*
- *  option_3
+ *  list_remove
+ *  Takes a file out of init.txt and the catalog, returns 0 on success
+ */
+int list_remove(const char* file)
+{
+	FILE* init = fopen("init.txt", "r");
+	FILE* out = fopen("init.txt.tmp", "w");
+	if (init == NULL || out == NULL)
+	{
+		if (init != NULL)
+			fclose(init);
+		if (out != NULL)
+			fclose(out);
+		return -1;
+	}
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	while ((len = getline(&line, &line_cap, init)) >= 0)
+	{
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (strcmp(line, file) != 0)
+			fprintf(out, "%s\n", line);
+	}
+	free(line);
+	fclose(init);
+	if (fclose(out) != 0 || rename("init.txt.tmp", "init.txt") != 0)
+		return -1;
+	int id = catalog_find(&catalog, file);
+	if (id >= 0 && catalog_tombstone(&catalog, CATALOG_PATH, id) != 0)
+		return -1;
+	return catalog_stamp(&catalog, CATALOG_PATH, CATALOG_LIST, store.header->generation);
+}
+
+/*
+ *  sync_index
+ *  Makes sure the LSH index (if there is one) was built from the current store with the asked for
+ *  bands and rows, rebuilding it if not
+ */
+void sync_index(void)
+{
+	// open the index left behind by an earlier run
+	if (lsh.header == NULL)
+		lsh_open(&lsh, LSH_PATH);
+
+	// the configuration asked for on the command line, otherwise the one the index was built with
+	int bands = (lsh_bands >= 0) ? lsh_bands : (lsh.header != NULL) ? (int)lsh.header->bands : 0;
+	if (bands == 0)
+	{
+		if (lsh.header != NULL)
+			unlink(LSH_PATH);
+		lsh_close(&lsh);
+		return;
+	}
+	int rows = (lsh_rows > 0) ? lsh_rows : (lsh_bands > 0 || lsh.header == NULL) ? PERMUTATIONS / bands
+	                                                                            : (int)lsh.header->rows;
+	if (bands * rows > PERMUTATIONS || rows == 0)
+	{
+		printf("Error, %d bands of %d rows need more than the %d permutations\n", bands, rows, PERMUTATIONS);
+		exit(1);
+	}
+	if (rows * signature_bits % 8 != 0)
+	{
+		printf("Error, bands of %d rows of %d bits don't fill whole bytes\n", rows, signature_bits);
+		exit(1);
+	}
+	if (lsh_is_current(&lsh, &store) && (int)lsh.header->bands == bands && (int)lsh.header->rows == rows)
+		return;
+
+	// rebuild it
+	lsh_close(&lsh);
+	if (lsh_build(LSH_PATH, &store, bands, rows) != 0 || lsh_open(&lsh, LSH_PATH) != 0)
+	{
+		printf("Error, couldn't write the LSH index `%s`\n", LSH_PATH);
+		exit(1);
+	}
+}
+
+/*
+ *  sync_matrix
+ *  Builds the signature matrix if it was asked for and isn't up to date with the store (or
+ *  removes it)
+ */
+void sync_matrix(void)
+{
+	// open the matrix left behind by an earlier run
+	if (matrix.header == NULL)
+		matrix_open(&matrix, MATRIX_PATH);
+
+	// asked for on the command line, otherwise kept if there is one
+	bool wanted = (matrix_wanted >= 0) ? matrix_wanted == 1 : matrix.header != NULL;
+	if (!wanted)
+	{
+		if (matrix.header != NULL)
+			unlink(MATRIX_PATH);
+		matrix_close(&matrix);
+		return;
+	}
+	if (matrix_is_current(&matrix, &store))
+		return;
+
+	// rebuild it
+	matrix_close(&matrix);
+	if (matrix_build(MATRIX_PATH, &store) != 0 || matrix_open(&matrix, MATRIX_PATH) != 0)
+	{
+		printf("Error, couldn't write the signature matrix `%s`\n", MATRIX_PATH);
+		exit(1);
+	}
+}
+
+/*
+ *  use_seed
+ *  Sets the MurmurHash2 seed and derives the permutations from it
+ */
+void use_seed(uint64_t new_seed)
+{
+	if (perm.a != NULL && seed == new_seed)
+		return;
+	if (perm.a != NULL)
+		permutation_free(&perm);
+	seed = new_seed;
+	permutation_init(&perm, perm_family_find(PERMUTATION_MULTIPLY_ADD), seed, PERMUTATIONS);
+}
+
+/*
+ *  option_1
+ *  Averages the results of shingling RUNS times
+ */
+void option_1(void)
+{
+	// get the two files (lots of error checking)
+	printf("\nEnter two files to compare.\n");
+	char* file_a = readline("File 1: ");
+    if (file_a == NULL)
+    {
+    	printf("Reached EOF.\n");
+    	exit(1);
+    }
+    else if (strcmp(file_a, "Quit") == 0)
+    {
+    	printf("Quitting\n");
+    	exit(2);
+    }
+	if (!isatty(fileno(stdin)))
+        printf("File 1: %s\n", file_a);
+	char* file_b = readline("File 2: ");
+	if (file_b == NULL)
+	{
+		printf("Reached EOF.\n");
+		exit(3);
+	}
+	if (!isatty(fileno(stdin)))
+		printf("File 2: %s\n", file_b);
+	if (strcmp(file_a, file_b) == 0)
+	{
+		printf("Please enter two different files.\n\n");
+		free(file_a);
+		free(file_b);
+		return;
+	}
+
+	// every run of both files
+	float results[RUNS];
+	int failed = run_pair(file_a, file_b, results, &query_arena);
+	if (failed != 0)
+	{
+		printf("Couldn't open `db/%s`, please enter a file that's listed in the database.\n\n",
+		       (failed == 1) ? file_a : file_b);
+		free(file_a);
+		free(file_b);
+		return;
+	}
+	double mean, stddev, margin;
+	run_stats(results, &mean, &stddev, &margin);
+
+	// print message
+	for (int r = 0; r < RUNS; r++)
+		printf("* Run %d: %.2f\n", r + 1, results[r]);
+	printf("Average of all %d rounds: %.2f\n", RUNS, mean);
+	printf("Standard deviation: %.3f\n", stddev);
+	printf("95%% confidence interval: [%.2f, %.2f]\n\n", mean - margin, mean + margin);
+
+	// clean up
+	free(file_a);
+	free(file_b);
+}
+
+/*
+ *  run_pair
+ *  Compares two files RUNS times with independent permutations, shingling them only once
+ *  (returns 0, or which file couldn't be opened)
+ */
+int run_pair(const char* file_a, const char* file_b, float* results, arena* scratch)
+{
+	// shingle both files once, every run works from the same shingle sets
+	runs_job job;
+	for (int i = 0; i < 2; i++)
+	{
+		uint64_t* set;
+		job.set_lens[i] = shingle_set((i == 0) ? file_a : file_b, &set, scratch);
+		job.sets[i] = set;
+		if (job.set_lens[i] < 0)
+			return i + 1;
+	}
+
+	// every run gets its own permutations (a local seed, so the stored signatures stay valid),
+	// all of them drawn from one family of RUNS * PERMUTATIONS
+	uint64_t state = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+	permutation_init(&job.perms, perm.family, splitmix64(&state), RUNS * PERMUTATIONS);
+	for (int r = 0; r < RUNS; r++)
+		job.run_seeds[r] = splitmix64(&state);
+	for (int i = 0; i < 2; i++)
+		job.sigs[i] = arena_alloc(scratch, RUNS * PERMUTATIONS * sizeof(uint64_t));
+	job.empty = arena_alloc(scratch, RUNS * PERMUTATIONS * sizeof(bool));
+
+	// one permutation hashing splits by run, k permutations by blocks of minimums
+	int tasks = (engine == ENGINE_OPH) ? RUNS : (RUNS * PERMUTATIONS + RUN_BLOCK - 1) / RUN_BLOCK;
+	pool_parallel_for(&pool, tasks, 1, runs_task, &job);
+	permutation_free(&job.perms);
+
+	// compare file similarities of every run (with as many bits as the stored signatures keep)
+	for (int r = 0; r < RUNS; r++)
+	{
+		pack_signature(job.sigs[0] + r * PERMUTATIONS);
+		pack_signature(job.sigs[1] + r * PERMUTATIONS);
+		results[r] = compare_signatures(job.sigs[0] + r * PERMUTATIONS, job.sigs[1] + r * PERMUTATIONS);
+	}
+	return 0;
+}
+
+/*
+ *  run_stats
+ *  Mean, sample standard deviation and the margin of a 95% confidence interval for the mean of
+ *  RUNS results
+ */
+void run_stats(const float* results, double* mean, double* stddev, double* margin)
+{
+	double sum = 0, variance = 0;
+	for (int r = 0; r < RUNS; r++)
+		sum += results[r];
+	*mean = sum / RUNS;
+	for (int r = 0; r < RUNS; r++)
+		variance += (results[r] - *mean) * (results[r] - *mean);
+	*stddev = (RUNS > 1) ? sqrt(variance / (RUNS - 1)) : 0;
+	*margin = (RUNS > 1) ? t_critical_95(RUNS - 1) * *stddev / sqrt(RUNS) : 0;
+}
+
+/*
+ *  runs_task
+ *  Computes one slice of every run's signatures of both files in option 1 (runs on a pool worker)
+ */
+void runs_task(void* ctx, int index, int worker)
+{
+	runs_job* job = ctx;
+	(void)worker;
+	STATS_MARK(start);
+	if (engine == ENGINE_OPH)
+	{
+		// one whole run, shingles are re-hashed with the run's seed so runs are independent
+		uint64_t run_seed = job->run_seeds[index];
+		for (int i = 0; i < 2; i++)
+		{
+			uint64_t* sig = job->sigs[i] + index * PERMUTATIONS;
+			for (int k = 0; k < PERMUTATIONS; k++)
+				sig[k] = UINT64_MAX;
+			for (long j = 0; j < job->set_lens[i]; j++)
+				oph_add(sig, PERMUTATIONS, shingle_mix(job->sets[i][j] ^ run_seed));
+			oph_densify(sig, PERMUTATIONS, run_seed, job->empty + index * PERMUTATIONS);
+		}
+		STATS_SPAN(STAGE_PERMUTE, start);
+		return;
+	}
+
+	// a block of minimums, which may span the end of one run and the start of the next
+	int first = index * RUN_BLOCK;
+	int n = RUNS * PERMUTATIONS - first;
+	if (n > RUN_BLOCK)
+		n = RUN_BLOCK;
+	permutation slice = permutation_slice(&job->perms, first, n);
+	for (int i = 0; i < 2; i++)
+	{
+		uint64_t* sig = job->sigs[i] + first;
+		for (int k = 0; k < n; k++)
+			sig[k] = UINT64_MAX;
+		for (long j = 0; j < job->set_lens[i]; j++)
+			permutation_fold(&slice, job->sets[i][j], sig);
+	}
+	STATS_SPAN(STAGE_PERMUTE, start);
+}
+
+/*
+ *  t_critical_95
+ *  Two-sided 95% critical value of Student's t distribution
+ */
+double t_critical_95(int degrees)
+{
+	static const double table[] =
+	{
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+	};
+	if (degrees < 1)
+		return 0;
+	if (degrees <= (int)(sizeof(table) / sizeof(table[0])))
+		return table[degrees - 1];
+	return 1.960;
+}
+
+/*
+ *  option_2
+ *  Runs the database normally
+ */
+void option_2(void)
+{
+	// get the two files (lots of error checking)
+	printf("\nEnter two files to compare.\n");
+	char* file_a = readline("File 1: ");
+    if (file_a == NULL)
+    	exit(1);
+    else if (strcmp(file_a, "Quit") == 0)
+    {
+    	printf("Quitting\n");
+    	exit(2);
+    }
+	if (!isatty(fileno(stdin)))
+        printf("File 1: %s\n", file_a);
+	char* file_b = readline("File 2: ");
+	if (file_b == NULL)
+	{
+		printf("Reached EOF.\n");
+		exit(3);
+	}
+	if (!isatty(fileno(stdin)))
+		printf("File 2: %s\n", file_b);
+	if (strcmp(file_a, file_b) == 0)
+	{
+		printf("Please enter two different files.\n\n");
+		free(file_a);
+		free(file_b);
+		return;
+	}
+
+	// compare file similarities (signatures come straight from the store for files in the database)
+	float resemblance;
+	int failed = compare_pair(file_a, file_b, &resemblance, &query_arena);
+	if (failed != 0)
+	{
+		printf("Couldn't open `db/%s`, please enter a file that's listed in the database.\n\n",
+		       (failed == 1) ? file_a : file_b);
+		free(file_a);
+		free(file_b);
+		return;
+	}
+
+	// print similarity report
+	printf("Result:\n");
+	printf("                            matching minimums         %.1f             \n", (PERMUTATIONS * resemblance));
+	printf("           Similarity =   ---------------------  =  -------  = %.2f  \n", resemblance);
+	printf("                          # calculated minimums       %.1f             \n\n", (float)PERMUTATIONS);
+
+	// the exact similarity the estimate stands for
+	long both, either;
+	double similarity;
+	if (exact && (similarity = exact_pair(file_a, file_b, &both, &either, &query_arena)) >= 0)
+	{
+		printf("                            shared shingles           %ld             \n", both);
+		printf("        Exact Jaccard =   ---------------------  =  -------  = %.2f  \n", similarity);
+		printf("                          distinct shingles           %ld             \n\n", either);
+	}
+
+	// clean up
+	free(file_a);
+	free(file_b);
+}
+
+/*
+ *  option_3
  *  Checks a file against the rest of the files in the database
  */
-void option_3(void)
+void option_3(void)
+{
+	// pick up changes to init.txt
+	boot();
+
+	// get the file (lots of error checking)
+	printf("\nEnter a file to check agains the rest of the database.\n");
+	char* file_a = readline("File: ");
+    if (file_a == NULL)
+    	exit(1);
+    else if (strcmp(file_a, "Quit") == 0)
+    {
+    	printf("Quitting...\n");
+    	exit(2);
+    }
+	if (!isatty(fileno(stdin)))
+        printf("File 1: %s\n", file_a);
+	int count = store_count(&store);
+	int* docs = arena_alloc(&query_arena, count * sizeof(int));
+	float* scores = arena_alloc(&query_arena, count * sizeof(float));
+	int self = find_file(file_a);
+	int found = (lsh.header == NULL && top > 0) ? compare_top(file_a, self, top, docs, scores, true, &query_arena)
+	                                            : compare_all(file_a, self, docs, scores, true, &query_arena);
+	if (found < 0)
+	{
+		printf("Couldn't open `db/%s`, please enter a file that's listed in the database\n\n", file_a);
+		free(file_a);
+		return;
+	}
+
+	// print results (the best `top` of them)
+	int others = store_live_count(&store) - (self >= 0);
+	if (lsh.header != NULL)
+	{
+		printf("%d of %d files share a bucket with `%s` (%d bands of %d rows)\n", found, others, file_a,
+		       lsh.header->bands, lsh.header->rows);
+		others = found;
+	}
+	else
+		printf("\n");
+	int shown = (top > 0 && found > top) ? top : found;
+	for (int i = 0; i < shown; i++)
+		print_result(store_get_record(&store, docs[i])->name, scores[i]);
+	if (shown < others)
+		printf("(%d more not shown, --top=0 shows every file)\n", others - shown);
+	printf("\n");
+
+	// clean up
+	free(file_a);
+}
+
+/*
+ *  option_5
+ *  Adds a file in db/ to the database, or re-signs it if it changed
+ */
+void option_5(void)
+{
+	printf("\nEnter a file in `db/` to add to the database.\n");
+	char* file = readline("File: ");
+	if (file == NULL)
+	{
+		printf("Reached EOF.\n");
+		exit(1);
+	}
+	if (!isatty(fileno(stdin)))
+		printf("File: %s\n", file);
+	int status = put_file(file, false);
+	if (status < 0)
+		printf("Couldn't add `db/%s`, make sure it's there and its name is short enough.\n\n", file);
+	else if (list_add(file) != 0)
+		printf("Error, couldn't add `%s` to `init.txt`\n\n", file);
+	else if (status == 0)
+		printf("`%s` is already up to date.\n\n", file);
+	else
+		printf("Signed `%s`, it's now in the database.\n\n", file);
+	free(file);
+}
+
+/*
+ *  option_6
+ *  Removes a file from the database (the file itself stays in db/)
+ */
+void option_6(void)
+{
+	printf("\nEnter a file to remove from the database.\n");
+	char* file = readline("File: ");
+	if (file == NULL)
+	{
+		printf("Reached EOF.\n");
+		exit(1);
+	}
+	if (!isatty(fileno(stdin)))
+		printf("File: %s\n", file);
+	if (drop_file(file) != 0)
+		printf("`%s` isn't in the database.\n\n", file);
+	else if (list_remove(file) != 0)
+		printf("Error, couldn't remove `%s` from `init.txt`\n\n", file);
+	else
+		printf("Removed `%s` from the database.\n\n", file);
+	free(file);
+}
+
+/*
+ *  option_7
+ *  Shows where the time of the last query and of the whole run went
+ */
+void option_7(void)
+{
+	if (!STATS)
+	{
+		printf("Statistics were compiled out (STATS=0)\n\n");
+		return;
+	}
+	stats_print(stdout, "Last query:", &stats_query);
+	stats_print(stdout, "Since the database started:", &stats_process);
+	printf("\n");
+}
+
+/*
+ *  run_batch
+ *  Runs every query of a batch (see Batch.h) back to back and writes a record per result
+ */
+void run_batch(FILE* in, FILE* out, int format)
+{
+	batch_begin(out, format);
+	char* line = NULL;
+	size_t line_cap = 0;
+	char* args[BATCH_MAX_ARGS];
+	while (getline(&line, &line_cap, in) >= 0)
+	{
+		int num_args = batch_parse(line, args, BATCH_MAX_ARGS);
+		if (num_args == 0)
+			continue;
+		if (strcmp(args[0], "stats") != 0)
+			stats_begin_query();
+		run_query(args, num_args, out, format, &query_arena);
+
+		// release everything the query allocated and swap in a finished compaction
+		arena_reset(&query_arena);
+		maintain_store(false);
+	}
+	free(line);
+	fflush(out);
+}
+
+/*
+ *  run_query
+ *  Runs one query of batch mode (or of a client of the server) and writes its records, with
+ *  scratch memory from `scratch`
+ */
+void run_query(char** args, int num_args, FILE* out, int format, arena* scratch)
+{
+	double start = batch_now_ms();
+	batch_record record;
+	batch_record_init(&record, args[0]);
+	record.file_1 = (num_args > 1) ? args[1] : NULL;
+	record.file_2 = (num_args > 2) ? args[2] : NULL;
+	bool pair = strcmp(args[0], "pair") == 0;
+	bool runs = strcmp(args[0], "runs") == 0;
+
+	// one file against another
+	if ((pair || runs) && num_args == 3)
+	{
+		int failed;
+		if (pair)
+		{
+			float resemblance;
+			failed = compare_pair(args[1], args[2], &resemblance, scratch);
+			record.similarity = resemblance;
+			long both, either;
+			if (failed == 0 && exact)
+				record.exact = exact_pair(args[1], args[2], &both, &either, scratch);
+		}
+		else
+		{
+			float results[RUNS];
+			failed = run_pair(args[1], args[2], results, scratch);
+			if (failed == 0)
+			{
+				double margin;
+				run_stats(results, &record.similarity, &record.stddev, &margin);
+				record.has_stats = true;
+				record.ci_low = record.similarity - margin;
+				record.ci_high = record.similarity + margin;
+			}
+		}
+		if (failed != 0)
+			record.error = "couldn't open a file";
+		record.ms = batch_now_ms() - start;
+		batch_emit(out, format, &record);
+	}
+
+	// one file against all the others (or the best k of them), a record per match
+	else if ((strcmp(args[0], "all") == 0 && num_args == 2) ||
+	         (strcmp(args[0], "top") == 0 && num_args == 3 && atoi(args[2]) > 0))
+	{
+		bool best = num_args == 3;
+		record.file_2 = NULL;
+		int count = store_count(&store);
+		int* docs = arena_alloc(scratch, count * sizeof(int));
+		float* scores = arena_alloc(scratch, count * sizeof(float));
+		int self = find_file(args[1]);
+		int found = best ? compare_top(args[1], self, atoi(args[2]), docs, scores, false, scratch)
+		                 : compare_all(args[1], self, docs, scores, false, scratch);
+
+		// best first (a scan without an index gives them in database order)
+		if (!best && lsh.header == NULL && found > 1)
+		{
+			scored_doc* ranked = arena_alloc(scratch, found * sizeof(scored_doc));
+			for (int i = 0; i < found; i++)
+			{
+				ranked[i].doc = docs[i];
+				ranked[i].score = scores[i];
+			}
+			qsort(ranked, found, sizeof(scored_doc), scored_doc_cmp);
+			for (int i = 0; i < found; i++)
+			{
+				docs[i] = ranked[i].doc;
+				scores[i] = ranked[i].score;
+			}
+		}
+		record.ms = batch_now_ms() - start;
+		if (found < 0)
+			record.error = "couldn't open a file";
+		if (found <= 0)
+			batch_emit(out, format, &record);
+		for (int i = 0; i < found; i++)
+		{
+			record.file_2 = store_get_record(&store, docs[i])->name;
+			record.rank = i + 1;
+			record.similarity = scores[i];
+			batch_emit(out, format, &record);
+		}
+	}
+	// changes to the database
+	else if ((strcmp(args[0], "add") == 0 || strcmp(args[0], "remove") == 0) && num_args == 2)
+	{
+		record.status_only = true;
+		if (args[0][0] == 'a' && put_file(args[1], false) < 0)
+			record.error = "couldn't add the file";
+		else if (args[0][0] == 'r' && drop_file(args[1]) != 0)
+			record.error = "the file isn't in the database";
+		else if ((args[0][0] == 'a') ? list_add(args[1]) != 0 : list_remove(args[1]) != 0)
+			record.error = "couldn't update init.txt";
+		record.ms = batch_now_ms() - start;
+		batch_emit(out, format, &record);
+	}
+	// where the time of the last query and of the whole run went
+	else if (strcmp(args[0], "stats") == 0 && num_args == 1)
+	{
+		if (STATS)
+		{
+			stats_emit(out, format, "query", &stats_query);
+			stats_emit(out, format, "process", &stats_process);
+		}
+		else
+		{
+			record.status_only = true;
+			record.error = "statistics were compiled out (STATS=0)";
+			record.ms = batch_now_ms() - start;
+			batch_emit(out, format, &record);
+		}
+	}
+	else
+	{
+		record.error = "unknown query (expected `pair A B`, `all A`, `top A K`, `runs A B`, `add A`, `remove A` or `stats`)";
+		record.ms = batch_now_ms() - start;
+		batch_emit(out, format, &record);
+	}
+}
+
+/*
+ *  run_bench
+ *  Runs the benchmark suite: every stage of the pipeline on synthetic documents of each size in
+ *  `sizes`, then building and querying a generated database of `docs` documents
+ */
+void run_bench(FILE* out, int format, const long* sizes, int num_sizes, int docs, long doc_words, long edits)
+{
+	// the parameters asked for on the command line, otherwise the ones a new database gets
+	if (engine == 0)
+		engine = ENGINE_KPERM;
+	if (shingle_length == 0)
+		shingle_length = DEFAULT_SHINGLE_LENGTH;
+	if (signature_bits == 0)
+		signature_bits = BBIT_FULL;
+	use_seed(DEFAULT_SEED);
+
+	bench_begin(out, format);
+	bench_config(out, format, PERMUTATIONS, shingle_length, (engine == ENGINE_OPH) ? "oph" : "kperm",
+	             signature_bits, pool.num_workers, STATS);
+	for (int i = 0; i < num_sizes; i++)
+		bench_sizes(out, format, sizes[i], edits);
+	bench_database(out, format, docs, doc_words, edits);
+}
+
+/*
+ *  bench_sizes
+ *  Benchmarks every stage on a synthetic document of `words` words, then checks how close the
+ *  estimate is to the exact similarity as the document is edited more and more
+ */
+void bench_sizes(FILE* out, int format, long words, long edits)
+{
+	arena_mark mark = arena_save(&query_arena);
+	bench_job job;
+	memset(&job, 0, sizeof(job));
+
+	// the document and a variant of it
+	uint64_t state = CORPUS_SEED;
+	int* baseline = arena_alloc(&query_arena, words * sizeof(int));
+	int* variant = arena_alloc(&query_arena, words * sizeof(int));
+	char* texts[2];
+	for (int i = 0; i < 2; i++)
+	{
+		texts[i] = arena_alloc(&query_arena, corpus_text_size(words));
+		job.texts[i] = texts[i];
+		job.sigs[i] = arena_alloc(&query_arena, PERMUTATIONS * sizeof(uint64_t));
+	}
+	corpus_words(baseline, words, &state);
+	memcpy(variant, baseline, words * sizeof(int));
+	corpus_edit(variant, words, edits, &state);
+	job.sizes[0] = corpus_render(baseline, words, texts[0]);
+	job.sizes[1] = corpus_render(variant, words, texts[1]);
+
+	// its words, for the stages that start from words
+	job.words = arena_alloc(&query_arena, words * sizeof(char*));
+	job.word_lens = arena_alloc(&query_arena, words * sizeof(int));
+	tokenizer tok;
+	tokenizer_init(&tok, job.texts[0], job.sizes[0]);
+	while (job.num_words < words && tokenizer_next(&tok, &job.words[job.num_words], &job.word_lens[job.num_words]))
+		job.num_words++;
+
+	// every stage
+	bench_record record;
+	bench_record_init(&record, "tokenize", "word");
+	record.words = words;
+	bench_measure(&record, bench_tokenize, &job, job.sizes[0]);
+	bench_emit(out, format, &record);
+
+	bench_record_init(&record, "murmur", "word");
+	record.words = words;
+	bench_measure(&record, bench_murmur, &job, job.sizes[0]);
+	bench_emit(out, format, &record);
+
+	bench_record_init(&record, "shingle", "word");
+	record.words = words;
+	bench_measure(&record, bench_shingle, &job, job.sizes[0]);
+	bench_emit(out, format, &record);
+
+	bench_record_init(&record, "sign", "doc");
+	record.words = words;
+	bench_measure(&record, bench_sign, &job, job.sizes[0]);
+	bench_emit(out, format, &record);
+
+	sign_text(job.texts[1], job.sizes[1], seed, job.sigs[1], &query_arena);
+	pack_signature(job.sigs[1]);
+	bench_record_init(&record, "compare", "pair");
+	record.words = words;
+	record.edits = edits;
+	bench_measure(&record, bench_compare, &job, 0);
+	bench_emit(out, format, &record);
+
+	bench_record_init(&record, "pair", "pair");
+	record.words = words;
+	record.edits = edits;
+	bench_measure(&record, bench_pair, &job, job.sizes[0] + job.sizes[1]);
+	bench_emit(out, format, &record);
+
+	// the estimate against the exact similarity, at 0, 1, ..., BENCH_EDIT_STEPS times `edits` edits
+	for (int k = 0; k <= BENCH_EDIT_STEPS; k++)
+	{
+		uint64_t edit_state = CORPUS_SEED + k;
+		memcpy(variant, baseline, words * sizeof(int));
+		corpus_edit(variant, words, k * edits, &edit_state);
+		job.sizes[1] = corpus_render(variant, words, texts[1]);
+		bench_pair(&job);
+
+		arena_mark sets = arena_save(&query_arena);
+		uint64_t* set_1;
+		uint64_t* set_2;
+		long set_1_len = shingle_text(job.texts[0], job.sizes[0], &set_1, &query_arena);
+		long set_2_len = shingle_text(job.texts[1], job.sizes[1], &set_2, &query_arena);
+		bench_record_init(&record, "accuracy", "pair");
+		record.words = words;
+		record.edits = (k * edits < words) ? k * edits : words;
+		record.similarity = compare_signatures(job.sigs[0], job.sigs[1]);
+		record.exact = jaccard(set_1, set_1_len, set_2, set_2_len);
+		arena_restore(&query_arena, sets);
+		bench_emit(out, format, &record);
+	}
+	arena_restore(&query_arena, mark);
+}
+
+/*
+ *  bench_database
+ *  Generates a database of `docs` documents in a temporary directory, then times building its
+ *  signature store and comparing its baseline with every other file
+ */
+void bench_database(FILE* out, int format, int docs, long words, long edits)
+{
+	// a database of its own, so the real one is left alone
+	char cwd[PATH_MAX];
+	char dir[] = "/tmp/database-bench-XXXXXX";
+	if (getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(dir) == NULL || chdir(dir) != 0)
+	{
+		fprintf(stderr, "Error, couldn't make a temporary directory for the database benchmarks\n");
+		return;
+	}
+	FILE* init = (mkdir("db", 0755) == 0) ? fopen("init.txt", "w") : NULL;
+	bool written = init != NULL && corpus_write("db", docs, words, edits, CORPUS_SEED, init) == 0;
+	if (init != NULL && fclose(init) != 0)
+		written = false;
+
+	if (written)
+	{
+		// signing every file into a new store (once, it's too slow to repeat)
+		bench_record record;
+		bench_record_init(&record, "ingest", "doc");
+		record.words = words;
+		record.docs = docs;
+		double start = batch_now_ms();
+		boot();
+		record.ns_per_op = (batch_now_ms() - start) * 1e6 / docs;
+		record.ops = docs;
+		bench_emit(out, format, &record);
+
+		// the baseline against the rest
+		arena_mark mark = arena_save(&query_arena);
+		bench_job job;
+		memset(&job, 0, sizeof(job));
+		char query[32];
+		corpus_name(query, sizeof(query), 0);
+		job.query = query;
+		job.docs = arena_alloc(&query_arena, store_count(&store) * sizeof(int));
+		job.scores = arena_alloc(&query_arena, store_count(&store) * sizeof(float));
+		bench_record_init(&record, "one_vs_all", "query");
+		record.words = words;
+		record.docs = docs;
+		bench_measure(&record, bench_one_vs_all, &job, (size_t)store_count(&store) * store.header->record_size);
+		bench_emit(out, format, &record);
+		bench_record_init(&record, "top_k", "query");
+		record.words = words;
+		record.docs = docs;
+		bench_measure(&record, bench_top_k, &job, 0);
+		bench_emit(out, format, &record);
+
+		// the same two with the signature matrix
+		if (matrix_build(MATRIX_PATH, &store) == 0 && matrix_open(&matrix, MATRIX_PATH) == 0)
+		{
+			bench_record_init(&record, "one_vs_all_matrix", "query");
+			record.words = words;
+			record.docs = docs;
+			bench_measure(&record, bench_one_vs_all, &job, matrix.map_len);
+			bench_emit(out, format, &record);
+			bench_record_init(&record, "top_k_matrix", "query");
+			record.words = words;
+			record.docs = docs;
+			bench_measure(&record, bench_top_k, &job, 0);
+			bench_emit(out, format, &record);
+		}
+		matrix_close(&matrix);
+		arena_restore(&query_arena, mark);
+	}
+	else
+		fprintf(stderr, "Error, couldn't write the corpus for the database benchmarks\n");
+
+	// clean up
+	maintain_store(true);
+	store_close(&store);
+	lsh_close(&lsh);
+	matrix_close(&matrix);
+	catalog_close(&catalog);
+	for (int i = 0; i < docs; i++)
+	{
+		char name[32];
+		char path[64];
+		corpus_name(name, sizeof(name), i);
+		snprintf(path, sizeof(path), "db/%s", name);
+		unlink(path);
+	}
+	unlink("init.txt");
+	unlink(CATALOG_PATH);
+	unlink(STORE_PATH);
+	unlink(LSH_PATH);
+	unlink(MATRIX_PATH);
+	rmdir("db");
+	if (chdir(cwd) != 0 || rmdir(dir) != 0)
+		fprintf(stderr, "Error, couldn't remove `%s`\n", dir);
+}
+
+/*
+ *  bench_tokenize
+ *  Splits the benchmark's document into words (returns how many)
+ */
+long bench_tokenize(void* ctx)
+{
+	bench_job* job = ctx;
+	tokenizer tok;
+	tokenizer_init(&tok, job->texts[0], job->sizes[0]);
+	const char* word;
+	int word_len;
+	long count = 0;
+	while (tokenizer_next(&tok, &word, &word_len))
+	{
+		job->sink += word_len;
+		count++;
+	}
+	return count;
+}
+
+/*
+ *  bench_murmur
+ *  Hashes every word of the benchmark's document with MurmurHash64A (returns how many)
+ */
+long bench_murmur(void* ctx)
+{
+	bench_job* job = ctx;
+	for (long i = 0; i < job->num_words; i++)
+		job->sink ^= MurmurHash64A(job->words[i], job->word_lens[i], seed);
+	return job->num_words;
+}
+
+/*
+ *  bench_shingle
+ *  Hashes every shingle of the benchmark's document (returns how many words went in)
+ */
+long bench_shingle(void* ctx)
 {
-	// get the files in the database
-	char** files = boot();
-	int num_files = 0;
-	FILE* fp = fopen("init.txt", "r");
-	char ch;
-	while(1)
+	bench_job* job = ctx;
+	shingler sh;
+	shingler_init(&sh, shingle_length, seed);
+	uint64_t shingle;
+	for (long i = 0; i < job->num_words; i++)
 	{
-		ch = fgetc(fp);
-		if (feof(fp))
-			break;
-		else if (ch == '\n')
-			num_files++;
+		if (shingler_push(&sh, job->words[i], job->word_lens[i], &shingle))
+			job->sink ^= shingle;
 	}
-	fclose(fp);
+	return job->num_words;
+}
 
-	// open the file (lots of error checking)
-	printf("\nEnter a file to check agains the rest of the database.\n");
-	char* file_a = readline("File: ");
-    if (file_a == NULL)
-    	exit(1);
-    else if (strcmp(file_a, "Quit") == 0)
-    {
-    	printf("Quitting...\n");
-    	exit(2);
-    }
-	if (!isatty(fileno(stdin)))
-        printf("File 1: %s\n", file_a);
-	char* file_1 = malloc(strlen(file_a) + 3 * sizeof(char));
-	file_1[0] = 'd'; file_1[1] = 'b'; file_1[2] = '/';
-	strcpy(file_1 + 3, file_a);
-	FILE* file_1_fp = fopen(file_1, "r");
-	if (file_1_fp == NULL)
+/*
+ *  bench_sign
+ *  Builds the stored signature of the benchmark's document (returns 1)
+ */
+long bench_sign(void* ctx)
+{
+	bench_job* job = ctx;
+	arena_mark mark = arena_save(&query_arena);
+	sign_text(job->texts[0], job->sizes[0], seed, job->sigs[0], &query_arena);
+	pack_signature(job->sigs[0]);
+	arena_restore(&query_arena, mark);
+	job->sink ^= job->sigs[0][0];
+	return 1;
+}
+
+/*
+ *  bench_compare
+ *  Compares the signatures of the benchmark's two documents (returns 1)
+ */
+long bench_compare(void* ctx)
+{
+	bench_job* job = ctx;
+	job->sink += compare_signatures(job->sigs[0], job->sigs[1]) * PERMUTATIONS;
+	return 1;
+}
+
+/*
+ *  bench_pair
+ *  Signs both of the benchmark's documents and compares them (returns 1)
+ */
+long bench_pair(void* ctx)
+{
+	bench_job* job = ctx;
+	arena_mark mark = arena_save(&query_arena);
+	for (int i = 0; i < 2; i++)
 	{
-		printf("Couldn't open `%s`, please enter a file that's listed in the database\n\n", file_1);
-		free(file_a);
-		free(file_1);
-		fclose(file_1_fp);
-		return;
+		sign_text(job->texts[i], job->sizes[i], seed, job->sigs[i], &query_arena);
+		pack_signature(job->sigs[i]);
 	}
+	arena_restore(&query_arena, mark);
+	job->sink += compare_signatures(job->sigs[0], job->sigs[1]) * PERMUTATIONS;
+	return 1;
+}
+
+/*
+ *  bench_one_vs_all
+ *  Compares the benchmark's query with every other file in the database (returns 1)
+ */
+long bench_one_vs_all(void* ctx)
+{
+	bench_job* job = ctx;
+	arena_mark mark = arena_save(&query_arena);
+	int found = compare_all(job->query, find_file(job->query), job->docs, job->scores, false, &query_arena);
+	arena_restore(&query_arena, mark);
+	job->sink += found;
+	return 1;
+}
+
+/*
+ *  bench_top_k
+ *  Finds the DEFAULT_TOP files most similar to the benchmark's query (returns 1)
+ */
+long bench_top_k(void* ctx)
+{
+	bench_job* job = ctx;
+	arena_mark mark = arena_save(&query_arena);
+	int found = compare_top(job->query, find_file(job->query), DEFAULT_TOP, job->docs, job->scores, false,
+	                        &query_arena);
+	arena_restore(&query_arena, mark);
+	job->sink += found;
+	return 1;
+}
 
-	// indicates progress
-	int file = 1;
+/*
+ *  run_server
+ *  Serves batch queries to clients of a Unix-domain socket until SIGINT or SIGTERM, with the
+ *  database loaded once (returns -1 if the socket can't be opened)
+ */
+int run_server(const char* path, int format)
+{
+	// a client waiting to add a file isn't starved by a stream of queries
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&store_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	int status = server_run(path, (num_threads > 0) ? num_threads : pool_default_size(), serve_query, &format);
+	pthread_rwlock_destroy(&store_lock);
+	return status;
+}
 
-	// results
-	float* results = malloc(num_files * sizeof(float));
-	for (int i = 0; i < num_files; i++)
+/*
+ *  serve_query
+ *  Runs one query of a client of the server and writes its records, followed by an empty line
+ *  (runs on a server worker)
+ */
+void serve_query(char* line, FILE* out, arena* scratch, void* ctx)
+{
+	int format = *(int*)ctx;
+	char* args[BATCH_MAX_ARGS];
+	int num_args = batch_parse(line, args, BATCH_MAX_ARGS);
+	if (num_args > 0)
 	{
-		// skip if it's the current file
-		if (strcmp(file_a, files[i]) == 0)
-			continue;
+		bool changes = strcmp(args[0], "add") == 0 || strcmp(args[0], "remove") == 0;
+		if (changes)
+			pthread_rwlock_wrlock(&store_lock);
+		else
+			pthread_rwlock_rdlock(&store_lock);
+		run_query(args, num_args, out, format, scratch);
+		pthread_rwlock_unlock(&store_lock);
+
+		// swap in a finished compaction while nobody's using the store
+		if (pthread_rwlock_trywrlock(&store_lock) == 0)
+		{
+			maintain_store(false);
+			arena_reset(&query_arena);
+			pthread_rwlock_unlock(&store_lock);
+		}
+	}
+	fputc('\n', out);
+}
 
-		// progress
-		printf("\rComparing files (%d/%d)", file++, num_files - 1);
-		fflush(stdout);
+/*
+ *  scored_doc_cmp
+ *  Orders results best first (ties in database order)
+ */
+int scored_doc_cmp(const void* a, const void* b)
+{
+	const scored_doc* x = a;
+	const scored_doc* y = b;
+	if (x->score != y->score)
+		return (x->score < y->score) ? 1 : -1;
+	return x->doc - y->doc;
+}
+
+/*
+ *  compare_pair
+ *  Estimates the resemblance of two files (returns 0, or which file couldn't be opened)
+ */
+int compare_pair(const char* file_a, const char* file_b, float* resemblance, arena* scratch)
+{
+	const uint64_t* sig_1 = get_signature(file_a, find_file(file_a), scratch);
+	if (sig_1 == NULL)
+		return 1;
+	const uint64_t* sig_2 = get_signature(file_b, find_file(file_b), scratch);
+	if (sig_2 == NULL)
+		return 2;
+	*resemblance = compare_signatures(sig_1, sig_2);
+	return 0;
+}
+
+/*
+ *  exact_pair
+ *  Exact Jaccard similarity of two files, with the number of shingles they share and have
+ *  between them (returns -1 if a file can't be opened)
+ */
+double exact_pair(const char* file_a, const char* file_b, long* both, long* either, arena* scratch)
+{
+	uint64_t* set_1;
+	uint64_t* set_2;
+	long set_1_len = shingle_set(file_a, &set_1, scratch);
+	long set_2_len = shingle_set(file_b, &set_2, scratch);
+	if (set_1_len < 0 || set_2_len < 0)
+		return -1;
+	*both = intersect_count(set_1, set_1_len, set_2, set_2_len);
+	*either = set_1_len + set_2_len - *both;
+	return jaccard(set_1, set_1_len, set_2, set_2_len);
+}
+
+/*
+ *  compare_all
+ *  Compares a file with every other file in the database, filling `docs` and `scores` (room for
+ *  every stored file) and returning how many there are, or -1 if the file can't be opened. With
+ *  an LSH index only files sharing a bucket and passing the threshold are kept, best first,
+ *  otherwise every file is kept in database order. `self` is the file's record (see find_file())
+ */
+int compare_all(const char* file, int self, int* docs, float* scores, bool progress, arena* scratch)
+{
+	const uint64_t* query = get_signature(file, self, scratch);
+	if (query == NULL)
+		return -1;
+	int count = store_count(&store);
+
+	// only look at files sharing a bucket with the query when there's an index
+	if (lsh.header != NULL)
+	{
+		unsigned char* seen = arena_calloc(scratch, count, sizeof(unsigned char));
+		int num_candidates = lsh_candidates(&lsh, query, seen, docs);
+
+		// the query's shingles, for checking borderline estimates exactly
+		uint64_t* set_1 = NULL;
+		long set_1_len = exact ? shingle_set(file, &set_1, scratch) : -1;
 
-		// open and error check the second file
-		char* file_b = malloc(strlen(files[i]));
-		strcpy(file_b, files[i]);
-		char* file_2 = malloc(strlen(file_b) + 3 * sizeof(char));
-		file_2[0] = 'd'; file_2[1] = 'b'; file_2[2] = '/';
-		strcpy(file_2 + 3, file_b);
-		FILE* file_2_fp = fopen(file_2, "r");
-		if (file_2_fp == NULL)
-		{
-			printf("Couldn't open `%s`, aborting because this shouldn't happen...\n", file_2);
-			free(file_a);
-			free(file_b);
-			free(file_1);
-			free(file_2);
-			fclose(file_1_fp);
-			return;
-		}
-
-		// a circular array to store words
-		char** circle = malloc(SHINGLE_LENGTH * sizeof(char*));
-		int* circle_lens = malloc(SHINGLE_LENGTH * sizeof(int));
-		int circle_index = 0;
-
-		// variables for file 1
-		int sz_unit = BUFSIZ * sizeof(uint64_t);
-		uint64_t* f1_shingles = malloc(sz_unit);
-		ssize_t f1_shingles_sz = sz_unit;
-		int f1_shingles_count = 0;
-		int f1_stored_shingles = 0;
-
-		// get words from file 1
-		char* word = get_next_word(file_1_fp);
-		while (word != NULL)
-		{
-			// add word to the circle
-			circle_lens[circle_index]= strlen(word);
-			circle[circle_index] = malloc(circle_lens[circle_index]);
-			strncpy(*(circle + circle_index), word, circle_lens[circle_index]);
-			circle_index = (circle_index + 1) % SHINGLE_LENGTH;
-			f1_shingles_count++;
-
-			// shingle if ready
-			if (f1_shingles_count >= SHINGLE_LENGTH)
+		// rank candidates by full signature agreement
+		int kept = 0;
+		for (int i = 0; i < num_candidates; i++)
+		{
+			store_record* record = store_get_record(&store, docs[i]);
+			if ((record->flags & STORE_FLAG_DELETED) || docs[i] == self)
+				continue;
+			float score = compare_signatures(query, store_signature(&store, docs[i]));
+			if (set_1_len >= 0 && score > threshold - BORDERLINE && score < threshold + BORDERLINE)
 			{
-				// get a string and convert it to a 64-bit number
-				char* str = concatenate_circle(circle_index, circle, circle_lens);
-				uint64_t hash =  MurmurHash64A(str, strlen(str), seed);
-
-				// possibly increase array size and then store number
-				if (f1_shingles_count % BUFSIZ == 0 && f1_shingles_count != 0)
-				{
-					f1_shingles_sz += sz_unit;
-					f1_shingles = realloc(f1_shingles, f1_shingles_sz);
-				}
-				f1_shingles[f1_stored_shingles++] = hash;
+				arena_mark mark = arena_save(scratch);
+				uint64_t* set_2;
+				long set_2_len = shingle_set(record->name, &set_2, scratch);
+				if (set_2_len >= 0)
+					score = jaccard(set_1, set_1_len, set_2, set_2_len);
+				arena_restore(scratch, mark);
 			}
-
-			// get next word
-			word = get_next_word(file_1_fp);
+			if (score < threshold)
+				continue;
+			int j = kept++;
+			int doc = docs[i];
+			for (; j > 0 && scores[j - 1] < score; j--)
+			{
+				scores[j] = scores[j - 1];
+				docs[j] = docs[j - 1];
+			}
+			scores[j] = score;
+			docs[j] = doc;
 		}
+		return kept;
+	}
+
+	// compare against every stored signature across the pool
+	scan_job job;
+	scan_plan_init(&job.plan, query, scratch);
+	job.self = self;
+	job.total = store_live_count(&store) - (self >= 0);
+	job.progress = 0;
+	job.show_progress = progress;
+	pthread_mutex_init(&job.print_lock, NULL);
+	job.buffers = arena_alloc(scratch, pool.num_workers * sizeof(scan_buffer));
+	for (int w = 0; w < pool.num_workers; w++)
+	{
+		arena_init(&job.buffers[w].scratch, SCAN_BLOCK * 2 * sizeof(scan_block));
+		job.buffers[w].blocks = NULL;
+	}
+	pool_parallel_for(&pool, job.plan.batches, 1, scan_task, &job);
+	if (progress)
+		printf("\rComparing files (%d/%d)", job.progress, job.total);
 
-		// reset circle
-		for (int i = 0; i < SHINGLE_LENGTH; i++)
+	// merge the per-thread results (files that couldn't be read count as not similar)
+	float* results = arena_calloc(scratch, count, sizeof(float));
+	for (int w = 0; w < pool.num_workers; w++)
+	{
+		for (scan_block* block = job.buffers[w].blocks; block != NULL; block = block->next)
 		{
-			free(circle[i]);
-			circle_lens[i] = 0;
+			for (int i = 0; i < block->len; i++)
+				results[block->docs[i]] = block->scores[i];
 		}
-		circle_index = 0;
+		arena_free(&job.buffers[w].scratch);
+	}
+	pthread_mutex_destroy(&job.print_lock);
 
-		// variables for file 2
-		uint64_t* f2_shingles = malloc(sz_unit);
-		ssize_t f2_shingles_sz = sz_unit;
-		int f2_shingles_count = 0;
-		int f2_stored_shingles = 0;
+	// every file but the query, in database order
+	int kept = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if ((store_get_record(&store, i)->flags & STORE_FLAG_DELETED) || i == self)
+			continue;
+		docs[kept] = i;
+		scores[kept++] = results[i];
+	}
+	return kept;
+}
+
+/*
+ *  compare_top
+ *  Finds the `k` (at least 1) files most similar to a file, filling `docs` and `scores` best first
+ *  and returning how many there are, or -1 if the file can't be opened. Without an index, every
+ *  file is compared only as far as it could still make the top `k` (in full with a signature
+ *  matrix); with one, the best `k` of compare_all() are taken. `self` is the file's record (see
+ *  find_file()), `progress` prints how many files have been compared as it goes
+ */
+int compare_top(const char* file, int self, int k, int* docs, float* scores, bool progress, arena* scratch)
+{
+	int count = store_count(&store);
 
-		// get words from file 2
-		word = get_next_word(file_2_fp);
-		while (word != NULL)
+	// the index's candidates are few and come out ranked already
+	if (lsh.header != NULL)
+	{
+		arena_mark mark = arena_save(scratch);
+		int* all_docs = arena_alloc(scratch, count * sizeof(int));
+		float* all_scores = arena_alloc(scratch, count * sizeof(float));
+		int found = compare_all(file, self, all_docs, all_scores, progress, scratch);
+		if (found > k)
+			found = k;
+		for (int i = 0; i < found; i++)
 		{
-			// add word to circle
-			circle_lens[circle_index]= strlen(word);
-			circle[circle_index] = malloc(circle_lens[circle_index]);
-			strncpy(*(circle + circle_index), word, circle_lens[circle_index]);
-			circle_index = (circle_index + 1) % SHINGLE_LENGTH;
-			f2_shingles_count++;
+			docs[i] = all_docs[i];
+			scores[i] = all_scores[i];
+		}
+		arena_restore(scratch, mark);
+		return found;
+	}
 
-			// shingle if ready
-			if (f2_shingles_count >= SHINGLE_LENGTH)
-			{
-				// get a string and convert it to a 64-bit number
-				char* str = concatenate_circle(circle_index, circle, circle_lens);
-				uint64_t hash =  MurmurHash64A(str, strlen(str), seed);
-
-				// possibly increase array size and then store number
-				if (f2_shingles_count % BUFSIZ == 0 && f2_shingles_count != 0)
-				{
-					f2_shingles_sz += sz_unit;
-					f2_shingles = realloc(f2_shingles, f2_shingles_sz);
-				}
-				f2_shingles[f2_stored_shingles++] = hash;
-			}
+	const uint64_t* query = get_signature(file, self, scratch);
+	if (query == NULL)
+		return -1;
+
+	// every worker keeps its own best k, the floor they reach is shared
+	top_job job;
+	job.query = query;
+	job.self = self;
+	job.floor = 0;
+	job.heaps = arena_alloc(scratch, pool.num_workers * sizeof(topk));
+	for (int w = 0; w < pool.num_workers; w++)
+		topk_init(&job.heaps[w], k, scratch);
+	job.total = store_live_count(&store) - (self >= 0);
+	job.progress = 0;
+	job.show_progress = progress;
+	pthread_mutex_init(&job.print_lock, NULL);
+
+	// a matrix compares whole blocks faster than files can be given up on one by one
+	if (matrix.header != NULL)
+	{
+		scan_plan_init(&job.plan, query, scratch);
+		pool_parallel_for(&pool, job.plan.batches, 1, top_batch_task, &job);
+	}
+	else
+		pool_parallel_for(&pool, count, 64, top_task, &job);
+	if (progress)
+		printf("\rComparing files (%d/%d)", job.progress, job.total);
+	pthread_mutex_destroy(&job.print_lock);
+
+	// the best k of the workers' best
+	topk best;
+	topk_init(&best, k, scratch);
+	for (int w = 0; w < pool.num_workers; w++)
+		topk_merge(&best, &job.heaps[w]);
+	int found = topk_sort(&best);
+	for (int i = 0; i < found; i++)
+	{
+		docs[i] = best.entries[i].doc;
+		scores[i] = signature_resemblance(best.entries[i].matches);
+	}
+	return found;
+}
 
-			// get next words
-			word = get_next_word(file_2_fp);
-		}
+/*
+ *  top_task
+ *  Compares the query of a top-k scan with one stored signature, giving up once it can't make
+ *  the top k (runs on a pool worker)
+ */
+void top_task(void* ctx, int index, int worker)
+{
+	top_job* job = ctx;
+	store_record* record = store_get_record(&store, index);
+	if ((record->flags & STORE_FLAG_DELETED) || index == job->self)
+		return;
+
+	top_progress(job, 1);
+
+	// files that couldn't be read aren't listed, like in a one-vs-all scan
+	if (record->flags & STORE_FLAG_MISSING)
+		return;
+	int matches = count_matches(job->query, store_signature(&store, index),
+	                            __atomic_load_n(&job->floor, __ATOMIC_RELAXED));
+	if (matches < 0)
+	{
+		STATS_ADD(COUNTER_PRUNED, 1);
+		return;
+	}
+
+	// the k-th best of any worker is a floor for the k best of all
+	topk* heap = &job->heaps[worker];
+	if (topk_push(heap, index, matches))
+	{
+		int floor = topk_floor(heap);
+		int seen = __atomic_load_n(&job->floor, __ATOMIC_RELAXED);
+		while (floor > seen && !__atomic_compare_exchange_n(&job->floor, &seen, floor, true, __ATOMIC_RELAXED,
+		                                                    __ATOMIC_RELAXED))
+			;
+	}
+}
+
+/*
+ *  top_batch_task
+ *  Compares the query of a top-k scan with the files of one batch of a scan_plan, in full (runs
+ *  on a pool worker)
+ */
+void top_batch_task(void* ctx, int index, int worker)
+{
+	top_job* job = ctx;
+	int counts[MATCH_BATCH];
+	int num;
+	int first = scan_batch(&job->plan, index, counts, &num);
+	int compared = 0;
+	for (int i = 0; i < num; i++)
+	{
+		store_record* record = store_get_record(&store, first + i);
+		if ((record->flags & STORE_FLAG_DELETED) || first + i == job->self)
+			continue;
+		compared++;
+
+		// files that couldn't be read aren't listed, like in a one-vs-all scan
+		if (!(record->flags & STORE_FLAG_MISSING))
+			topk_push(&job->heaps[worker], first + i, counts[i]);
+	}
+	top_progress(job, compared);
+}
+
+/*
+ *  top_progress
+ *  Counts files a top-k scan is done with and prints how far it is, every MATCH_BATCH files and
+ *  at the end (whoever gets the lock prints, nobody waits for it)
+ */
+void top_progress(top_job* job, int compared)
+{
+	int done = __atomic_add_fetch(&job->progress, compared, __ATOMIC_RELAXED);
+	if (!job->show_progress || compared == 0)
+		return;
+	if (done / MATCH_BATCH == (done - compared) / MATCH_BATCH && done != job->total)
+		return;
+	if (pthread_mutex_trylock(&job->print_lock) == 0)
+	{
+		printf("\rComparing files (%d/%d)", done, job->total);
+		fflush(stdout);
+		pthread_mutex_unlock(&job->print_lock);
+	}
+}
+
+/*
+ *  scan_plan_init
+ *  Cuts a one-vs-all scan of the store into batches, laying the query out like the signature
+ *  matrix (in memory from `scratch`) when there is one
+ */
+void scan_plan_init(scan_plan* plan, const uint64_t* query, arena* scratch)
+{
+	plan->query = query;
+	plan->lanes = NULL;
+	plan->blocks = 0;
+	plan->tail = 0;
+	plan->count = store_count(&store);
+	if (matrix.header != NULL)
+	{
+		void* lanes = arena_alloc(scratch, PERMUTATIONS * matrix.header->lane);
+		matrix_query(&matrix, query, lanes);
+		plan->lanes = lanes;
+		plan->blocks = matrix_blocks(&matrix);
+		plan->tail = matrix.header->count;
+	}
+	plan->batches = plan->blocks + (plan->count - plan->tail + MATCH_BATCH - 1) / MATCH_BATCH;
+}
 
-		// reset circle
-		for (int i = 0; i < SHINGLE_LENGTH; i++)
+/*
+ *  scan_batch
+ *  Writes the matching slots of the query and every file of the index-th batch of a scan to
+ *  `counts` (counted like count_matches() does), returns the first file and sets `num`
+ */
+int scan_batch(const scan_plan* plan, int index, int* counts, int* num)
+{
+	STATS_MARK(start);
+	int first;
+	if (index < plan->blocks)
+	{
+		// a block of the matrix (b-bit matches include the unused slots, like the store's)
+		first = index * MATRIX_BLOCK;
+		*num = (plan->tail - first < MATRIX_BLOCK) ? plan->tail - first : MATRIX_BLOCK;
+		matrix_counts(&matrix, index, plan->lanes, counts);
+		if (signature_bits != BBIT_FULL)
 		{
-			free(circle[i]);
-			circle_lens[i] = 0;
+			int padding = bbit_words(PERMUTATIONS, signature_bits) * (64 / signature_bits) - PERMUTATIONS;
+			for (int i = 0; i < *num; i++)
+				counts[i] += padding;
 		}
-		circle_index = 0;
+	}
+	else
+	{
+		// signatures in the store
+		first = plan->tail + (index - plan->blocks) * MATCH_BATCH;
+		*num = (plan->count - first < MATCH_BATCH) ? plan->count - first : MATCH_BATCH;
+		match_count_many(plan->query, store_signature(&store, first), store.header->record_size, *num, PERMUTATIONS,
+		                 signature_bits, counts);
+	}
+	STATS_SPAN(STAGE_COMPARE, start);
+	return first;
+}
 
-		// permute and compare file similarities
-		results[i] = permute_and_compare(file_a, f1_shingles_count, f1_shingles, 
-				            			 file_b, f2_shingles_count, f2_shingles);
+/*
+ *  scan_task
+ *  Compares the query of a one-vs-all scan with the files of one batch (runs on a pool worker)
+ */
+void scan_task(void* ctx, int index, int worker)
+{
+	scan_job* job = ctx;
 
-		// clean up
-		free(file_b);
-		free(file_2);
-		fclose(file_2_fp);
-		fseek(file_1_fp, 0, SEEK_SET);   // reset first file position
-	}
+	// the whole batch in one go, deleted and unreadable files are skipped afterwards
+	int counts[MATCH_BATCH];
+	int num;
+	int first = scan_batch(&job->plan, index, counts, &num);
 
-	// print results
-	printf("\n");
-	for (int i = 0; i < num_files; i++)
+	int compared = 0;
+	for (int i = 0; i < num; i++)
 	{
-		// skip same file
-		if (strcmp(file_a, files[i]) == 0)
+		store_record* record = store_get_record(&store, first + i);
+		if ((record->flags & STORE_FLAG_DELETED) || first + i == job->self)
+			continue;
+		compared++;
+		if (record->flags & STORE_FLAG_MISSING)
 			continue;
 
-		// print file and space
-		printf("File: %s", files[i]);
-		int file_len = strlen(files[i]);
-		int len_to_print = 15 - file_len;
-		for (int j = 0; j < len_to_print; j++)
-			printf(" ");
+		// keep the result in this worker's own buffer
+		scan_buffer* buffer = &job->buffers[worker];
+		if (buffer->blocks == NULL || buffer->blocks->len == SCAN_BLOCK)
+		{
+			scan_block* block = arena_alloc(&buffer->scratch, sizeof(scan_block));
+			block->next = buffer->blocks;
+			block->len = 0;
+			buffer->blocks = block;
+		}
+		scan_block* block = buffer->blocks;
+		block->docs[block->len] = first + i;
+		block->scores[block->len++] = signature_resemblance(counts[i]);
+	}
+
+	// progress (whoever gets the lock prints, nobody waits for it)
+	int done = __atomic_add_fetch(&job->progress, compared, __ATOMIC_RELAXED);
+	if (job->show_progress && pthread_mutex_trylock(&job->print_lock) == 0)
+	{
+		printf("\rComparing files (%d/%d)", done, job->total);
+		fflush(stdout);
+		pthread_mutex_unlock(&job->print_lock);
+	}
+}
 
-		// print hashes
-		printf("[");
-		int percent = results[i] * 100;
-		int hashes = percent / 10;
-		int j;
-		for (j = 0; j < 10; j++)
+/*
+ *  print_result
+ *  Prints a file and its similarity as a bar
+ */
+void print_result(const char* file, float result)
+{
+	// print file and space
+	printf("File: %s", file);
+	int file_len = strlen(file);
+	int len_to_print = 15 - file_len;
+	for (int j = 0; j < len_to_print; j++)
+		printf(" ");
+
+	// print hashes
+	printf("[");
+	int percent = result * 100;
+	int hashes = percent / 10;
+	int j;
+	for (j = 0; j < 10; j++)
+	{
+		if (hashes > 0)
 		{
-			if (hashes > 0)
-			{
-				printf("#");
-				hashes--;
-			}
-			else
-				printf(" ");
+			printf("#");
+			hashes--;
 		}
-		printf("]    (%d/%d)\n", (percent / 10), 10);
+		else
+			printf(" ");
 	}
-	printf("\n");
+	printf("]    (%d/%d)\n", (percent / 10), 10);
+}
 
-	// clean up
-	for (int i = 0; i < num_files; i++)
-		free(files[i]);
-	free(files);
-	free(file_a);
-	free(file_1);
-	free(results);
+/*
+ *  doc_path
+ *  Where a query's file is read from: a file of the database is where the catalog has it (in db/
+ *  if it isn't catalogued yet), an absolute path is read as it is and `-` is standard input
+ */
+void doc_path(const char* file, char* path, size_t size)
+{
+	int id;
+	if (file[0] == '/' || strcmp(file, "-") == 0)
+		snprintf(path, size, "%s", file);
+	else if ((id = catalog_find(&catalog, file)) >= 0)
+		snprintf(path, size, "%s", catalog_path(&catalog, id));
+	else
+		snprintf(path, size, "%s/%s", CATALOG_DIR, file);
 }
 
 /*
- *  permute_and_compare
- *  Permuates and compares two sets of numbers, then returns the result (similarity)
+ *  find_file
+ *  Finds a file of the database in the store, returns its record or -1 if it isn't stored (the
+ *  catalog's name lookups turn away anything else before the store is looked at)
  */
-float permute_and_compare(char* file_1, int set_1_len, uint64_t* set_1,
-         			     char* file_2, int set_2_len, uint64_t* set_2)
+int find_file(const char* file)
 {
-	// make sure inputs are valid
-	assert(file_1 != NULL);
-	assert(file_2 != NULL);
-	assert(set_1 != NULL);
-	assert(set_2 != NULL);
+	if (catalog.header != NULL && catalog_find(&catalog, file) < 0)
+		return -1;
+	return store_find(&store, file);
+}
 
-	// 2D arrays
-	uint64_t** p_set_1 = malloc(set_1_len * sizeof(uint64_t*));
-	uint64_t** p_set_2 = malloc(set_2_len * sizeof(uint64_t*));
-	for (int i = 0; i < set_1_len; i++)
+/*
+ *  get_signature
+ *  Gets the signature of a file, straight from the store if it's the `index`-th record (see
+ *  find_file(), -1 if it isn't stored), otherwise from the signature cache or by shingling it
+ *  into memory from `scratch` (returns NULL if the file can't be opened)
+ */
+const uint64_t* get_signature(const char* file, int index, arena* scratch)
+{
+	if (index >= 0 && !(store_get_record(&store, index)->flags & STORE_FLAG_MISSING))
+		return store_signature(&store, index);
+
+	// not in the database, shingle it (standard input can only be read once)
+	char path[PATH_MAX];
+	doc_path(file, path, sizeof(path));
+	if (strcmp(path, "-") == 0 && !stdin_document)
+		return NULL;
+	if (strcmp(path, "-") == 0)
+		stdin_document = false;
+	uint64_t* buf = arena_alloc(scratch, PERMUTATIONS * sizeof(uint64_t));
+	if (strcmp(path, "-") == 0)
 	{
-		uint64_t* array = malloc(PERMUTATIONS * sizeof(uint64_t));
-		p_set_1[i] = array;
+		if (sign_file(path, seed, buf, scratch) < 0)
+			return NULL;
+		pack_signature(buf);
+		return buf;
 	}
-	for (int i = 0; i < set_2_len; i++)
+
+	// a document seen before (with the same contents and parameters) comes from the cache
+	sigcache_key key = {0, seed, PERMUTATIONS, shingle_length, engine, 0};
+	struct stat before;
+	struct stat after;
+	if (catalog_hash_file(path, &key.hash, &before) != 0)
+		return NULL;
+	if (sigcache_get(&sigcache, &key, buf) == SIGCACHE_MISS)
 	{
-		uint64_t* array = malloc(PERMUTATIONS * sizeof(uint64_t));
-		p_set_2[i] = array;
+		if (sign_file(path, seed, buf, scratch) < 0)
+			return NULL;
+
+		// it's only cached if it didn't change while it was being signed
+		if (stat(path, &after) == 0 && catalog_stat_ns(&after) == catalog_stat_ns(&before) &&
+		    after.st_size == before.st_size)
+			sigcache_put(&sigcache, &key, buf);
 	}
+	pack_signature(buf);
+	return buf;
+}
+
+/*
+ *  shingle_set
+ *  Shingles a file in the database into its sorted, distinct shingle hashes, allocated from
+ *  `scratch` (returns how many there are, or -1 if the file can't be opened)
+ */
+long shingle_set(const char* file, uint64_t** set, arena* scratch)
+{
+	char path[PATH_MAX];
+	doc_path(file, path, sizeof(path));
+	doc_map doc;
+	if (doc_map_open(&doc, path) != 0)
+		return -1;
+	long len = shingle_text(doc.data, doc.size, set, scratch);
+	doc_map_close(&doc);
+	return len;
+}
 
-	// generate 100 random numbers 
-	for (int i = 0; i < set_1_len; i++)
+/*
+ *  shingle_text
+ *  Shingles text into its sorted, distinct shingle hashes, allocated from `scratch` (returns how
+ *  many there are)
+ */
+long shingle_text(const char* text, size_t size, uint64_t** set, arena* scratch)
+{
+	// words are separated by at least one character, so that's the most shingles there can be
+	size_t most = size / 2 + 1;
+	uint64_t* shingles = arena_alloc(scratch, most * sizeof(uint64_t));
+	long len = 0;
+	STATS_FRAME(frame);
+	STATS_MARK(lap);
+	shingler sh;
+	shingler_init(&sh, shingle_length, seed);
+	tokenizer tok;
+	tokenizer_init(&tok, text, size);
+	const char* word;
+	int word_len;
+	uint64_t shingle;
+	while (tokenizer_next(&tok, &word, &word_len))
 	{
-		// use set 1 number as a seed
-		srand(set_1[i]);
-		for (int j = 0; j < PERMUTATIONS; j++)
-			p_set_1[i][j] = rand();
+		STATS_LAP(frame, STAGE_TOKENIZE, lap);
+		STATS_COUNT(frame, COUNTER_WORDS, 1);
+		if (shingler_push(&sh, word, word_len, &shingle))
+			shingles[len++] = shingle;
+		STATS_LAP(frame, STAGE_HASH, lap);
 	}
-	for (int i = 0; i < set_2_len; i++)
+	STATS_LAP(frame, STAGE_TOKENIZE, lap);
+	STATS_COUNT(frame, COUNTER_SHINGLES, len);
+	STATS_FLUSH(frame);
+
+	// sort and drop repeats (the sort's scratch space is only needed until then)
+	arena_mark mark = arena_save(scratch);
+	radix_sort_u64(shingles, arena_alloc(scratch, most * sizeof(uint64_t)), len);
+	arena_restore(scratch, mark);
+	*set = shingles;
+	return dedupe_sorted(shingles, len);
+}
+
+/*
+ *  sign_file
+ *  Shingles a file straight into `signature`: files that aren't too big are mapped, anything else
+ *  (standard input as `-`, a pipe, a huge dump) is streamed through a fixed buffer (returns the
+ *  number of shingles, or -1 if the file can't be read)
+ */
+long sign_file(const char* path, uint64_t hash_seed, uint64_t* signature, arena* scratch)
+{
+	bool is_stdin = strcmp(path, "-") == 0;
+	struct stat st;
+	if (!is_stdin && stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= STREAM_MAP_MAX)
 	{
-		// use set 2 number as a seed
-		srand(set_2[i]);
-		for (int j = 0; j < PERMUTATIONS; j++)
-			p_set_2[i][j] = rand();
+		doc_map doc;
+		if (doc_map_open(&doc, path) != 0)
+			return -1;
+		long count = sign_text(doc.data, doc.size, hash_seed, signature, scratch);
+		doc_map_close(&doc);
+		return count;
 	}
 
-	// compute resemblance
-	int matching_mins = 0;
-	int calculated_mins = 0;
-	uint64_t set_1_min;
-	uint64_t set_2_min;
-	for (int i = 0; i < PERMUTATIONS; i++)
-	{
-		// min of permutated set 1
-		for (int j = 0; j < set_1_len; j++)
-			set_1_min = (j == 0) ? p_set_1[j][i] : ((set_1_min < p_set_1[j][i]) ? set_1_min : p_set_1[j][i]);
+	// stream it
+	int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	arena_mark mark = arena_save(scratch);
+	doc_stream stream;
+	doc_stream_fd(&stream, fd, arena_alloc(scratch, STREAM_CHUNK), STREAM_CHUNK);
+	long count = sign_stream(&stream, hash_seed, signature, scratch);
+	arena_restore(scratch, mark);
+	if (!is_stdin)
+		close(fd);
+	return stream.failed ? -1 : count;
+}
 
-		// min of permutated set 2
-		for (int j = 0; j < set_2_len; j++)
-			set_2_min = (j == 0) ? p_set_2[j][i] : ((set_2_min < p_set_2[j][i]) ? set_2_min : p_set_2[j][i]);
+/*
+ *  sign_text
+ *  Shingles text that's all in memory straight into `signature` (returns the number of shingles)
+ */
+long sign_text(const char* text, size_t size, uint64_t hash_seed, uint64_t* signature, arena* scratch)
+{
+	doc_stream stream;
+	doc_stream_text(&stream, text, size);
+	return sign_stream(&stream, hash_seed, signature, scratch);
+}
 
-		// see if mins match
-		calculated_mins++;
-		if (set_1_min == set_2_min)
-			matching_mins += 1;
+/*
+ *  sign_stream
+ *  Shingles a stream into 64-bit numbers using `hash_seed` and folds each one into `signature`
+ *  as it's produced, so memory doesn't grow with the input (returns the number of shingles)
+ */
+long sign_stream(doc_stream* stream, uint64_t hash_seed, uint64_t* signature, arena* scratch)
+{
+	// the signature so far
+	signature_init(signature);
+	long count = 0;
+	STATS_FRAME(frame);
+	STATS_MARK(lap);
+
+	// hash every shingle of the text as its last word comes in (the window carries on across chunks)
+	shingler sh;
+	shingler_init(&sh, shingle_length, hash_seed);
+	const char* word;
+	int word_len;
+	uint64_t shingle;
+	while (doc_stream_next(stream, &word, &word_len))
+	{
+		STATS_LAP(frame, STAGE_TOKENIZE, lap);
+		STATS_COUNT(frame, COUNTER_WORDS, 1);
+		bool complete = shingler_push(&sh, word, word_len, &shingle);
+		STATS_LAP(frame, STAGE_HASH, lap);
+		if (complete)
+		{
+			// permute it into the signature
+			signature_add(signature, shingle);
+			count++;
+			STATS_LAP(frame, STAGE_PERMUTE, lap);
+		}
 	}
+	STATS_LAP(frame, STAGE_TOKENIZE, lap);
+	signature_finish(signature, scratch);
+	STATS_LAP(frame, STAGE_PERMUTE, lap);
+	STATS_COUNT(frame, COUNTER_SHINGLES, count);
+	STATS_FLUSH(frame);
+	return count;
+}
 
-	// calculate resemblance
-	float resemblance = (float)matching_mins / (float)PERMUTATIONS;
+/*
+ *  signature_init
+ *  Starts an empty signature (an empty set has no minimums)
+ */
+void signature_init(uint64_t* signature)
+{
+	for (int i = 0; i < PERMUTATIONS; i++)
+		signature[i] = UINT64_MAX;
+}
 
-	// clean up
-	for (int i = 0; i < set_1_len; i++)
-		free(p_set_1[i]);
-	for (int i = 0; i < set_2_len; i++)
-		free(p_set_2[i]);
-	free(p_set_1);
-	free(p_set_2);
+/*
+ *  signature_add
+ *  Permutes one number and keeps the running minimum of every permutation (or of its bin, when
+ *  using one permutation hashing)
+ */
+void signature_add(uint64_t* signature, uint64_t shingle)
+{
+	if (engine == ENGINE_OPH)
+		oph_add(signature, PERMUTATIONS, shingle);
+	else
+		permutation_fold(&perm, shingle, signature);
+}
 
-	// return result
-	return resemblance;
+/*
+ *  signature_finish
+ *  Completes a signature once every shingle is in (fills the empty bins of one permutation hashing)
+ */
+void signature_finish(uint64_t* signature, arena* scratch)
+{
+	if (engine == ENGINE_OPH)
+	{
+		arena_mark mark = arena_save(scratch);
+		oph_densify(signature, PERMUTATIONS, seed, arena_alloc(scratch, PERMUTATIONS * sizeof(bool)));
+		arena_restore(scratch, mark);
+	}
 }
 
 /*
- *  get_next_word
- *  Gets the next word from a file
+ *  signature_fold
+ *  Folds a batch of shingles into a signature, one after the other
  */
-char* get_next_word(FILE* file)
+void signature_fold(uint64_t* signature, const uint64_t* shingles, int len)
 {
-	// get words while possible
-    char* word = malloc(BUFSIZ * BUFSIZ * sizeof(char));
-    int index = 0;
-    for (int c = fgetc(file); c != EOF; c = fgetc(file))
-    {
-        // allow only alphabetical characters and apostrophes or numbers
-        if (isalpha(c) || (c == '\'' && index > 0) || isdigit(c))
-        {
-            // append character to word
-            word[index] = c;
-            index++;
-        }
-
-        // we must have found a whole word
-        else if (index > 0)
-        {
-            // terminate current word
-            word[index] = '\0';
-
-            // return next word
-            return word;
-        }
-    }
+	for (int i = 0; i < len; i++)
+		signature_add(signature, shingles[i]);
+}
 
-    // no more words
-    return NULL;
+/*
+ *  pack_signature
+ *  Cuts a signature down to the bits the store keeps of every minimum, in place
+ */
+void pack_signature(uint64_t* signature)
+{
+	bbit_pack(signature, PERMUTATIONS, signature_bits);
 }
 
 /*
- * concatenate_circle
- * Concatenates all the words in a circular array
+ *  compare_signatures
+ *  Returns the fraction of permutations whose minimums match (the resemblance), corrected for
+ *  chance matches with b-bit signatures
  */
-char* concatenate_circle(int head, char** circle, int* circle_lens)     
+float compare_signatures(const uint64_t* sig_1, const uint64_t* sig_2)
 {
-	// get length of string needed
-	int len = 0;
-	for (int i = 0; i < SHINGLE_LENGTH; i++)
-		len += circle_lens[i];
+	return signature_resemblance(count_matches(sig_1, sig_2, 0));
+}
 
-	// make string
-	int trav = head;
-	int str_index = 0;
-	char* str = malloc(len * sizeof(char));
-	for (int i = 0; i < SHINGLE_LENGTH; i++)
+/*
+ *  count_matches
+ *  Number of slots two signatures agree on, compared MATCH_CHUNK slots at a time; returns -1
+ *  as soon as the slots left couldn't bring it up to `at_least`
+ */
+int count_matches(const uint64_t* sig_1, const uint64_t* sig_2, int at_least)
+{
+	STATS_MARK(start);
+	int matches = 0;
+	if (signature_bits != BBIT_FULL)
+	{
+		// whole words of packed slots (unused slots of the last word count as matching)
+		int words = bbit_words(PERMUTATIONS, signature_bits);
+		int per_word = 64 / signature_bits;
+		int chunk = MATCH_CHUNK / per_word;
+		for (int w = 0; w < words && matches >= 0; w += chunk)
+		{
+			int len = (words - w < chunk) ? words - w : chunk;
+			matches += bbit_matches(sig_1 + w, sig_2 + w, len, signature_bits);
+			if (matches + (words - w - len) * per_word < at_least)
+				matches = -1;
+		}
+	}
+	else
 	{
-		strncpy(str + str_index, circle[trav], circle_lens[trav]);
-		str_index += circle_lens[trav];
-		trav = (trav + 1) % SHINGLE_LENGTH;
+		for (int i = 0; i < PERMUTATIONS && matches >= 0; i += MATCH_CHUNK)
+		{
+			int end = (i + MATCH_CHUNK < PERMUTATIONS) ? i + MATCH_CHUNK : PERMUTATIONS;
+			matches += match_count(sig_1 + i, sig_2 + i, end - i);
+			if (matches + (PERMUTATIONS - end) < at_least)
+				matches = -1;
+		}
 	}
-	return str;
+	STATS_SPAN(STAGE_COMPARE, start);
+	return matches;
+}
+
+/*
+ *  signature_resemblance
+ *  Estimated resemblance of two signatures agreeing on `matches` slots
+ */
+float signature_resemblance(int matches)
+{
+	if (signature_bits != BBIT_FULL)
+		return bbit_resemblance(matches, PERMUTATIONS, signature_bits);
+	return (float)matches / (float)PERMUTATIONS;
 }
 
 /*
@@ -954,7 +2871,8 @@ uint64_t MurmurHash64A (const void* key, int len, uint64_t seed)
 
   while(data != end)
   {
-    uint64_t k = *data++;
+    uint64_t k;
+    memcpy(&k, data++, sizeof(k));  // words are views into a mapping, so this can be unaligned
 
     k *= m; 
     k ^= k >> r; 